@@ -0,0 +1,343 @@
+/*
+ * TINYEXPRX - Benchmarks
+ *
+ * Measures compile, parse and optimize time per KB of input and evaluation
+ * time per call over a few expression shapes, reported as JSON or CSV.
+ *
+ *     cc -O2 -o benchmark benchmark.c -lm
+ *     ./benchmark [--csv] [--seconds S]
+ *
+ * The library source is included directly so that parsing and optimization
+ * can be timed on their own. Define BENCH_TINYEXPR and add tinyexpr.c from
+ * upstream TinyExpr to the command line to time its evaluation on the same inputs.
+ *
+ */
+
+#include "tinyexprx.c"
+#include <stdarg.h>
+#include <time.h>
+
+#if defined(BENCH_TINYEXPR)
+#include "tinyexpr.h"
+#endif
+
+
+#define BENCH_VARIABLES 64
+
+static d_cx values[BENCH_VARIABLES];
+static double real_values[BENCH_VARIABLES];
+static char names[BENCH_VARIABLES][8];
+static double scale = 0.5;
+
+static d_cx scaled(void *context, d_cx a) {return *(double*)context * a;}
+static d_cx blend(void *context, d_cx a, d_cx b) {return *(double*)context * a + (1 - *(double*)context) * b;}
+
+#if defined(BENCH_TINYEXPR)
+static double te_scaled(void *context, double a) {return *(double*)context * a;}
+static double te_blend(void *context, double a, double b) {return *(double*)context * a + (1 - *(double*)context) * b;}
+#endif
+
+
+static double now(void) {
+#if defined(CLOCK_MONOTONIC)
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + 1e-9 * t.tv_nsec;
+#else
+    return (double)clock() / CLOCKS_PER_SEC;
+#endif
+}
+
+
+/* Growable text for building the inputs. */
+typedef struct text {
+    char *data;
+    size_t length;
+    size_t capacity;
+} text;
+
+static void append(text *t, const char *format, ...) {
+    va_list args;
+    for (;;) {
+        const size_t room = t->capacity - t->length;
+        va_start(args, format);
+        const int n = vsnprintf(t->data ? t->data + t->length : 0, room, format, args);
+        va_end(args);
+        if (n >= 0 && (size_t)n < room) {
+            t->length += n;
+            return;
+        }
+        t->capacity = 2 * t->capacity + 1024 + (size_t)n;
+        t->data = realloc(t->data, t->capacity);
+        if (!t->data) exit(1);
+    }
+}
+
+
+typedef struct shape {
+    const char *name;
+    void (*build)(text *t);
+} shape;
+
+
+static void deep_chain(text *t) {
+    int i;
+    for (i = 0; i < 200; ++i) append(t, "(");
+    append(t, "x0");
+    for (i = 0; i < 200; ++i) append(t, i % 2 ? "*x1-0.25)" : "+0.5)/1.5");
+}
+
+static void wide_sum(text *t) {
+    int i;
+    append(t, "x0");
+    for (i = 1; i < 1000; ++i) append(t, "+%d.5*x%d", i % 7, i % 4);
+}
+
+static void transcendental(text *t) {
+    int i;
+    append(t, "0");
+    for (i = 0; i < 20; ++i) append(t, "+exp(x%d*0.1)^x%d+(x%d+1)^0.5", i % 3, (i + 1) % 3, i % 3);
+}
+
+static void variable_heavy(text *t) {
+    int i;
+    append(t, "x0*x1");
+    for (i = 2; i < BENCH_VARIABLES; ++i) append(t, "%sx%d*x%d", i % 3 ? "+" : "-", i, (i * 7) % BENCH_VARIABLES);
+}
+
+static void closures(text *t) {
+    int i;
+    append(t, "x0");
+    for (i = 0; i < 50; ++i) append(t, "+blend(scaled(x%d), x%d)", i % 5, (i + 2) % 5);
+}
+
+static const shape shapes[] = {
+    {"deep_chain", deep_chain},
+    {"wide_sum", wide_sum},
+    {"transcendental", transcendental},
+    {"variable_heavy", variable_heavy},
+    {"closures", closures},
+};
+
+
+typedef struct result {
+    size_t bytes;
+    int nodes;
+    double compile_ns_per_kb;
+    double parse_ns_per_kb;
+    double optimize_ns;
+    double eval_ns;
+    double program_ns;
+    double jit_ns;              /* NAN where there is no native code generator. */
+    double tinyexpr_eval_ns;    /* NAN unless built with BENCH_TINYEXPR. */
+} result;
+
+
+static tx_variable variables[BENCH_VARIABLES + 2];
+
+static tx_expr *parse_only(const char *expression) {
+    /* The first stage of compile(). */
+    state s;
+    memset(&s, 0, sizeof(s));
+    s.start = s.next = expression;
+    s.lookup = variables;
+    s.lookup_len = BENCH_VARIABLES + 2;
+    tx_next_token(&s);
+    tx_expr *root = list(&s);
+    if (root && s.type != TOK_END) {
+        tx_free(root);
+        return 0;
+    }
+    return root;
+}
+
+
+static volatile double sink;
+
+static void measure(const shape *sh, double seconds, result *r) {
+    text t = {0, 0, 0};
+    sh->build(&t);
+    const double kb = t.length / 1024.0;
+    double start, elapsed;
+    long n;
+    int err;
+
+    memset(r, 0, sizeof(*r));
+    r->bytes = t.length;
+    r->tinyexpr_eval_ns = NAN;
+
+    tx_expr *expr = tx_compile(t.data, variables, BENCH_VARIABLES + 2, &err);
+    if (!expr) {
+        fprintf(stderr, "%s: error at %d\n", sh->name, err);
+        exit(1);
+    }
+    r->nodes = node_count(expr);
+
+    for (n = 0, start = now(); (elapsed = now() - start) < seconds || !n; ++n) {
+        tx_free(tx_compile(t.data, variables, BENCH_VARIABLES + 2, &err));
+    }
+    r->compile_ns_per_kb = 1e9 * elapsed / n / kb;
+
+    double optimizing = 0;
+    for (n = 0, start = now(); (elapsed = now() - start) < seconds || !n; ++n) {
+        tx_expr *root = parse_only(t.data);
+        const double before = now();
+        optimize(root, 0);
+        optimizing += now() - before;
+        tx_free(root);
+    }
+    r->parse_ns_per_kb = 1e9 * (elapsed - optimizing) / n / kb;
+    r->optimize_ns = 1e9 * optimizing / n;
+
+    /* Evaluation moves one variable so that nothing can be hoisted out of the loop. */
+    for (n = 0, start = now(); (elapsed = now() - start) < seconds || !n; ) {
+        int k;
+        for (k = 0; k < 1000; ++k, ++n) {
+            values[0] = 0.5 + 1e-6 * k;
+            sink += creal(tx_eval(expr));
+        }
+    }
+    r->eval_ns = 1e9 * elapsed / n;
+
+    tx_program *program = tx_compile_program(expr);
+    for (n = 0, start = now(); (elapsed = now() - start) < seconds || !n; ) {
+        int k;
+        for (k = 0; k < 1000; ++k, ++n) {
+            values[0] = 0.5 + 1e-6 * k;
+            sink += creal(tx_program_eval(program));
+        }
+    }
+    r->program_ns = 1e9 * elapsed / n;
+    tx_program_free(program);
+
+    tx_jit *jit = tx_jit_compile(expr, 0, 0);
+    for (n = 0, start = now(); (elapsed = now() - start) < seconds || !n; ) {
+        int k;
+        for (k = 0; k < 1000; ++k, ++n) {
+            values[0] = 0.5 + 1e-6 * k;
+            sink += creal(tx_jit_eval(jit, 0));
+        }
+    }
+    r->jit_ns = tx_jit_function(jit) ? 1e9 * elapsed / n : NAN;
+    tx_jit_free(jit);
+
+#if defined(BENCH_TINYEXPR)
+    {
+        te_variable te_vars[BENCH_VARIABLES + 2];
+        int i;
+        for (i = 0; i < BENCH_VARIABLES; ++i) {
+            te_vars[i].name = names[i];
+            te_vars[i].address = real_values + i;
+            te_vars[i].type = TE_VARIABLE;
+            te_vars[i].context = 0;
+        }
+        te_vars[i].name = "scaled";
+        te_vars[i].address = te_scaled;
+        te_vars[i].type = TE_CLOSURE1;
+        te_vars[i].context = &scale;
+        ++i;
+        te_vars[i].name = "blend";
+        te_vars[i].address = te_blend;
+        te_vars[i].type = TE_CLOSURE2;
+        te_vars[i].context = &scale;
+
+        te_expr *te = te_compile(t.data, te_vars, BENCH_VARIABLES + 2, &err);
+        if (te) {
+            for (n = 0, start = now(); (elapsed = now() - start) < seconds || !n; ) {
+                int k;
+                for (k = 0; k < 1000; ++k, ++n) {
+                    real_values[0] = 0.5 + 1e-6 * k;
+                    sink += te_eval(te);
+                }
+            }
+            r->tinyexpr_eval_ns = 1e9 * elapsed / n;
+            te_free(te);
+        }
+    }
+#endif
+
+    tx_free(expr);
+    free(t.data);
+}
+
+
+/* Times not taken print as null in JSON and as an empty field in CSV. */
+static void print_time(double ns, int csv) {
+    if (isnan(ns)) {
+        if (!csv) printf("null");
+    } else {
+        printf("%.2f", ns);
+    }
+}
+
+
+int main(int argc, char *argv[]) {
+    const int count = sizeof(shapes) / sizeof(shape);
+    double seconds = 0.2;
+    int csv = 0;
+    int i;
+
+    for (i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--csv") == 0) {
+            csv = 1;
+        } else if (strcmp(argv[i], "--seconds") == 0 && i + 1 < argc) {
+            seconds = atof(argv[++i]);
+            if (!(seconds > 0)) {
+                fprintf(stderr, "%s: --seconds must be positive\n", argv[0]);
+                return 1;
+            }
+        } else {
+            fprintf(stderr, "usage: %s [--csv] [--seconds S]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    for (i = 0; i < BENCH_VARIABLES; ++i) {
+        snprintf(names[i], sizeof(names[i]), "x%d", i);
+        values[i] = real_values[i] = 0.5 + 0.01 * i;
+        variables[i].name = names[i];
+        variables[i].address = values + i;
+        variables[i].type = TX_VARIABLE;
+        variables[i].context = 0;
+    }
+    variables[i].name = "scaled";
+    variables[i].address = scaled;
+    variables[i].type = TX_CLOSURE1;
+    variables[i].context = &scale;
+    ++i;
+    variables[i].name = "blend";
+    variables[i].address = blend;
+    variables[i].type = TX_CLOSURE2;
+    variables[i].context = &scale;
+
+    if (csv) {
+        printf("shape,bytes,nodes,compile_ns_per_kb,parse_ns_per_kb,optimize_ns,eval_ns,program_ns,jit_ns,tinyexpr_eval_ns\n");
+    } else {
+        printf("[\n");
+    }
+
+    for (i = 0; i < count; ++i) {
+        result r;
+        measure(shapes + i, seconds, &r);
+        if (csv) {
+            printf("%s,%zu,%d,%.1f,%.1f,%.1f,%.2f,%.2f,", shapes[i].name, r.bytes, r.nodes,
+                   r.compile_ns_per_kb, r.parse_ns_per_kb, r.optimize_ns, r.eval_ns, r.program_ns);
+            print_time(r.jit_ns, csv);
+            printf(",");
+            print_time(r.tinyexpr_eval_ns, csv);
+            printf("\n");
+        } else {
+            printf("  {\"shape\": \"%s\", \"bytes\": %zu, \"nodes\": %d, \"compile_ns_per_kb\": %.1f, "
+                   "\"parse_ns_per_kb\": %.1f, \"optimize_ns\": %.1f, \"eval_ns\": %.2f, \"program_ns\": %.2f, "
+                   "\"jit_ns\": ", shapes[i].name, r.bytes, r.nodes,
+                   r.compile_ns_per_kb, r.parse_ns_per_kb, r.optimize_ns, r.eval_ns, r.program_ns);
+            print_time(r.jit_ns, csv);
+            printf(", \"tinyexpr_eval_ns\": ");
+            print_time(r.tinyexpr_eval_ns, csv);
+            printf("}%s\n", i + 1 < count ? "," : "");
+        }
+    }
+
+    if (!csv) printf("]\n");
+    return 0;
+}
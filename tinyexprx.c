@@ -28,12 +28,35 @@ A couple of changes are fundamental changes are implemented in TinyExprX compare
 // Noe: In his parser, a^b^c = (a^b)^c and -a^b = (-a)^b
 // log is natural as it is common in complex analysis
 
+/* Anonymous mappings for the JIT and sysconf for the thread backends. */
+#if (defined(__unix__) || defined(__APPLE__)) && !defined(_DEFAULT_SOURCE)
+#define _DEFAULT_SOURCE
+#endif
+
 #include "tinyexprx.h"
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 #include <complex.h>
 #include <ctype.h>
+#include <math.h>
+#include <float.h>
+#include <stdint.h>
+#include <stdarg.h>
+
+#if defined(TX_USE_PTHREADS)
+#include <pthread.h>
+#include <unistd.h>
+#elif defined(TX_USE_C11_THREADS)
+#include <threads.h>
+#if defined(__unix__) || defined(__APPLE__)
+#include <unistd.h>
+#endif
+#endif
+
+#if defined(TX_ENABLE_PROFILE)
+#include <time.h>
+#endif
 
 #ifndef NAN
 #define NAN (0.0/0.0)
@@ -54,34 +77,191 @@ enum {
 
 enum {TX_CONSTANT = 1};
 
+/* The sum, prod and iterate keywords. Below TX_FUNCTION0, so that TYPE_MASK keeps it. */
+enum {TOK_LOOP = 2};
+
+
+/* Loops. The body is kept by the loop rather than as a child of the node, and
+ * reads its loop variable and running powers through placeholder addresses
+ * that are only ever compared, one row per nesting depth. */
+#define LOOP_DEPTH 8
+#define LOOP_POWERS 4
+#define LOOP_MAX_TRIPS 2147483648.0
+
+enum {LOOP_SUM, LOOP_PROD, LOOP_ITERATE};
+
+typedef struct loop {
+    int kind;
+    int depth;
+    tx_expr *body;
+    int powers;
+    tx_expr *bases[LOOP_POWERS];    /* base^k, kept as a running product. */
+
+    /* While parsing the loop, its variable and the next scope out. */
+    const char *name;
+    int length;
+    struct loop *scope;
+} loop;
+
+static const d_cx loop_slots[LOOP_DEPTH][1 + LOOP_POWERS] = {{0}};
+
+static int is_loop_call(const void *function, int arity);
+static int is_loop(const tx_expr *n);
+static void loop_free(loop *l);
+static loop *loop_copy(const loop *l);
+
 
 typedef struct state {
     const char *start;
     const char *next;
+    const char *end;
     int type;
-    union {double value; const d_cx *bound; const void *function;};
+    union {double value; const d_cx *bound; const void *function; int keyword;};
     void *context;
 
     const tx_variable *lookup;
     int lookup_len;
+    const tx_symtab *symtab;
+
+    tx_arena *arena;
+    tx_compiler *compiler;      /* Owner of reusable parser scratch, if any. */
+    int flags;
+    loop *scope;                /* Innermost loop being parsed. */
 } state;
 
+static loop *loop_open(state *s);
+static void loop_discard(state *s, loop *l);
+static tx_expr *loop_close(state *s, loop *l, tx_expr *first, tx_expr *second, tx_expr *body);
+
 
 #define TYPE_MASK(TYPE) ((TYPE)&0x0000001F)
 
 #define IS_PURE(TYPE) (((TYPE) & TX_FLAG_PURE) != 0)
+#define IS_ARRAY(TYPE) (((TYPE) & TX_FLAG_ARRAY) != 0)
 #define IS_FUNCTION(TYPE) (((TYPE) & TX_FUNCTION0) != 0)
 #define IS_CLOSURE(TYPE) (((TYPE) & TX_CLOSURE0) != 0)
 #define ARITY(TYPE) ( ((TYPE) & (TX_FUNCTION0 | TX_CLOSURE0)) ? ((TYPE) & 0x00000007) : 0 )
-#define NEW_EXPR(type, ...) new_expr((type), (const tx_expr*[]){__VA_ARGS__})
+#define NEW_EXPR(arena, type, ...) new_expr((arena), (type), (const tx_expr*[]){__VA_ARGS__})
 #define CHECK_NULL(ptr, ...) if ((ptr) == NULL) { __VA_ARGS__; return NULL; }
 
-static tx_expr *new_expr(const int type, const tx_expr *parameters[]) {
+
+/* Allocation counters, shared by all threads. They cost an atomic add per */
+/* node, so they are only kept with TX_ENABLE_ALLOC_STATS. */
+#if defined(TX_ENABLE_ALLOC_STATS)
+static tx_alloc_stats alloc_stats;
+#if defined(__GNUC__)
+#define ALLOC_COUNT(field, n) __atomic_fetch_add(&alloc_stats.field, (size_t)(n), __ATOMIC_RELAXED)
+#define ALLOC_READ(field) __atomic_load_n(&alloc_stats.field, __ATOMIC_RELAXED)
+#define ALLOC_CLEAR(field) __atomic_store_n(&alloc_stats.field, 0, __ATOMIC_RELAXED)
+#else
+#define ALLOC_COUNT(field, n) (alloc_stats.field += (n))
+#define ALLOC_READ(field) (alloc_stats.field)
+#define ALLOC_CLEAR(field) (alloc_stats.field = 0)
+#endif
+#else
+#define ALLOC_COUNT(field, n) ((void)0)
+#endif
+
+
+/* Bump allocator. Memory is handed out from large blocks and only given */
+/* back when the whole arena is reset or freed. */
+#define ARENA_BLOCK 4096
+#define ARENA_ALIGN 16
+
+typedef struct arena_block {
+    struct arena_block *next;
+    size_t size;
+    size_t used;
+} arena_block;
+
+struct tx_arena {
+    arena_block *head;
+    arena_block *current;
+    size_t block_size;
+};
+
+#define BLOCK_HEADER ((sizeof(arena_block) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+#define BLOCK_DATA(b) ((char*)(b) + BLOCK_HEADER)
+
+
+tx_arena *tx_arena_create(size_t block_size) {
+    tx_arena *a = malloc(sizeof(tx_arena));
+    CHECK_NULL(a);
+
+    a->head = a->current = 0;
+    a->block_size = block_size ? block_size : ARENA_BLOCK;
+    return a;
+}
+
+
+static void *arena_alloc(tx_arena *a, size_t size) {
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+
+    /* Blocks after the current one are left over from before a reset. */
+    while (a->current && a->current->used + size > a->current->size && a->current->next) {
+        a->current = a->current->next;
+    }
+
+    arena_block *b = a->current;
+    if (!b || b->used + size > b->size) {
+        const size_t bsize = size > a->block_size ? size : a->block_size;
+        b = malloc(BLOCK_HEADER + bsize);
+        CHECK_NULL(b);
+        ALLOC_COUNT(arena_blocks, 1);
+        ALLOC_COUNT(arena_bytes, BLOCK_HEADER + bsize);
+
+        b->size = bsize;
+        b->used = 0;
+        if (a->current) {
+            b->next = a->current->next;
+            a->current->next = b;
+        } else {
+            b->next = a->head;
+            a->head = b;
+        }
+        a->current = b;
+    }
+
+    void *ret = BLOCK_DATA(b) + b->used;
+    b->used += size;
+    return ret;
+}
+
+
+void tx_arena_reset(tx_arena *a) {
+    arena_block *b;
+    if (!a) return;
+    for (b = a->head; b; b = b->next) b->used = 0;
+    a->current = a->head;
+}
+
+
+void tx_arena_free(tx_arena *a) {
+    if (!a) return;
+    while (a->head) {
+        arena_block *next = a->head->next;
+        free(a->head);
+        a->head = next;
+    }
+    free(a);
+}
+
+
+static int node_size(const int type) {
+    const int arity = ARITY(type);
+    return (sizeof(tx_expr) - sizeof(void*)) + sizeof(void*) * arity + (IS_CLOSURE(type) ? sizeof(void*) : 0);
+}
+
+
+static tx_expr *new_expr(tx_arena *arena, const int type, const tx_expr *parameters[]) {
     const int arity = ARITY(type);
     const int psize = sizeof(void*) * arity;
-    const int size = (sizeof(tx_expr) - sizeof(void*)) + psize + (IS_CLOSURE(type) ? sizeof(void*) : 0);
-    tx_expr *ret = malloc(size);
+    const int size = node_size(type);
+    tx_expr *ret = arena ? arena_alloc(arena, size) : malloc(size);
     CHECK_NULL(ret);
+    ALLOC_COUNT(nodes, 1);
+    ALLOC_COUNT(node_bytes, size);
+    if (!arena) ALLOC_COUNT(heap_nodes, 1);
 
     memset(ret, 0, size);
     if (arity && parameters) {
@@ -95,6 +275,7 @@ static tx_expr *new_expr(const int type, const tx_expr *parameters[]) {
 
 void tx_free_parameters(tx_expr *n) {
     if (!n) return;
+    if (is_loop(n)) loop_free(n->parameters[ARITY(n->type)]);
     switch (TYPE_MASK(n->type)) {
     case TX_FUNCTION6: case TX_CLOSURE6: tx_free(n->parameters[5]);     /* Falls through. */
     case TX_FUNCTION5: case TX_CLOSURE5: tx_free(n->parameters[4]);     /* Falls through. */
@@ -112,6 +293,17 @@ void tx_free(tx_expr *n) {
     free(n);
 }
 
+
+static void free_expr(tx_arena *arena, tx_expr *n) {
+    /* Arena nodes go away with their arena. */
+    if (!arena) tx_free(n);
+}
+
+
+static void free_parameters(tx_arena *arena, tx_expr *n) {
+    if (!arena) tx_free_parameters(n);
+}
+
 // all functions need to return complex
 static d_cx i(void) {return I;}
 static d_cx pi(void) {return 3.14159265358979323846;}
@@ -176,9 +368,93 @@ static const tx_variable *find_builtin(const char *name, int len) {
 }
 
 
+static unsigned hash_bytes(unsigned h, const void *p, size_t size) {
+    const unsigned char *c = p;
+    while (size--) h = (h ^ *c++) * 16777619u;
+    return h;
+}
+
+
+/* Symbol tables hash the names with open addressing, so lookups stay cheap */
+/* however many variables there are. */
+struct tx_symtab {
+    unsigned mask;
+    unsigned hash;
+    int count;
+    tx_variable *variables;
+    int *slots;
+};
+
+
+static int same_name(const char *name, int len, const char *other) {
+    return strncmp(name, other, len) == 0 && other[len] == '\0';
+}
+
+
+tx_symtab *tx_symtab_create(const tx_variable *variables, int var_count) {
+    tx_symtab *t = malloc(sizeof(tx_symtab));
+    CHECK_NULL(t);
+
+    unsigned size = 1;
+    while (size < 2u * (unsigned)var_count + 1) size *= 2;
+
+    t->mask = size - 1;
+    t->count = var_count;
+    t->variables = malloc(sizeof(tx_variable) * (var_count ? var_count : 1));
+    t->slots = malloc(sizeof(int) * size);
+    if (!t->variables || !t->slots) {
+        tx_symtab_free(t);
+        return NULL;
+    }
+
+    memset(t->slots, -1, sizeof(int) * size);
+    if (var_count) memcpy(t->variables, variables, sizeof(tx_variable) * var_count);
+
+    /* Fingerprint of the bindings, for caches keyed by table. */
+    t->hash = 2166136261u;
+
+    int i;
+    for (i = 0; i < var_count; ++i) {
+        const int len = strlen(variables[i].name);
+        t->hash = hash_bytes(t->hash, variables[i].name, len + 1);
+        t->hash = hash_bytes(t->hash, &variables[i].address, sizeof(void*));
+        t->hash = hash_bytes(t->hash, &variables[i].type, sizeof(int));
+        t->hash = hash_bytes(t->hash, &variables[i].context, sizeof(void*));
+
+        unsigned probe = hash_bytes(2166136261u, variables[i].name, len) & t->mask;
+
+        /* As with the plain array, the first of several equal names wins. */
+        while (t->slots[probe] >= 0 && !same_name(variables[i].name, len, variables[t->slots[probe]].name)) {
+            probe = (probe + 1) & t->mask;
+        }
+        if (t->slots[probe] < 0) t->slots[probe] = i;
+    }
+    return t;
+}
+
+
+void tx_symtab_free(tx_symtab *t) {
+    if (!t) return;
+    free(t->variables);
+    free(t->slots);
+    free(t);
+}
+
+
+static const tx_variable *symtab_find(const tx_symtab *t, const char *name, int len) {
+    unsigned probe = hash_bytes(2166136261u, name, len) & t->mask;
+    for (; t->slots[probe] >= 0; probe = (probe + 1) & t->mask) {
+        const tx_variable *var = t->variables + t->slots[probe];
+        if (same_name(name, len, var->name)) return var;
+    }
+    return 0;
+}
+
+
 static const tx_variable *find_lookup(const state *s, const char *name, int len) {
     int iters;
     const tx_variable *var;
+    if (s->symtab) return symtab_find(s->symtab, name, len);
     if (!s->lookup) return 0;
 
     for (var = s->lookup, iters = s->lookup_len; iters; ++var, --iters) {
@@ -196,6 +472,579 @@ static d_cx mul(d_cx a, d_cx b) {return a*b;}
 static d_cx divide(d_cx a, d_cx b) {return a/b;}
 static d_cx negate(d_cx a) {return -a;}
 static d_cx comma(d_cx a, d_cx b) {(void)a; return b;}
+static d_cx square(d_cx a) {return a*a;}
+
+static d_cx cx_make(double re, double im) {
+    /* Unlike re + im*I, keeps infinite parts as they are. */
+    d_cx c;
+    ((double*)&c)[0] = re;
+    ((double*)&c)[1] = im;
+    return c;
+}
+
+static d_cx ipow(d_cx a, d_cx b) {
+    /* Integer power by repeated squaring, b holds a small integer. */
+    int e = (int)creal(b);
+    const int negative = e < 0;
+    d_cx r = 1;
+    if (negative) e = -e;
+    while (e) {
+        if (e & 1) r *= a;
+        e >>= 1;
+        if (e) a *= a;
+    }
+    return negative ? 1 / r : r;
+}
+
+/* Fused where the hardware does it, so that the fallback costs no library call. */
+#if defined(FP_FAST_FMA)
+#define FMA(a, b, c) fma((a), (b), (c))
+#else
+#define FMA(a, b, c) ((a) * (b) + (c))
+#endif
+
+static d_cx cfma(d_cx a, d_cx b, d_cx c) {
+    /* a*b + c with each half of the product fused into the sum. NaN+NaNI results */
+    /* are redone with the C99 product, which recovers infinities. */
+    const double re = FMA(creal(a), creal(b), FMA(-cimag(a), cimag(b), creal(c)));
+    const double im = FMA(creal(a), cimag(b), FMA(cimag(a), creal(b), cimag(c)));
+    if (re != re && im != im) return a * b + c;
+    return cx_make(re, im);
+}
+
+
+/* Kernels for subtrees proven real. They read only the real parts and leave */
+/* the imaginary part zero. */
+static d_cx radd(d_cx a, d_cx b) {return creal(a) + creal(b);}
+static d_cx rsub(d_cx a, d_cx b) {return creal(a) - creal(b);}
+static d_cx rmul(d_cx a, d_cx b) {return creal(a) * creal(b);}
+static d_cx rdivide(d_cx a, d_cx b) {return creal(a) / creal(b);}
+static d_cx rnegate(d_cx a) {return -creal(a);}
+static d_cx rsquare(d_cx a) {return creal(a) * creal(a);}
+static d_cx rabs(d_cx a) {return fabs(creal(a));}
+static d_cx rsin(d_cx a) {return sin(creal(a));}
+static d_cx rcos(d_cx a) {return cos(creal(a));}
+static d_cx rtan(d_cx a) {return tan(creal(a));}
+static d_cx rsinh(d_cx a) {return sinh(creal(a));}
+static d_cx rcosh(d_cx a) {return cosh(creal(a));}
+static d_cx rtanh(d_cx a) {return tanh(creal(a));}
+static d_cx rexp(d_cx a) {return exp(creal(a));}
+static d_cx ratan(d_cx a) {return atan(creal(a));}
+static d_cx rasinh(d_cx a) {return asinh(creal(a));}
+static d_cx rfma(d_cx a, d_cx b, d_cx c) {return FMA(creal(a), creal(b), creal(c));}
+
+static d_cx ripow(d_cx a, d_cx b) {
+    int e = (int)creal(b);
+    const int negative = e < 0;
+    double x = creal(a), r = 1;
+    if (negative) e = -e;
+    while (e) {
+        if (e & 1) r *= x;
+        e >>= 1;
+        if (e) x *= x;
+    }
+    return negative ? 1 / r : r;
+}
+
+
+/* Fast approximations, swapped in for the built-ins by TX_FAST_MATH and
+ * TX_FAST_MATH_LOW. Each function is reduced onto a small interval and
+ * approximated there by a polynomial fitted at Chebyshev nodes; the LOW tier
+ * uses shorter polynomials. The reductions are branch free, so the same code
+ * is stamped out below for scalars and for every SIMD instruction set, and
+ * arguments outside the ranges they cover go to the library. */
+enum {FAST_EXP, FAST_LOG, FAST_POW, FAST_SIN, FAST_COS, FAST_TAN, FAST_SINH, FAST_COSH, FAST_TANH};
+
+#define FAST_EXP_MAX 708.0          /* exp stays normal. */
+#define FAST_SQUARE_MAX 350.0       /* Squares of cosh stay finite. */
+#define FAST_TRIG_MAX 0x1p19        /* Multiples of pi/2 are subtracted exactly. */
+
+#define FAST_ROUND 0x1.8p52
+#define FAST_LOG2E 0x1.71547652b82fep+0
+#define FAST_LN2_HI 0x1.62e42fee00000p-1
+#define FAST_LN2_LO 0x1.a39ef35793c76p-33
+#define FAST_2_PI 0x1.45f306dc9c883p-1
+#define FAST_PIO2_1 0x1.921fb54400000p+0
+#define FAST_PIO2_2 0x1.0b4611a600000p-34
+#define FAST_PIO2_3 0x1.3198a2e000000p-69
+#define FAST_PIO2_3T 0x1.b839a252049c1p-104
+#define FAST_TAN_PI_8 0x1.a827999fcef32p-2
+#define FAST_SQRT2 0x1.6a09e667f3bcdp+0
+#define FAST_PI 3.14159265358979323846
+#define FAST_PI_2 1.57079632679489661923
+#define FAST_PI_4 0.78539816339744830962
+
+/* Coefficients of the full tier, then of the LOW tier. */
+typedef struct fast_poly {
+    int n;
+    double c[8];
+} fast_poly;
+
+static const fast_poly fast_exp_poly[2] = {
+    /* (exp(r) - 1 - r) / r^2 on |r| <= log(2)/2. */
+    {8, {0x1.fffffffffe069p-2, 0x1.5555555554f97p-3, 0x1.55555565c559fp-5, 0x1.111111170ad56p-7,
+         0x1.6c166be75a859p-10, 0x1.a019c3721fb3ep-13, 0x1.a136b06babd51p-16, 0x1.72ad3ae3ed777p-19}},
+    {5, {0x1p-1, 0x1.5554dd04e58bep-3, 0x1.55551933893e6p-5, 0x1.120b616c43f75p-7, 0x1.6d10fc65baf1cp-10}}
+};
+
+static const fast_poly fast_sin_poly[2] = {
+    /* (sin(r) - r) / r^3 in r^2, on |r| <= pi/4. */
+    {5, {-0x1.555555555516bp-3, 0x1.1111110fd3d43p-7, -0x1.a019fd9b35ee5p-13, 0x1.71d9a9f41c5a9p-19,
+         -0x1.aa285788aaa42p-26}},
+    {3, {-0x1.555552a4a4a44p-3, 0x1.110c28a771a24p-7, -0x1.9ac9b03bb7fbbp-13}}
+};
+
+static const fast_poly fast_cos_poly[2] = {
+    /* (cos(r) - 1 + r^2/2) / r^4 in r^2, on |r| <= pi/4. */
+    {5, {0x1.5555555555437p-5, -0x1.6c16c16b614fcp-10, 0x1.a019ff53a6a1cp-16, -0x1.27e25f4bb4e6fp-22,
+         0x1.1c81c3531fff2p-29}},
+    {3, {0x1.5555544178832p-5, -0x1.6c12d2ef379dcp-10, 0x1.9bd89bc2b0a75p-16}}
+};
+
+static const fast_poly fast_log_poly[2] = {
+    /* (atanh(s) - s) / s^3 in s^2, on |s| <= 3 - 2 sqrt(2). */
+    {5, {0x1.5555555564e96p-2, 0x1.999998cafbf2ap-3, 0x1.249323e4d7fc7p-3, 0x1.c67ada017cf97p-4,
+         0x1.8c8c11e54d389p-4}},
+    {3, {0x1.55555b7f8de11p-2, 0x1.997c305d84f6dp-3, 0x1.2ee610023bfcfp-3}}
+};
+
+static const fast_poly fast_atan_poly[2] = {
+    /* (atan(u) - u) / u^3 in u^2, on |u| <= tan(pi/8). */
+    {8, {-0x1.5555555552617p-2, 0x1.999999885ec7fp-3, -0x1.249240dabc69ep-3, 0x1.c71963926d8dep-4,
+         -0x1.7415b658a5a9fp-4, 0x1.377e1bae7bed4p-4, -0x1.edc1cc88dd692p-5, 0x1.0dfb68d0231a4p-5}},
+    {5, {-0x1.555554473ccb3p-2, 0x1.999730d8fbe92p-3, -0x1.24203520652cap-3, 0x1.b810309e6479ep-4,
+         -0x1.08455ee800ef0p-4}}
+};
+
+static const fast_poly fast_sinh_poly[2] = {
+    /* (sinh(x) - x) / x^3 in x^2, on |x| <= 1. */
+    {5, {0x1.5555555558201p-3, 0x1.1111110857b52p-7, 0x1.a01a131097a98p-13, 0x1.71d208a299728p-19,
+         0x1.b557c78eb1ae2p-26}},
+    {4, {0x1.5555554e858c9p-3, 0x1.11111eaff05ecp-7, 0x1.a008ffbc060dap-13, 0x1.78a70e32a02ebp-19}}
+};
+
+
+static int fast_in_range(int mode, double re, double im) {
+    /* Whether the approximation covers the argument; NaNs and infinities never are. */
+    const double n = re * re + im * im;
+    re = fabs(re);
+    im = fabs(im);
+    switch (mode) {
+    case FAST_EXP: return re <= FAST_EXP_MAX && im <= FAST_TRIG_MAX;
+    case FAST_LOG: case FAST_POW: return n >= 0x1p-1000 && n <= 0x1p1000;
+    case FAST_SIN: case FAST_COS: return re <= FAST_TRIG_MAX && im <= FAST_EXP_MAX;
+    case FAST_TAN: return re <= FAST_TRIG_MAX && im <= FAST_SQUARE_MAX;
+    case FAST_SINH: case FAST_COSH: return im <= FAST_TRIG_MAX && re <= FAST_EXP_MAX;
+    case FAST_TANH: return im <= FAST_TRIG_MAX && re <= FAST_SQUARE_MAX;
+    }
+    return 0;
+}
+
+
+/* Scalar forms of the bit tricks the vector code does with integer lanes. */
+static double fast_round(double a) {
+#if FLT_EVAL_METHOD == 0 && !defined(__FAST_MATH__)
+    return (a + FAST_ROUND) - FAST_ROUND;
+#else
+    return nearbyint(a);
+#endif
+}
+
+static double fast_exp2i(double k) {
+    /* 2^k for integral k in the normal range. */
+    const uint64_t bits = (uint64_t)((int64_t)k + 1023) << 52;
+    double r;
+    memcpy(&r, &bits, sizeof(r));
+    return r;
+}
+
+static double fast_exponent(double a) {
+    uint64_t bits;
+    memcpy(&bits, &a, sizeof(bits));
+    return (double)(int)(bits >> 52) - 1023;
+}
+
+static double fast_mantissa(double a) {
+    uint64_t bits;
+    memcpy(&bits, &a, sizeof(bits));
+    bits = (bits & 0x000FFFFFFFFFFFFFull) | 0x3FF0000000000000ull;
+    memcpy(&a, &bits, sizeof(a));
+    return a;
+}
+
+
+/* The approximations over V_TYPE lanes. Beyond the arithmetic of the SoA
+ * kernels they use V_SET1, comparisons giving a V_MASK for V_SELECT, V_ABS,
+ * V_COPYSIGN, V_ROUND to the nearest integer, V_EXP2I for 2^k, and
+ * V_EXPONENT and V_MANTISSA splitting a positive normal number. The array
+ * loops leave lanes outside fast_in_range undefined, and pow NaN where the
+ * exponent it forms is out of range, for the caller to redo. */
+#define FAST_KERNELS(SFX, ATTR)                                                                         \
+static ATTR V_TYPE fast_poly_##SFX(V_TYPE w, const fast_poly *p) {                                      \
+    V_TYPE r = V_SET1(p->c[p->n - 1]);                                                                  \
+    int k;                                                                                              \
+    for (k = p->n - 2; k >= 0; --k) r = V_ADD(V_MUL(r, w), V_SET1(p->c[k]));                            \
+    return r;                                                                                           \
+}                                                                                                       \
+static ATTR V_TYPE fast_exp_##SFX(V_TYPE x, int low) {                                                  \
+    /* x = k log(2) + r with |r| <= log(2)/2. */                                                        \
+    const V_TYPE k = V_ROUND(V_MUL(x, V_SET1(FAST_LOG2E)));                                             \
+    const V_TYPE r = V_SUB(V_SUB(x, V_MUL(k, V_SET1(FAST_LN2_HI))), V_MUL(k, V_SET1(FAST_LN2_LO)));     \
+    const V_TYPE q = fast_poly_##SFX(r, fast_exp_poly + low);                                           \
+    return V_MUL(V_ADD(V_SET1(1.0), V_ADD(r, V_MUL(V_MUL(r, r), q))), V_EXP2I(k));                      \
+}                                                                                                       \
+static ATTR V_TYPE fast_parity_##SFX(V_TYPE j) {                                                        \
+    /* 1 for odd integral j, 0 for even. */                                                             \
+    const V_TYPE o = V_SUB(j, V_MUL(V_SET1(2.0), V_ROUND(V_MUL(j, V_SET1(0.5)))));                      \
+    return V_MUL(o, o);                                                                                 \
+}                                                                                                       \
+static ATTR void fast_sincos_##SFX(V_TYPE x, int low, V_TYPE *s, V_TYPE *c) {                           \
+    /* x = k pi/2 + r with |r| <= pi/4, pi/2 split in four so that each product is exact. */            \
+    const V_TYPE half = V_SET1(0.5), one = V_SET1(1.0), two = V_SET1(2.0);                              \
+    const V_TYPE k = V_ROUND(V_MUL(x, V_SET1(FAST_2_PI)));                                              \
+    V_TYPE r = V_SUB(x, V_MUL(k, V_SET1(FAST_PIO2_1)));                                                 \
+    r = V_SUB(r, V_MUL(k, V_SET1(FAST_PIO2_2)));                                                        \
+    r = V_SUB(r, V_MUL(k, V_SET1(FAST_PIO2_3)));                                                        \
+    r = V_SUB(r, V_MUL(k, V_SET1(FAST_PIO2_3T)));                                                       \
+    const V_TYPE w = V_MUL(r, r);                                                                       \
+    const V_TYPE sr = V_ADD(r, V_MUL(V_MUL(r, w), fast_poly_##SFX(w, fast_sin_poly + low)));            \
+    const V_TYPE cr = V_ADD(V_SUB(one, V_MUL(half, w)), V_MUL(V_MUL(w, w), fast_poly_##SFX(w, fast_cos_poly + low))); \
+    /* Odd k swaps the two; the sine is negated for odd floor(k/2), the cosine for odd floor((k+1)/2). */ \
+    const V_MASK odd = V_EQ(fast_parity_##SFX(k), one);                                                 \
+    const V_TYPE ns = fast_parity_##SFX(V_ROUND(V_MUL(V_SUB(k, half), half)));                          \
+    const V_TYPE nc = fast_parity_##SFX(V_ROUND(V_MUL(V_ADD(k, half), half)));                          \
+    *s = V_MUL(V_SELECT(odd, cr, sr), V_SUB(one, V_MUL(two, ns)));                                      \
+    *c = V_MUL(V_SELECT(odd, sr, cr), V_SUB(one, V_MUL(two, nc)));                                      \
+}                                                                                                       \
+static ATTR void fast_sinhcosh_##SFX(V_TYPE x, int low, V_TYPE *sh, V_TYPE *ch) {                       \
+    /* From exp(|x|), with a series below 1 where the difference would cancel. */                       \
+    const V_TYPE one = V_SET1(1.0), half = V_SET1(0.5);                                                 \
+    const V_TYPE a = V_ABS(x), w = V_MUL(a, a);                                                         \
+    const V_TYPE e = fast_exp_##SFX(a, low), inv = V_DIV(one, e);                                       \
+    const V_TYPE small = V_ADD(a, V_MUL(V_MUL(a, w), fast_poly_##SFX(w, fast_sinh_poly + low)));        \
+    *sh = V_COPYSIGN(V_SELECT(V_LT(a, one), small, V_MUL(half, V_SUB(e, inv))), x);                     \
+    *ch = V_MUL(half, V_ADD(e, inv));                                                                   \
+}                                                                                                       \
+static ATTR V_TYPE fast_loghalf_##SFX(V_TYPE re, V_TYPE im, int low) {                                  \
+    /* log|z| from n = |z|^2 = m 2^e with m in [sqrt(2)/2, sqrt(2)), as e log(2)/2 + atanh((m-1)/(m+1)). */ \
+    /* For e = 0, m - 1 is formed from the parts so that it stays accurate close to the unit circle. */  \
+    const V_TYPE one = V_SET1(1.0);                                                                     \
+    const V_TYPE n = V_ADD(V_MUL(re, re), V_MUL(im, im));                                               \
+    V_TYPE m = V_MANTISSA(n), e = V_EXPONENT(n);                                                        \
+    const V_MASK up = V_LT(V_SET1(FAST_SQRT2), m);                                                      \
+    m = V_SELECT(up, V_MUL(m, V_SET1(0.5)), m);                                                         \
+    e = V_SELECT(up, V_ADD(e, one), e);                                                                 \
+    const V_TYPE f = V_SELECT(V_EQ(e, V_ZERO()), V_ADD(V_MUL(V_SUB(re, one), V_ADD(re, one)), V_MUL(im, im)), \
+                              V_SUB(m, one));                                                           \
+    const V_TYPE s = V_DIV(f, V_ADD(V_SET1(2.0), f)), w = V_MUL(s, s);                                  \
+    const V_TYPE t = V_ADD(s, V_MUL(V_MUL(s, w), fast_poly_##SFX(w, fast_log_poly + low)));             \
+    return V_ADD(V_MUL(e, V_SET1(0.5 * FAST_LN2_HI)), V_ADD(t, V_MUL(e, V_SET1(0.5 * FAST_LN2_LO))));   \
+}                                                                                                       \
+static ATTR V_TYPE fast_atan2_##SFX(V_TYPE y, V_TYPE x, int low) {                                      \
+    /* atan of the smaller over the larger part, past tan(pi/8) as pi/4 + atan((t-1)/(t+1)), */         \
+    /* then moved into its octant. */                                                                   \
+    const V_TYPE one = V_SET1(1.0), zero = V_ZERO();                                                    \
+    const V_TYPE ax = V_ABS(x), ay = V_ABS(y);                                                          \
+    const V_MASK swap = V_LT(ax, ay);                                                                   \
+    const V_TYPE t = V_DIV(V_SELECT(swap, ax, ay), V_SELECT(swap, ay, ax));                             \
+    const V_MASK big = V_LT(V_SET1(FAST_TAN_PI_8), t);                                                  \
+    const V_TYPE u = V_SELECT(big, V_DIV(V_SUB(t, one), V_ADD(t, one)), t), w = V_MUL(u, u);            \
+    V_TYPE a = V_ADD(u, V_MUL(V_MUL(u, w), fast_poly_##SFX(w, fast_atan_poly + low)));                  \
+    a = V_ADD(V_SELECT(big, V_SET1(FAST_PI_4), zero), a);                                               \
+    a = V_SELECT(swap, V_SUB(V_SET1(FAST_PI_2), a), a);                                                 \
+    a = V_SELECT(V_LT(x, zero), V_SUB(V_SET1(FAST_PI), a), a);                                          \
+    return V_COPYSIGN(a, y);                                                                            \
+}                                                                                                       \
+static ATTR V_TYPE fast_real_v_##SFX(V_TYPE x, int mode, int low) {                                     \
+    V_TYPE s, c;                                                                                        \
+    switch (mode) {                                                                                     \
+    case FAST_EXP: return fast_exp_##SFX(x, low);                                                       \
+    case FAST_SIN: case FAST_COS: case FAST_TAN:                                                        \
+        fast_sincos_##SFX(x, low, &s, &c);                                                              \
+        return mode == FAST_SIN ? s : mode == FAST_COS ? c : V_DIV(s, c);                               \
+    }                                                                                                   \
+    fast_sinhcosh_##SFX(x, low, &s, &c);                                                                \
+    return mode == FAST_SINH ? s : mode == FAST_COSH ? c : V_DIV(s, c);                                 \
+}                                                                                                       \
+static ATTR void fast_complex_v_##SFX(V_TYPE re, V_TYPE im, int mode, int low, V_TYPE *ore, V_TYPE *oim) { \
+    /* The trigonometric and hyperbolic functions from sin, cos, sinh and cosh of the parts. */          \
+    V_TYPE s, c, sh, ch, d;                                                                             \
+    switch (mode) {                                                                                     \
+    case FAST_EXP:                                                                                      \
+        fast_sincos_##SFX(im, low, &s, &c);                                                             \
+        ch = fast_exp_##SFX(re, low);                                                                   \
+        *ore = V_MUL(ch, c);                                                                            \
+        *oim = V_MUL(ch, s);                                                                            \
+        return;                                                                                         \
+    case FAST_LOG:                                                                                      \
+        *ore = fast_loghalf_##SFX(re, im, low);                                                         \
+        *oim = fast_atan2_##SFX(im, re, low);                                                           \
+        return;                                                                                         \
+    case FAST_SIN: case FAST_COS: case FAST_TAN:                                                        \
+        fast_sincos_##SFX(re, low, &s, &c);                                                             \
+        fast_sinhcosh_##SFX(im, low, &sh, &ch);                                                         \
+        break;                                                                                          \
+    default:                                                                                            \
+        fast_sincos_##SFX(im, low, &s, &c);                                                             \
+        fast_sinhcosh_##SFX(re, low, &sh, &ch);                                                         \
+        break;                                                                                          \
+    }                                                                                                   \
+    switch (mode) {                                                                                     \
+    case FAST_SIN: *ore = V_MUL(s, ch); *oim = V_MUL(c, sh); break;                                     \
+    case FAST_COS: *ore = V_MUL(c, ch); *oim = V_NEG(V_MUL(s, sh)); break;                              \
+    case FAST_SINH: *ore = V_MUL(sh, c); *oim = V_MUL(ch, s); break;                                    \
+    case FAST_COSH: *ore = V_MUL(ch, c); *oim = V_MUL(sh, s); break;                                    \
+    case FAST_TAN:                                                                                      \
+        /* (sin 2a + i sinh 2b) / (cos 2a + cosh 2b), halved so that the denominator cannot cancel. */   \
+        d = V_ADD(V_MUL(c, c), V_MUL(sh, sh));                                                          \
+        *ore = V_DIV(V_MUL(s, c), d);                                                                   \
+        *oim = V_DIV(V_MUL(sh, ch), d);                                                                 \
+        break;                                                                                          \
+    default:                                                                                            \
+        d = V_ADD(V_MUL(sh, sh), V_MUL(c, c));                                                          \
+        *ore = V_DIV(V_MUL(sh, ch), d);                                                                 \
+        *oim = V_DIV(V_MUL(s, c), d);                                                                   \
+        break;                                                                                          \
+    }                                                                                                   \
+}                                                                                                       \
+static ATTR void fast_pow_v_##SFX(V_TYPE are, V_TYPE aim, V_TYPE bre, V_TYPE bim, int low,              \
+                                  V_TYPE *ore, V_TYPE *oim) {                                           \
+    /* exp(b log a), NaN where b log a is out of the range of exp. */                                   \
+    const V_TYPE lre = fast_loghalf_##SFX(are, aim, low), lim = fast_atan2_##SFX(aim, are, low);        \
+    const V_TYPE wre = V_SUB(V_MUL(bre, lre), V_MUL(bim, lim));                                         \
+    const V_TYPE wim = V_ADD(V_MUL(bre, lim), V_MUL(bim, lre));                                         \
+    const V_TYPE reach = V_ADD(V_MUL(V_ABS(wre), V_SET1(1 / FAST_EXP_MAX)), V_MUL(V_ABS(wim), V_SET1(1 / FAST_TRIG_MAX))); \
+    const V_MASK inside = V_LT(reach, V_SET1(1.0));                                                     \
+    fast_complex_v_##SFX(V_SELECT(inside, wre, V_ZERO()), V_SELECT(inside, wim, V_ZERO()), FAST_EXP, low, ore, oim); \
+    *ore = V_SELECT(inside, *ore, V_SET1(NAN));                                                         \
+    *oim = V_SELECT(inside, *oim, V_SET1(NAN));                                                         \
+}                                                                                                       \
+static ATTR void fast_real_##SFX(double *o, const double *a, int j, int count, int mode, int low) {     \
+    for (; j + V_WIDTH <= count; j += V_WIDTH) V_STORE(o + j, fast_real_v_##SFX(V_LOAD(a + j), mode, low)); \
+    if (j < count) fast_real_c(o, a, j, count, mode, low);                                              \
+}                                                                                                       \
+static ATTR void fast_complex_##SFX(double *ore, double *oim, const double *are, const double *aim,     \
+                                    int j, int count, int mode, int low) {                              \
+    V_TYPE re, im;                                                                                      \
+    for (; j + V_WIDTH <= count; j += V_WIDTH) {                                                        \
+        fast_complex_v_##SFX(V_LOAD(are + j), V_LOAD(aim + j), mode, low, &re, &im);                    \
+        V_STORE(ore + j, re);                                                                           \
+        V_STORE(oim + j, im);                                                                           \
+    }                                                                                                   \
+    if (j < count) fast_complex_c(ore, oim, are, aim, j, count, mode, low);                             \
+}                                                                                                       \
+static ATTR void fast_pow_##SFX(double *ore, double *oim, const double *are, const double *aim,         \
+                                const double *bre, const double *bim, int j, int count, int low) {      \
+    V_TYPE re, im;                                                                                      \
+    for (; j + V_WIDTH <= count; j += V_WIDTH) {                                                        \
+        fast_pow_v_##SFX(V_LOAD(are + j), V_LOAD(aim + j), V_LOAD(bre + j), V_LOAD(bim + j), low, &re, &im); \
+        V_STORE(ore + j, re);                                                                           \
+        V_STORE(oim + j, im);                                                                           \
+    }                                                                                                   \
+    if (j < count) fast_pow_c(ore, oim, are, aim, bre, bim, j, count, low);                             \
+}
+
+
+static void fast_real_c(double *o, const double *a, int j, int count, int mode, int low);
+static void fast_complex_c(double *ore, double *oim, const double *are, const double *aim,
+                           int j, int count, int mode, int low);
+static void fast_pow_c(double *ore, double *oim, const double *are, const double *aim,
+                       const double *bre, const double *bim, int j, int count, int low);
+
+#define V_TYPE double
+#define V_WIDTH 1
+#define V_LOAD(p) (*(p))
+#define V_STORE(p, v) (*(p) = (v))
+#define V_ADD(a, b) ((a) + (b))
+#define V_SUB(a, b) ((a) - (b))
+#define V_MUL(a, b) ((a) * (b))
+#define V_DIV(a, b) ((a) / (b))
+#define V_NEG(a) (-(a))
+#define V_ZERO() 0.0
+#define V_SET1(c) (c)
+#define V_MASK int
+#define V_LT(a, b) ((a) < (b))
+#define V_EQ(a, b) ((a) == (b))
+#define V_SELECT(m, a, b) ((m) ? (a) : (b))
+#define V_ABS(a) fabs(a)
+#define V_COPYSIGN(a, s) copysign((a), (s))
+#define V_ROUND(a) fast_round(a)
+#define V_EXP2I(k) fast_exp2i(k)
+#define V_EXPONENT(a) fast_exponent(a)
+#define V_MANTISSA(a) fast_mantissa(a)
+FAST_KERNELS(c, )
+#undef V_TYPE
+#undef V_WIDTH
+#undef V_LOAD
+#undef V_STORE
+#undef V_ADD
+#undef V_SUB
+#undef V_MUL
+#undef V_DIV
+#undef V_NEG
+#undef V_ZERO
+#undef V_SET1
+#undef V_MASK
+#undef V_LT
+#undef V_EQ
+#undef V_SELECT
+#undef V_ABS
+#undef V_COPYSIGN
+#undef V_ROUND
+#undef V_EXP2I
+#undef V_EXPONENT
+#undef V_MANTISSA
+
+
+static d_cx fast_call(d_cx (*exact)(d_cx), d_cx a, int mode, int low) {
+    double re, im;
+    if (!fast_in_range(mode, creal(a), cimag(a))) return exact(a);
+    fast_complex_v_c(creal(a), cimag(a), mode, low, &re, &im);
+    return cx_make(re, im);
+}
+
+static d_cx fast_real_call(double (*exact)(double), d_cx a, int mode, int low) {
+    const double x = creal(a);
+    if (!fast_in_range(mode, x, 0)) return exact(x);
+    return fast_real_v_c(x, mode, low);
+}
+
+static d_cx fast_pow_call(d_cx a, d_cx b, int low) {
+    double re, im;
+    if (!fast_in_range(FAST_POW, creal(a), cimag(a))) return cpow(a, b);
+    fast_pow_v_c(creal(a), cimag(a), creal(b), cimag(b), low, &re, &im);
+    if (re != re) return cpow(a, b);
+    return cx_make(re, im);
+}
+
+#define FAST_KERNEL(NAME, EXACT, MODE)                                                                  \
+static d_cx NAME##_fast(d_cx a) {return fast_call(EXACT, a, MODE, 0);}                                  \
+static d_cx NAME##_low(d_cx a) {return fast_call(EXACT, a, MODE, 1);}
+#define FAST_REAL_KERNEL(NAME, EXACT, MODE)                                                             \
+static d_cx NAME##_fast(d_cx a) {return fast_real_call(EXACT, a, MODE, 0);}                             \
+static d_cx NAME##_low(d_cx a) {return fast_real_call(EXACT, a, MODE, 1);}
+
+FAST_KERNEL(cexp, cexp, FAST_EXP)
+FAST_KERNEL(clog, clog, FAST_LOG)
+FAST_KERNEL(csin, csin, FAST_SIN)
+FAST_KERNEL(ccos, ccos, FAST_COS)
+FAST_KERNEL(ctan, ctan, FAST_TAN)
+FAST_KERNEL(csinh, csinh, FAST_SINH)
+FAST_KERNEL(ccosh, ccosh, FAST_COSH)
+FAST_KERNEL(ctanh, ctanh, FAST_TANH)
+FAST_REAL_KERNEL(rexp, exp, FAST_EXP)
+FAST_REAL_KERNEL(rsin, sin, FAST_SIN)
+FAST_REAL_KERNEL(rcos, cos, FAST_COS)
+FAST_REAL_KERNEL(rtan, tan, FAST_TAN)
+FAST_REAL_KERNEL(rsinh, sinh, FAST_SINH)
+FAST_REAL_KERNEL(rcosh, cosh, FAST_COSH)
+FAST_REAL_KERNEL(rtanh, tanh, FAST_TANH)
+static d_cx cpow_fast(d_cx a, d_cx b) {return fast_pow_call(a, b, 0);}
+static d_cx cpow_low(d_cx a, d_cx b) {return fast_pow_call(a, b, 1);}
+
+#undef FAST_KERNEL
+#undef FAST_REAL_KERNEL
+
+
+/* Each built-in and its approximations, full tier then LOW. */
+static const struct {const void *exact; const void *fast; const void *low; int mode; int real;} fast_kernels[] = {
+    {cexp, cexp_fast, cexp_low, FAST_EXP, 0}, {clog, clog_fast, clog_low, FAST_LOG, 0},
+    {cpow, cpow_fast, cpow_low, FAST_POW, 0},
+    {csin, csin_fast, csin_low, FAST_SIN, 0}, {ccos, ccos_fast, ccos_low, FAST_COS, 0},
+    {ctan, ctan_fast, ctan_low, FAST_TAN, 0}, {csinh, csinh_fast, csinh_low, FAST_SINH, 0},
+    {ccosh, ccosh_fast, ccosh_low, FAST_COSH, 0}, {ctanh, ctanh_fast, ctanh_low, FAST_TANH, 0},
+    {rexp, rexp_fast, rexp_low, FAST_EXP, 1},
+    {rsin, rsin_fast, rsin_low, FAST_SIN, 1}, {rcos, rcos_fast, rcos_low, FAST_COS, 1},
+    {rtan, rtan_fast, rtan_low, FAST_TAN, 1}, {rsinh, rsinh_fast, rsinh_low, FAST_SINH, 1},
+    {rcosh, rcosh_fast, rcosh_low, FAST_COSH, 1}, {rtanh, rtanh_fast, rtanh_low, FAST_TANH, 1},
+    {0, 0, 0, 0, 0}
+};
+
+/* Relative error bounds of the two tiers, as documented. */
+static const double fast_tolerance[2] = {1e-12, 1e-7};
+
+
+static int fast_find(const void *f) {
+    /* The entry holding f at any tier, or -1. */
+    int k;
+    for (k = 0; fast_kernels[k].exact; ++k) {
+        if (f == fast_kernels[k].exact || f == fast_kernels[k].fast || f == fast_kernels[k].low) return k;
+    }
+    return -1;
+}
+
+static const void *exact_kernel(const void *f) {
+    /* Maps an approximation back to the function it stands for. */
+    const int k = fast_find(f);
+    return k < 0 ? f : fast_kernels[k].exact;
+}
+
+
+static const char *const loop_keywords[] = {"sum", "prod", "iterate"};
+
+static void token_symbol(state *s, const char *start, int len) {
+    /* Classifies a variable or function name. Loop variables hide everything else. */
+    const loop *l;
+    int k;
+    for (l = s->scope; l; l = l->scope) {
+        if (l->length == len && strncmp(l->name, start, len) == 0) {
+            s->type = TOK_VARIABLE | (l->kind == LOOP_ITERATE ? 0 : TX_FLAG_REAL);
+            s->bound = loop_slots[l->depth];
+            return;
+        }
+    }
+
+    const tx_variable *var = find_lookup(s, start, len);
+    if (!var) {
+        for (k = 0; k < 3; ++k) {
+            if (same_name(start, len, loop_keywords[k])) {
+                s->type = TOK_LOOP;
+                s->keyword = k;
+                return;
+            }
+        }
+        var = find_builtin(start, len);
+    }
+
+    if (!var) {
+        s->type = TOK_ERROR;
+    } else {
+        switch(TYPE_MASK(var->type))
+        {
+        case TX_VARIABLE:
+            s->type = TOK_VARIABLE | (var->type & TX_FLAG_REAL);
+            s->bound = var->address;
+            break;
+
+        case TX_CLOSURE0: case TX_CLOSURE1: case TX_CLOSURE2: case TX_CLOSURE3:         /* Falls through. */
+        case TX_CLOSURE4: case TX_CLOSURE5: case TX_CLOSURE6:                           /* Falls through. */
+            s->context = var->context;                                                  /* Falls through. */
+
+        case TX_FUNCTION0: case TX_FUNCTION1: case TX_FUNCTION2: case TX_FUNCTION3:     /* Falls through. */
+        case TX_FUNCTION4: case TX_FUNCTION5: case TX_FUNCTION6:                        /* Falls through. */
+            s->type = var->type;
+            s->function = var->address;
+            break;
+        }
+    }
+}
+
+
+static void token_char(state *s, char c) {
+    /* Look for an operator or special character. */
+    switch (c) {
+    case '+': s->type = TOK_INFIX; s->function = add; break;
+    case '-': s->type = TOK_INFIX; s->function = sub; break;
+    case '*': s->type = TOK_INFIX; s->function = mul; break;
+    case '/': s->type = TOK_INFIX; s->function = divide; break;
+    case '^': s->type = TOK_INFIX; s->function = cpow; break;
+    case '(': s->type = TOK_OPEN; break;
+    case ')': s->type = TOK_CLOSE; break;
+    case ',': s->type = TOK_SEP; break;
+    case ' ': case '\t': case '\n': case '\r': break;
+    default: s->type = TOK_ERROR; break;
+    }
+}
 
 
 void tx_next_token(state *s) {
@@ -223,51 +1072,154 @@ void tx_next_token(state *s) {
                 const char *start;
                 start = s->next;
                 while (isalpha(s->next[0]) || isdigit(s->next[0]) || (s->next[0] == '_')) s->next++;
-                
-                const tx_variable *var = find_lookup(s, start, s->next - start);
-                if (!var) var = find_builtin(start, s->next - start);
-
-                if (!var) {
-                    s->type = TOK_ERROR;
-                } else {
-                    switch(TYPE_MASK(var->type))
-                    {
-                    case TX_VARIABLE:
-                        s->type = TOK_VARIABLE;
-                        s->bound = var->address;
-                        break;
+                token_symbol(s, start, s->next - start);
+            } else {
+                token_char(s, s->next++[0]);
+            }
+        }
+    } while (s->type == TOK_NULL);
+}
 
-                    case TX_CLOSURE0: case TX_CLOSURE1: case TX_CLOSURE2: case TX_CLOSURE3:         /* Falls through. */
-                    case TX_CLOSURE4: case TX_CLOSURE5: case TX_CLOSURE6:                           /* Falls through. */
-                        s->context = var->context;                                                  /* Falls through. */
 
-                    case TX_FUNCTION0: case TX_FUNCTION1: case TX_FUNCTION2: case TX_FUNCTION3:     /* Falls through. */
-                    case TX_FUNCTION4: case TX_FUNCTION5: case TX_FUNCTION6:                        /* Falls through. */
-                        s->type = var->type;
-                        s->function = var->address;
-                        break;
-                    }
-                }
+/* Tokenizer for the iterative parser. It reads up to s->end, uses ASCII */
+/* character classes only and scans numbers itself, without the locale. */
+#define IS_DIGIT(c) ((c) >= '0' && (c) <= '9')
+#define IS_ALPHA(c) (((c) >= 'a' && (c) <= 'z') || ((c) >= 'A' && (c) <= 'Z'))
+
+/* Significant digits kept for the slow path; beyond these only whether any is nonzero matters. */
+#define NUMBER_DIGITS 800
+
+static const double exact_powers[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+
+static const char *scan_number(const char *p, const char *end, double *value) {
+    /* Reads digits [. digits] [e [sign] digits]. Returns p when there is no number. */
+    char digits[NUMBER_DIGITS + 16];
+    const char *const start = p;
+    int count = 0, seen = 0, sticky = 0;
+    long scale = 0;
+
+    for (; p != end && IS_DIGIT(*p); ++p, seen = 1) {
+        if (count == 0 && *p == '0') continue;
+        if (count < NUMBER_DIGITS) {
+            digits[count++] = *p;
+        } else {
+            if (*p != '0') sticky = 1;
+            ++scale;
+        }
+    }
+    if (p != end && *p == '.') {
+        for (++p; p != end && IS_DIGIT(*p); ++p, seen = 1) {
+            if (count == 0 && *p == '0') {
+                --scale;
+            } else if (count < NUMBER_DIGITS) {
+                digits[count++] = *p;
+                --scale;
+            } else if (*p != '0') {
+                sticky = 1;
+            }
+        }
+    }
+    if (!seen) return start;
+
+    /* Like strtod, an exponent without digits is left unread. */
+    if (p != end && (*p == 'e' || *p == 'E')) {
+        const char *q = p + 1;
+        int negative = 0;
+        long exponent = 0;
+        if (q != end && (*q == '+' || *q == '-')) negative = *q++ == '-';
+        if (q != end && IS_DIGIT(*q)) {
+            for (; q != end && IS_DIGIT(*q); ++q) {
+                if (exponent < 100000) exponent = 10 * exponent + (*q - '0');
+            }
+            scale += negative ? -exponent : exponent;
+            p = q;
+        }
+    }
+
+    if (count == 0) {
+        *value = 0;
+        return p;
+    }
+
+    /* Clinger's fast path: an exact mantissa and an exact power of ten round once. */
+    if (count <= 19 && !sticky) {
+        uint64_t mantissa = 0;
+        int i;
+        for (i = 0; i < count; ++i) mantissa = 10 * mantissa + (digits[i] - '0');
+
+        if (mantissa <= (1ull << 53)) {
+            if (scale >= 0 && scale <= 22) {
+                *value = (double)mantissa * exact_powers[scale];
+                return p;
+            }
+            if (scale < 0 && scale >= -22) {
+                *value = (double)mantissa / exact_powers[-scale];
+                return p;
+            }
+            /* Moves powers into the mantissa while it stays exact. */
+            long rest = scale;
+            while (rest > 22 && mantissa <= (1ull << 53) / 10) {
+                mantissa *= 10;
+                --rest;
+            }
+            if (rest <= 22 && rest > 0) {
+                *value = (double)mantissa * exact_powers[rest];
+                return p;
+            }
+        }
+    }
+
+    /* Otherwise strtod rounds a copy without a radix character, so the locale cannot matter. */
+    if (sticky) {
+        digits[count++] = '1';
+        --scale;
+    }
+    snprintf(digits + count, sizeof(digits) - count, "e%ld", scale);
+    *value = strtod(digits, 0);
+    return p;
+}
+
+
+static void scan_token(state *s) {
+    s->type = TOK_NULL;
+
+    do {
+        if (s->next == s->end) {
+            s->type = TOK_END;
+            return;
+        }
 
+        const char c = s->next[0];
+        if (IS_DIGIT(c) || c == '.') {
+            const char *after = scan_number(s->next, s->end, &s->value);
+            if (after == s->next) {
+                s->type = TOK_ERROR;
+                s->next++;
+            } else if (after != s->end && after[0] == 'I') {
+                s->type = TOK_NUMBER_I;
+                s->next = after + 1;
             } else {
-                /* Look for an operator or special character. */
-                switch (s->next++[0]) {
-                case '+': s->type = TOK_INFIX; s->function = add; break;
-                case '-': s->type = TOK_INFIX; s->function = sub; break;
-                case '*': s->type = TOK_INFIX; s->function = mul; break;
-                case '/': s->type = TOK_INFIX; s->function = divide; break;
-                case '^': s->type = TOK_INFIX; s->function = cpow; break;
-                case '(': s->type = TOK_OPEN; break;
-                case ')': s->type = TOK_CLOSE; break;
-                case ',': s->type = TOK_SEP; break;
-                case ' ': case '\t': case '\n': case '\r': break;
-                default: s->type = TOK_ERROR; break;
-                }
+                s->type = TOK_NUMBER_R;
+                s->next = after;
             }
+        } else if (IS_ALPHA(c)) {
+            const char *start = s->next;
+            while (s->next != s->end && (IS_ALPHA(s->next[0]) || IS_DIGIT(s->next[0]) || s->next[0] == '_')) s->next++;
+            token_symbol(s, start, s->next - start);
+        } else {
+            token_char(s, c);
+            s->next++;
         }
     } while (s->type == TOK_NULL);
 }
 
+#undef IS_DIGIT
+#undef IS_ALPHA
+
 
 static tx_expr *list(state *s);
 static tx_expr *expr(state *s);
@@ -275,12 +1227,14 @@ static tx_expr *power(state *s);
 
 static tx_expr *base(state *s) {
     /* <base>      =    <constant> | <variable> | <function-0> {"(" ")"} | <function-1> <power> | <function-X> "(" <expr> {"," <expr>} ")" | "(" <list> ")" */
+    /*                | <loop> "(" <name> "," <expr> "," <expr> "," <expr> ")" */
     tx_expr *ret;
     int arity;
+    loop *l;
 
     switch (TYPE_MASK(s->type)) {
     case TOK_NUMBER_R:
-        ret = new_expr(TX_CONSTANT, 0);
+        ret = new_expr(s->arena, TX_CONSTANT, 0);
         CHECK_NULL(ret);
 
         ret->value = s->value;
@@ -288,7 +1242,7 @@ static tx_expr *base(state *s) {
         break;
 
     case TOK_NUMBER_I:
-        ret = new_expr(TX_CONSTANT, 0);
+        ret = new_expr(s->arena, TX_CONSTANT, 0);
         CHECK_NULL(ret);
 
         ret->value = s->value*I;
@@ -296,7 +1250,7 @@ static tx_expr *base(state *s) {
         break;
 
     case TOK_VARIABLE:
-        ret = new_expr(TX_VARIABLE, 0);
+        ret = new_expr(s->arena, TX_VARIABLE | (s->type & TX_FLAG_REAL), 0);
         CHECK_NULL(ret);
 
         ret->bound = s->bound;
@@ -305,7 +1259,7 @@ static tx_expr *base(state *s) {
 
     case TX_FUNCTION0:
     case TX_CLOSURE0:
-        ret = new_expr(s->type, 0);
+        ret = new_expr(s->arena, s->type, 0);
         CHECK_NULL(ret);
 
         ret->function = s->function;
@@ -323,14 +1277,14 @@ static tx_expr *base(state *s) {
 
     case TX_FUNCTION1:
     case TX_CLOSURE1:
-        ret = new_expr(s->type, 0);
+        ret = new_expr(s->arena, s->type, 0);
         CHECK_NULL(ret);
 
         ret->function = s->function;
         if (IS_CLOSURE(s->type)) ret->parameters[1] = s->context;
         tx_next_token(s);
         ret->parameters[0] = power(s);
-        CHECK_NULL(ret->parameters[0], tx_free(ret));
+        CHECK_NULL(ret->parameters[0], free_expr(s->arena, ret));
         break;
 
     case TX_FUNCTION2: case TX_FUNCTION3: case TX_FUNCTION4:
@@ -339,7 +1293,7 @@ static tx_expr *base(state *s) {
     case TX_CLOSURE5: case TX_CLOSURE6:
         arity = ARITY(s->type);
 
-        ret = new_expr(s->type, 0);
+        ret = new_expr(s->arena, s->type, 0);
         CHECK_NULL(ret);
 
         ret->function = s->function;
@@ -353,7 +1307,7 @@ static tx_expr *base(state *s) {
             for(i = 0; i < arity; i++) {
                 tx_next_token(s);
                 ret->parameters[i] = expr(s);
-                CHECK_NULL(ret->parameters[i], tx_free(ret));
+                CHECK_NULL(ret->parameters[i], free_expr(s->arena, ret));
 
                 if(s->type != TOK_SEP) {
                     break;
@@ -368,6 +1322,37 @@ static tx_expr *base(state *s) {
 
         break;
 
+    case TOK_LOOP:
+        l = loop_open(s);
+        if (l) {
+            tx_expr *a[3] = {0, 0, 0};
+            int i;
+            for (i = 0; i < 3; ++i) {
+                tx_next_token(s);
+                a[i] = expr(s);
+                if (!a[i] || s->type != (i < 2 ? TOK_SEP : TOK_CLOSE)) break;
+            }
+            if (i == 3) {
+                ret = loop_close(s, l, a[0], a[1], a[2]);
+                if (ret) {
+                    tx_next_token(s);
+                    break;
+                }
+            } else {
+                const int failed = i < 3 && !a[i];
+                for (i = 0; i < 3; ++i) free_expr(s->arena, a[i]);
+                loop_discard(s, l);
+                if (failed) return NULL;
+                s->type = TOK_ERROR;
+            }
+        }
+        if (s->type != TOK_ERROR) return NULL;
+
+        ret = new_expr(s->arena, 0, 0);
+        CHECK_NULL(ret);
+        ret->value = NAN;
+        break;
+
     case TOK_OPEN:
         tx_next_token(s);
         ret = list(s);
@@ -381,7 +1366,7 @@ static tx_expr *base(state *s) {
         break;
 
     default:
-        ret = new_expr(0, 0);
+        ret = new_expr(s->arena, 0, 0);
         CHECK_NULL(ret);
 
         s->type = TOK_ERROR;
@@ -409,8 +1394,8 @@ static tx_expr *power(state *s) {
         tx_expr *b = base(s);
         CHECK_NULL(b);
 
-        ret = NEW_EXPR(TX_FUNCTION1 | TX_FLAG_PURE, b);
-        CHECK_NULL(ret, tx_free(b));
+        ret = NEW_EXPR(s->arena, TX_FUNCTION1 | TX_FLAG_PURE, b);
+        CHECK_NULL(ret, free_expr(s->arena, b));
 
         ret->function = negate;
     }
@@ -428,11 +1413,11 @@ static tx_expr *factor(state *s) {
         tx_fun2 t = s->function;
         tx_next_token(s);
         tx_expr *p = power(s);
-        CHECK_NULL(p, tx_free(ret));
+        CHECK_NULL(p, free_expr(s->arena, ret));
 
         tx_expr *prev = ret;
-        ret = NEW_EXPR(TX_FUNCTION2 | TX_FLAG_PURE, ret, p);
-        CHECK_NULL(ret, tx_free(p), tx_free(prev));
+        ret = NEW_EXPR(s->arena, TX_FUNCTION2 | TX_FLAG_PURE, ret, p);
+        CHECK_NULL(ret, free_expr(s->arena, p), free_expr(s->arena, prev));
 
         ret->function = t;
     }
@@ -450,11 +1435,11 @@ static tx_expr *term(state *s) {
         tx_fun2 t = s->function;
         tx_next_token(s);
         tx_expr *f = factor(s);
-        CHECK_NULL(f, tx_free(ret));
+        CHECK_NULL(f, free_expr(s->arena, ret));
 
         tx_expr *prev = ret;
-        ret = NEW_EXPR(TX_FUNCTION2 | TX_FLAG_PURE, ret, f);
-        CHECK_NULL(ret, tx_free(f), tx_free(prev));
+        ret = NEW_EXPR(s->arena, TX_FUNCTION2 | TX_FLAG_PURE, ret, f);
+        CHECK_NULL(ret, free_expr(s->arena, f), free_expr(s->arena, prev));
 
         ret->function = t;
     }
@@ -472,11 +1457,11 @@ static tx_expr *expr(state *s) {
         tx_fun2 t = s->function;
         tx_next_token(s);
         tx_expr *te = term(s);
-        CHECK_NULL(te, tx_free(ret));
+        CHECK_NULL(te, free_expr(s->arena, ret));
 
         tx_expr *prev = ret;
-        ret = NEW_EXPR(TX_FUNCTION2 | TX_FLAG_PURE, ret, te);
-        CHECK_NULL(ret, tx_free(te), tx_free(prev));
+        ret = NEW_EXPR(s->arena, TX_FUNCTION2 | TX_FLAG_PURE, ret, te);
+        CHECK_NULL(ret, free_expr(s->arena, te), free_expr(s->arena, prev));
 
         ret->function = t;
     }
@@ -493,11 +1478,11 @@ static tx_expr *list(state *s) {
     while (s->type == TOK_SEP) {
         tx_next_token(s);
         tx_expr *e = expr(s);
-        CHECK_NULL(e, tx_free(ret));
+        CHECK_NULL(e, free_expr(s->arena, ret));
 
         tx_expr *prev = ret;
-        ret = NEW_EXPR(TX_FUNCTION2 | TX_FLAG_PURE, ret, e);
-        CHECK_NULL(ret, tx_free(e), tx_free(prev));
+        ret = NEW_EXPR(s->arena, TX_FUNCTION2 | TX_FLAG_PURE, ret, e);
+        CHECK_NULL(ret, free_expr(s->arena, e), free_expr(s->arena, prev));
 
         ret->function = comma;
     }
@@ -506,25 +1491,392 @@ static tx_expr *list(state *s) {
 }
 
 
-#define TX_FUN(...) ((d_cx(*)(__VA_ARGS__))n->function)
-#define M(e) tx_eval(n->parameters[e])
+/* Iterative parser. Precedence climbing over explicit operand and operator
+ * stacks, for the same grammar as above: prefix signs and one-argument calls
+ * bind to the next base, and all binary operators are left-associative. */
+#define PARSE_MAX_DEPTH 10000
 
+enum {PARSE_BINARY, PARSE_PREFIX, PARSE_GROUP, PARSE_CALL};
 
-d_cx tx_eval(const tx_expr *n) {
-    if (!n) return NAN;
+typedef struct parse_operand {
+    tx_expr *node;
+    int depth;
+} parse_operand;
 
-    switch(TYPE_MASK(n->type)) {
-    case TX_CONSTANT: return n->value;
-    case TX_VARIABLE: return *n->bound;
+typedef struct parse_operator {
+    int kind;
+    int prec;
+    int type;
+    const void *function;
+    void *context;
+    int args;
+} parse_operator;
+
+typedef struct parser {
+    state *s;
+    int max_depth;
+    int too_deep;
+    int failed;
+
+    parse_operand *operands;
+    int operand_count;
+    int operand_capacity;
+
+    parse_operator *operators;
+    int operator_count;
+    int operator_capacity;
+} parser;
+
+
+/* Everything a tx_compiler keeps between calls, parser stacks included. */
+struct tx_compiler {
+    tx_arena *arena;
+    tx_symtab *symtab;
+
+    parse_operand *operands;
+    int operand_capacity;
+    parse_operator *operators;
+    int operator_capacity;
+};
 
-    case TX_FUNCTION0: case TX_FUNCTION1: case TX_FUNCTION2: case TX_FUNCTION3:
-    case TX_FUNCTION4: case TX_FUNCTION5: case TX_FUNCTION6:
-        switch(ARITY(n->type)) {
-        case 0: return TX_FUN(void)();
-        case 1: return TX_FUN(d_cx)(M(0));
-        case 2: return TX_FUN(d_cx, d_cx)(M(0), M(1));
-        case 3: return TX_FUN(d_cx, d_cx, d_cx)(M(0), M(1), M(2));
-        case 4: return TX_FUN(d_cx, d_cx, d_cx, d_cx)(M(0), M(1), M(2), M(3));
+
+static int parse_push_operand(parser *p, tx_expr *node, int depth) {
+    if (depth > p->max_depth) p->too_deep = 1;
+    if (p->too_deep) {
+        free_expr(p->s->arena, node);
+        return 0;
+    }
+    if (p->operand_count == p->operand_capacity) {
+        const int capacity = p->operand_capacity ? 2 * p->operand_capacity : 64;
+        parse_operand *operands = realloc(p->operands, sizeof(parse_operand) * capacity);
+        if (!operands) {
+            free_expr(p->s->arena, node);
+            p->failed = 1;
+            return 0;
+        }
+        p->operands = operands;
+        p->operand_capacity = capacity;
+    }
+    p->operands[p->operand_count].node = node;
+    p->operands[p->operand_count].depth = depth;
+    ++p->operand_count;
+    return 1;
+}
+
+
+static int parse_push_operator(parser *p, int kind, int prec, int type, const void *function, void *context) {
+    /* Open groups count against the depth limit too, as they cost stack without adding nodes. */
+    if (p->operator_count >= p->max_depth) {
+        p->too_deep = 1;
+        return 0;
+    }
+    if (p->operator_count == p->operator_capacity) {
+        const int capacity = p->operator_capacity ? 2 * p->operator_capacity : 64;
+        parse_operator *operators = realloc(p->operators, sizeof(parse_operator) * capacity);
+        if (!operators) {
+            p->failed = 1;
+            return 0;
+        }
+        p->operators = operators;
+        p->operator_capacity = capacity;
+    }
+    parse_operator *op = p->operators + p->operator_count++;
+    op->kind = kind;
+    op->prec = prec;
+    op->type = type;
+    op->function = function;
+    op->context = context;
+    op->args = 0;
+    return 1;
+}
+
+
+static int parse_leaf(parser *p, int type) {
+    tx_expr *ret = new_expr(p->s->arena, type, 0);
+    if (!ret) {
+        p->failed = 1;
+        return 0;
+    }
+
+    switch (TYPE_MASK(p->s->type)) {
+    case TOK_NUMBER_R: ret->value = p->s->value; break;
+    case TOK_NUMBER_I: ret->value = p->s->value*I; break;
+    case TOK_VARIABLE: ret->bound = p->s->bound; break;
+    default:
+        ret->function = p->s->function;
+        if (IS_CLOSURE(type)) ret->parameters[0] = p->s->context;
+        break;
+    }
+    return parse_push_operand(p, ret, 1);
+}
+
+
+static int parse_apply(parser *p, const parse_operator *op) {
+    /* Replaces the operator's arguments on top of the operand stack by its node. */
+    const int arity = ARITY(op->type);
+    parse_operand *args = p->operands + p->operand_count - arity;
+    int depth = 0;
+    int i;
+    for (i = 0; i < arity; ++i) {
+        if (args[i].depth > depth) depth = args[i].depth;
+    }
+
+    /* Loops are calls without a function, holding their loop as context. */
+    if (!op->function) {
+        p->operand_count -= arity;
+        tx_expr *ret = loop_close(p->s, op->context, args[0].node, args[1].node, args[2].node);
+        if (!ret) {
+            if (p->s->type != TOK_ERROR) p->failed = 1;
+            return 0;
+        }
+        return parse_push_operand(p, ret, depth + 1);
+    }
+
+    tx_expr *ret = new_expr(p->s->arena, op->type, 0);
+    if (!ret) {
+        p->failed = 1;
+        return 0;
+    }
+
+    for (i = 0; i < arity; ++i) ret->parameters[i] = args[i].node;
+    ret->function = op->function;
+    if (IS_CLOSURE(op->type)) ret->parameters[arity] = op->context;
+
+    p->operand_count -= arity;
+    return parse_push_operand(p, ret, depth + 1);
+}
+
+
+static int parse_reduce(parser *p, int kind, int prec) {
+    /* Applies operators of the kind from the top of the stack, binary ones down to prec. */
+    while (p->operator_count) {
+        const parse_operator *op = p->operators + p->operator_count - 1;
+        if (op->kind != kind || (kind == PARSE_BINARY && op->prec < prec)) break;
+        --p->operator_count;
+        if (!parse_apply(p, op)) return 0;
+    }
+    return 1;
+}
+
+
+static tx_expr *parse_iterative(state *s, int max_depth, int *error) {
+    parser p;
+    memset(&p, 0, sizeof(p));
+    p.s = s;
+    p.max_depth = max_depth > 0 ? max_depth : PARSE_MAX_DEPTH;
+    if (s->compiler) {
+        p.operands = s->compiler->operands;
+        p.operand_capacity = s->compiler->operand_capacity;
+        p.operators = s->compiler->operators;
+        p.operator_capacity = s->compiler->operator_capacity;
+    }
+
+    int operand = 1, negative = 0, ok = 1, done = 0;
+    scan_token(s);
+
+    while (ok && !done) {
+        if (operand) {
+            if (s->type == TOK_INFIX && (s->function == add || s->function == sub)) {
+                if (s->function == sub) negative = !negative;
+                scan_token(s);
+                continue;
+            }
+            if (negative) {
+                ok = parse_push_operator(&p, PARSE_PREFIX, 0, TX_FUNCTION1 | TX_FLAG_PURE, negate, 0);
+                negative = 0;
+                if (!ok) break;
+            }
+            if (s->type == TOK_INFIX) {
+                ok = 0;
+                break;
+            }
+
+            switch (TYPE_MASK(s->type)) {
+            case TOK_NUMBER_R: case TOK_NUMBER_I:
+                ok = parse_leaf(&p, TX_CONSTANT);
+                scan_token(s);
+                operand = 0;
+                break;
+
+            case TOK_VARIABLE:
+                ok = parse_leaf(&p, TX_VARIABLE | (s->type & TX_FLAG_REAL));
+                scan_token(s);
+                operand = 0;
+                break;
+
+            case TX_FUNCTION0: case TX_CLOSURE0:
+                ok = parse_leaf(&p, s->type);
+                scan_token(s);
+                if (ok && s->type == TOK_OPEN) {
+                    scan_token(s);
+                    ok = s->type == TOK_CLOSE;
+                    if (ok) scan_token(s);
+                }
+                operand = 0;
+                break;
+
+            case TX_FUNCTION1: case TX_CLOSURE1:
+                ok = parse_push_operator(&p, PARSE_PREFIX, 0, s->type, s->function, s->context);
+                scan_token(s);
+                break;
+
+            case TX_FUNCTION2: case TX_FUNCTION3: case TX_FUNCTION4:
+            case TX_FUNCTION5: case TX_FUNCTION6:
+            case TX_CLOSURE2: case TX_CLOSURE3: case TX_CLOSURE4:
+            case TX_CLOSURE5: case TX_CLOSURE6:
+                ok = parse_push_operator(&p, PARSE_CALL, 0, s->type, s->function, s->context);
+                scan_token(s);
+                if (ok) ok = s->type == TOK_OPEN;
+                if (ok) scan_token(s);
+                break;
+
+            case TOK_LOOP:
+                {
+                    loop *l = loop_open(s);
+                    if (!l) {
+                        p.failed = s->type != TOK_ERROR;
+                        ok = 0;
+                        break;
+                    }
+                    ok = parse_push_operator(&p, PARSE_CALL, 0, TX_FUNCTION3, 0, l);
+                    if (!ok) loop_discard(s, l);
+                    scan_token(s);
+                }
+                break;
+
+            case TOK_OPEN:
+                ok = parse_push_operator(&p, PARSE_GROUP, 0, 0, 0, 0);
+                scan_token(s);
+                break;
+
+            default:
+                ok = 0;
+                break;
+            }
+
+            /* A finished base takes its pending signs and one-argument calls. */
+            if (ok && !operand) ok = parse_reduce(&p, PARSE_PREFIX, 0);
+            continue;
+        }
+
+        parse_operator *top;
+        if (s->type == TOK_INFIX) {
+            const int prec = (s->function == add || s->function == sub) ? 2 : (s->function == cpow) ? 4 : 3;
+            ok = parse_reduce(&p, PARSE_BINARY, prec) &&
+                 parse_push_operator(&p, PARSE_BINARY, prec, TX_FUNCTION2 | TX_FLAG_PURE, s->function, 0);
+            scan_token(s);
+            operand = 1;
+            continue;
+        }
+
+        switch (s->type) {
+        case TOK_SEP:
+            ok = parse_reduce(&p, PARSE_BINARY, 0);
+            top = p.operator_count ? p.operators + p.operator_count - 1 : 0;
+            if (!ok) break;
+            if (top && top->kind == PARSE_CALL) {
+                ok = ++top->args < ARITY(top->type);
+            } else {
+                ok = parse_push_operator(&p, PARSE_BINARY, 1, TX_FUNCTION2 | TX_FLAG_PURE, comma, 0);
+            }
+            scan_token(s);
+            operand = 1;
+            break;
+
+        case TOK_CLOSE:
+            ok = parse_reduce(&p, PARSE_BINARY, 0);
+            top = p.operator_count ? p.operators + p.operator_count - 1 : 0;
+            if (!ok) break;
+            if (!top || (top->kind == PARSE_CALL && top->args != ARITY(top->type) - 1)) {
+                ok = 0;
+                break;
+            }
+            --p.operator_count;
+            if (top->kind == PARSE_CALL) ok = parse_apply(&p, top);
+            if (ok) ok = parse_reduce(&p, PARSE_PREFIX, 0);
+            if (s->type != TOK_ERROR) scan_token(s);
+            break;
+
+        case TOK_END:
+            ok = parse_reduce(&p, PARSE_BINARY, 0) && p.operator_count == 0;
+            done = 1;
+            break;
+
+        default:
+            ok = 0;
+            break;
+        }
+    }
+
+    tx_expr *ret = 0;
+    if (ok) {
+        ret = p.operands[0].node;
+        if (error) *error = 0;
+    } else {
+        int i;
+        for (i = 0; i < p.operand_count; ++i) free_expr(s->arena, p.operands[i].node);
+        for (i = p.operator_count - 1; i >= 0; --i) {
+            if (p.operators[i].kind == PARSE_CALL && !p.operators[i].function) loop_discard(s, p.operators[i].context);
+        }
+        if (error) {
+            *error = p.failed ? -1 : (int)(s->next - s->start);
+            if (*error == 0) *error = 1;
+        }
+    }
+
+    if (s->compiler) {
+        s->compiler->operands = p.operands;
+        s->compiler->operand_capacity = p.operand_capacity;
+        s->compiler->operators = p.operators;
+        s->compiler->operator_capacity = p.operator_capacity;
+    } else {
+        free(p.operands);
+        free(p.operators);
+    }
+    return ret;
+}
+
+
+static d_cx call_array(const void *function, void *context, int arity, const d_cx *a) {
+    /* Calls an array-form callback on a single point. */
+    const d_cx *args[6];
+    d_cx ret;
+    int i;
+    for (i = 0; i < arity; ++i) args[i] = a + i;
+    ((tx_array_fn)function)(context, args, &ret, 1);
+    return ret;
+}
+
+
+static d_cx eval_array(const tx_expr *n) {
+    const int arity = ARITY(n->type);
+    d_cx a[6];
+    int i;
+    for (i = 0; i < arity; ++i) a[i] = tx_eval(n->parameters[i]);
+    return call_array(n->function, IS_CLOSURE(n->type) ? n->parameters[arity] : 0, arity, a);
+}
+
+
+#define TX_FUN(...) ((d_cx(*)(__VA_ARGS__))n->function)
+#define M(e) tx_eval(n->parameters[e])
+
+
+d_cx tx_eval(const tx_expr *n) {
+    if (!n) return NAN;
+    if (IS_ARRAY(n->type) && (IS_FUNCTION(n->type) || IS_CLOSURE(n->type))) return eval_array(n);
+
+    switch(TYPE_MASK(n->type)) {
+    case TX_CONSTANT: return n->value;
+    case TX_VARIABLE: return *n->bound;
+
+    case TX_FUNCTION0: case TX_FUNCTION1: case TX_FUNCTION2: case TX_FUNCTION3:
+    case TX_FUNCTION4: case TX_FUNCTION5: case TX_FUNCTION6:
+        switch(ARITY(n->type)) {
+        case 0: return TX_FUN(void)();
+        case 1: return TX_FUN(d_cx)(M(0));
+        case 2: return TX_FUN(d_cx, d_cx)(M(0), M(1));
+        case 3: return TX_FUN(d_cx, d_cx, d_cx)(M(0), M(1), M(2));
+        case 4: return TX_FUN(d_cx, d_cx, d_cx, d_cx)(M(0), M(1), M(2), M(3));
         case 5: return TX_FUN(d_cx, d_cx, d_cx, d_cx, d_cx)(M(0), M(1), M(2), M(3), M(4));
         case 6: return TX_FUN(d_cx, d_cx, d_cx, d_cx, d_cx, d_cx)(M(0), M(1), M(2), M(3), M(4), M(5));
         default: return NAN;
@@ -550,7 +1902,7 @@ d_cx tx_eval(const tx_expr *n) {
 #undef TX_FUN
 #undef M
 
-static void optimize(tx_expr *n) {
+static void optimize(tx_expr *n, tx_arena *arena) {
     /* Evaluates as much as possible. */
     if (n->type == TX_CONSTANT) return;
     if (n->type == TX_VARIABLE) return;
@@ -561,14 +1913,14 @@ static void optimize(tx_expr *n) {
         int known = 1;
         int i;
         for (i = 0; i < arity; ++i) {
-            optimize(n->parameters[i]);
+            optimize(n->parameters[i], arena);
             if (((tx_expr*)(n->parameters[i]))->type != TX_CONSTANT) {
                 known = 0;
             }
         }
         if (known) {
             const d_cx value = tx_eval(n);
-            tx_free_parameters(n);
+            free_parameters(arena, n);
             n->type = TX_CONSTANT;
             n->value = value;
         }
@@ -576,76 +1928,6486 @@ static void optimize(tx_expr *n) {
 }
 
 
-tx_expr *tx_compile(const char *expression, const tx_variable *variables, int var_count, int *error) {
-    state s;
-    s.start = s.next = expression;
-    s.lookup = variables;
-    s.lookup_len = var_count;
+/* Largest integer exponent rewritten into a multiply chain. */
+#define SIMPLIFY_MAX_POWER 64
 
-    tx_next_token(&s);
-    tx_expr *root = list(&s);
-    if (root == NULL) {
-        if (error) *error = -1;
-        return NULL;
+#define IS_CALL(n, arity, f) (TYPE_MASK((n)->type) == TX_FUNCTION##arity && (n)->function == (f))
+#define IS_VALUE(n, v) ((n)->type == TX_CONSTANT && (n)->value == (v))
+
+
+static tx_expr *unwrap(tx_expr *n, int keep, tx_arena *arena) {
+    /* Replaces n by its parameter keep, freeing the rest. */
+    tx_expr *ret = n->parameters[keep];
+    n->parameters[keep] = 0;
+    free_expr(arena, n);
+    return ret;
+}
+
+
+static tx_expr *simplify(tx_expr *n, tx_arena *arena, int flags) {
+    /* Rewrites the tree bottom-up. Flags select rewrites that may change results */
+    /* in the last bits or for infinities, NaNs and signed zeros. */
+    const int arity = ARITY(n->type);
+    int i;
+
+    for (i = 0; i < arity; ++i) {
+        n->parameters[i] = simplify(n->parameters[i], arena, flags);
+        CHECK_NULL(n->parameters[i], free_expr(arena, n));
     }
+    if (!IS_FUNCTION(n->type) || !IS_PURE(n->type)) return n;
 
-    if (s.type != TOK_END) {
-        tx_free(root);
-        if (error) {
-            *error = (s.next - s.start);
-            if (*error == 0) *error = 1;
+    tx_expr *a = arity > 0 ? n->parameters[0] : 0;
+    tx_expr *b = arity > 1 ? n->parameters[1] : 0;
+
+    /* Exact in every case. */
+    if (IS_CALL(n, 1, negate) && IS_CALL(a, 1, negate)) {
+        return unwrap(unwrap(n, 0, arena), 0, arena);
+    }
+    if ((IS_CALL(n, 2, add) || IS_CALL(n, 2, sub)) && IS_CALL(b, 1, negate)) {
+        n->function = (n->function == add) ? (const void*)sub : (const void*)add;
+        n->parameters[1] = unwrap(b, 0, arena);
+        return n;
+    }
+
+    if (flags & TX_SIMPLIFY_IDENTITIES) {
+        if (IS_CALL(n, 2, add) && IS_VALUE(b, 0)) return unwrap(n, 0, arena);
+        if (IS_CALL(n, 2, add) && IS_VALUE(a, 0)) return unwrap(n, 1, arena);
+        if (IS_CALL(n, 2, sub) && IS_VALUE(b, 0)) return unwrap(n, 0, arena);
+        if (IS_CALL(n, 2, mul) && IS_VALUE(b, 1)) return unwrap(n, 0, arena);
+        if (IS_CALL(n, 2, mul) && IS_VALUE(a, 1)) return unwrap(n, 1, arena);
+        if (IS_CALL(n, 2, divide) && IS_VALUE(b, 1)) return unwrap(n, 0, arena);
+        if (IS_CALL(n, 2, cpow) && IS_VALUE(b, 1)) return unwrap(n, 0, arena);
+        if (IS_CALL(n, 2, cpow) && IS_VALUE(b, 0)) {
+            free_parameters(arena, n);
+            n->type = TX_CONSTANT;
+            n->value = 1;
+            return n;
         }
-        return 0;
-    } else {
-        optimize(root);
-        if (error) *error = 0;
-        return root;
+        if ((IS_CALL(n, 2, sub) && IS_VALUE(a, 0)) || (IS_CALL(n, 2, mul) && IS_VALUE(b, -1))) {
+            tx_expr *x = unwrap(n, IS_VALUE(a, 0) ? 1 : 0, arena);
+            if (IS_CALL(x, 1, negate)) return unwrap(x, 0, arena);
+
+            tx_expr *ret = NEW_EXPR(arena, TX_FUNCTION1 | TX_FLAG_PURE, x);
+            CHECK_NULL(ret, free_expr(arena, x));
+            ret->function = negate;
+            return ret;
+        }
+    }
+
+    if ((flags & TX_SIMPLIFY_POWERS) && IS_CALL(n, 2, cpow) && b->type == TX_CONSTANT && cimag(b->value) == 0) {
+        const double e = creal(b->value);
+        if (e == 2) {
+            free_expr(arena, b);
+            n->type = TX_FUNCTION1 | TX_FLAG_PURE;
+            n->function = square;
+        } else if (e >= -SIMPLIFY_MAX_POWER && e <= SIMPLIFY_MAX_POWER && e == (int)e && e != 0 && e != 1) {
+            n->function = ipow;
+        } else if (e == 0.5 || e == -0.5) {
+            free_expr(arena, b);
+            n->type = TX_FUNCTION1 | TX_FLAG_PURE;
+            n->function = csqrt;
+            if (e < 0) {
+                tx_expr *one = new_expr(arena, TX_CONSTANT, 0);
+                CHECK_NULL(one, free_expr(arena, n));
+                one->value = 1;
+                tx_expr *ret = NEW_EXPR(arena, TX_FUNCTION2 | TX_FLAG_PURE, one, n);
+                CHECK_NULL(ret, free_expr(arena, one), free_expr(arena, n));
+                ret->function = divide;
+                return ret;
+            }
+        }
+        return n;
+    }
+
+    if ((flags & TX_SIMPLIFY_RECIPROCAL) && IS_CALL(n, 2, divide) && b->type == TX_CONSTANT && b->value != 0) {
+        n->function = mul;
+        b->value = 1 / b->value;
     }
+
+    return n;
 }
 
 
-d_cx tx_interp(const char *expression, int *error) {
-    tx_expr *n = tx_compile(expression, 0, 0, error);
+/* Horner form. A sum is read as a polynomial in the variable raised to the
+ * highest constant power in its terms; terms that do not factor into a
+ * coefficient times a power of it join the constant coefficient. Each
+ * coefficient is still evaluated once, and the new nodes are pure built-ins. */
 
-    d_cx ret;
-    if (n) {
-        ret = tx_eval(n);
-        tx_free(n);
+#define HORNER_MAX_DEGREE SIMPLIFY_MAX_POWER
+#define IS_SUM(n) (IS_CALL(n, 2, add) || IS_CALL(n, 2, sub))
+
+static int depends(const tx_expr *n, const d_cx *wrt);
+
+
+static int horner_power(const tx_expr *n, const tx_expr **base) {
+    /* The constant exponent of n as base^e, or 1 with n itself as the base. */
+    *base = n;
+    if (IS_CALL(n, 1, square)) {
+        *base = n->parameters[0];
+        return 2;
+    }
+    if (IS_CALL(n, 2, cpow) || IS_CALL(n, 2, ipow)) {
+        const tx_expr *b = n->parameters[1];
+        if (b->type != TX_CONSTANT || cimag(b->value) != 0) return 1;
+        const double e = creal(b->value);
+        if (!(e >= 1 && e <= HORNER_MAX_DEGREE) || e != (int)e) return 1;
+        *base = n->parameters[0];
+        return (int)e;
+    }
+    return 1;
+}
+
+
+static void horner_pick(const tx_expr *n, int spine, const tx_expr **z, int *degree) {
+    /* Finds the variable under the highest power in the terms of the sum n. */
+    const tx_expr *base;
+    if (spine && IS_SUM(n)) {
+        horner_pick(n->parameters[0], 1, z, degree);
+        horner_pick(n->parameters[1], 1, z, degree);
+    } else if (IS_CALL(n, 1, negate)) {
+        horner_pick(n->parameters[0], spine, z, degree);
+    } else if (IS_CALL(n, 2, mul)) {
+        horner_pick(n->parameters[0], 0, z, degree);
+        horner_pick(n->parameters[1], 0, z, degree);
+    } else if (IS_CALL(n, 2, divide)) {
+        horner_pick(n->parameters[0], 0, z, degree);
     } else {
-        ret = NAN;
+        const int e = horner_power(n, &base);
+        if (e > *degree && TYPE_MASK(base->type) == TX_VARIABLE) {
+            *z = base;
+            *degree = e;
+        }
+    }
+}
+
+
+static int horner_degree(const tx_expr *n, const d_cx *z) {
+    /* The power of z in the product n, or -1 where n is not a coefficient times one. */
+    const tx_expr *base;
+    if (IS_CALL(n, 1, negate)) return horner_degree(n->parameters[0], z);
+    if (IS_CALL(n, 2, mul)) {
+        const int a = horner_degree(n->parameters[0], z);
+        const int b = horner_degree(n->parameters[1], z);
+        return (a < 0 || b < 0 || a + b > HORNER_MAX_DEGREE) ? -1 : a + b;
     }
+    if (IS_CALL(n, 2, divide) && !depends(n->parameters[1], z)) return horner_degree(n->parameters[0], z);
+
+    const int e = horner_power(n, &base);
+    if (TYPE_MASK(base->type) == TX_VARIABLE && base->bound == z) return e;
+    return depends(n, z) ? -1 : 0;
+}
+
+
+static int horner_top(const tx_expr *n, const d_cx *z) {
+    /* The highest power of z among the terms of the sum n. */
+    if (IS_SUM(n)) {
+        const int a = horner_top(n->parameters[0], z);
+        const int b = horner_top(n->parameters[1], z);
+        return a > b ? a : b;
+    }
+    if (IS_CALL(n, 1, negate)) return horner_top(n->parameters[0], z);
+    return horner_degree(n, z);
+}
+
+
+static tx_expr *horner_strip(tx_expr *n, const d_cx *z, tx_arena *arena) {
+    /* Drops the powers of z from a product horner_degree accepted, leaving 1 */
+    /* where nothing else is left. Allocates nothing. */
+    if (IS_CALL(n, 1, negate) || IS_CALL(n, 2, divide)) {
+        n->parameters[0] = horner_strip(n->parameters[0], z, arena);
+        return n;
+    }
+    if (IS_CALL(n, 2, mul)) {
+        n->parameters[0] = horner_strip(n->parameters[0], z, arena);
+        n->parameters[1] = horner_strip(n->parameters[1], z, arena);
+        if (IS_VALUE((tx_expr*)n->parameters[0], 1)) return unwrap(n, 1, arena);
+        if (IS_VALUE((tx_expr*)n->parameters[1], 1)) return unwrap(n, 0, arena);
+        return n;
+    }
+    if (depends(n, z)) {
+        free_parameters(arena, n);
+        n->type = TX_CONSTANT;
+        n->value = 1;
+    }
+    return n;
+}
+
+
+static void horner_collect(tx_expr **sum, tx_expr *term, int negative, tx_arena *arena, int *failed) {
+    /* Adds term to *sum, or subtracts it, starting the sum where there is none. */
+    if (*failed) {
+        free_expr(arena, term);
+        return;
+    }
+    if (!*sum && !negative) {
+        *sum = term;
+        return;
+    }
+
+    tx_expr *ret = *sum ? NEW_EXPR(arena, TX_FUNCTION2 | TX_FLAG_PURE, *sum, term)
+                        : NEW_EXPR(arena, TX_FUNCTION1 | TX_FLAG_PURE, term);
+    if (!ret) {
+        free_expr(arena, term);
+        *failed = 1;
+        return;
+    }
+    ret->function = !*sum ? (const void*)negate : negative ? (const void*)sub : (const void*)add;
+    *sum = ret;
+}
+
+
+static void horner_split(tx_expr *n, const d_cx *z, int negative, tx_expr **c, tx_arena *arena, int *failed) {
+    /* Takes the sum n apart into the coefficients c, by power of z. */
+    if (IS_SUM(n) || IS_CALL(n, 1, negate)) {
+        const int flip = n->function != add;
+        tx_expr *a = n->parameters[0];
+        tx_expr *b = IS_SUM(n) ? n->parameters[1] : 0;
+        n->parameters[0] = 0;
+        if (b) n->parameters[1] = 0;
+        free_expr(arena, n);
+        horner_split(a, z, b ? negative : !negative, c, arena, failed);
+        if (b) horner_split(b, z, flip ? !negative : negative, c, arena, failed);
+        return;
+    }
+
+    int degree = horner_degree(n, z);
+    if (degree < 0) degree = 0;
+    else n = horner_strip(n, z, arena);
+    horner_collect(c + degree, n, negative, arena, failed);
+}
+
+
+static tx_expr *horner_z(int type, const d_cx *z, int e, tx_arena *arena) {
+    /* A new z^e. */
+    tx_expr *v = new_expr(arena, type, 0);
+    CHECK_NULL(v);
+    v->bound = z;
+    if (e == 1) return v;
+
+    tx_expr *k = 0;
+    if (e > 2) {
+        k = new_expr(arena, TX_CONSTANT, 0);
+        CHECK_NULL(k, free_expr(arena, v));
+        k->value = e;
+    }
+    tx_expr *ret = k ? NEW_EXPR(arena, TX_FUNCTION2 | TX_FLAG_PURE, v, k) : NEW_EXPR(arena, TX_FUNCTION1 | TX_FLAG_PURE, v);
+    CHECK_NULL(ret, free_expr(arena, v), free_expr(arena, k));
+    ret->function = k ? (const void*)ipow : (const void*)square;
     return ret;
 }
 
 
-static void pn (const tx_expr *n, int depth) {
-    int i, arity;
-    printf("%*s", depth, "");
+static tx_expr *horner_step(tx_expr *p, tx_expr *x, tx_expr *c, tx_arena *arena) {
+    /* p*x + c, or p*x without c, taking ownership of all three. */
+    tx_expr *ret = 0;
+    if (p && x) {
+        if (IS_VALUE(p, 1)) {
+            free_expr(arena, p);
+            if (!c) return x;
+            p = 0;
+            ret = NEW_EXPR(arena, TX_FUNCTION2 | TX_FLAG_PURE, x, c);
+            if (ret) ret->function = add;
+        } else if (!c) {
+            ret = NEW_EXPR(arena, TX_FUNCTION2 | TX_FLAG_PURE, p, x);
+            if (ret) ret->function = mul;
+        } else {
+            ret = NEW_EXPR(arena, TX_FUNCTION3 | TX_FLAG_PURE, p, x, c);
+            if (ret) ret->function = cfma;
+        }
+    }
+    CHECK_NULL(ret, free_expr(arena, p), free_expr(arena, x), free_expr(arena, c));
+    return ret;
+}
 
-    switch(TYPE_MASK(n->type)) {
-    case TX_CONSTANT: tx_print_num(&n->value); break;
-    case TX_VARIABLE: printf("bound %p\n", n->bound); break;
 
-    case TX_FUNCTION0: case TX_FUNCTION1: case TX_FUNCTION2: case TX_FUNCTION3:
-    case TX_FUNCTION4: case TX_FUNCTION5: case TX_FUNCTION6:
-    case TX_CLOSURE0: case TX_CLOSURE1: case TX_CLOSURE2: case TX_CLOSURE3:
-    case TX_CLOSURE4: case TX_CLOSURE5: case TX_CLOSURE6:
-        arity = ARITY(n->type);
-        printf("f%d", arity);
-        for(i = 0; i < arity; i++) {
-            printf(" %p", n->parameters[i]);
+static tx_expr *horner(tx_expr *n, tx_arena *arena);
+
+static tx_expr *horner_rewrite(tx_expr *n, const tx_expr *variable, int top, tx_arena *arena) {
+    /* Builds ((c[top] z + c[top-1]) z + ...) z + c[0] from n, skipping the missing powers. */
+    const int type = variable->type;
+    const d_cx *z = variable->bound;
+    tx_expr *c[HORNER_MAX_DEGREE + 1];
+    int failed = 0, d, last;
+
+    memset(c, 0, sizeof(c));
+    horner_split(n, z, 0, c, arena, &failed);
+
+    /* What is left may be a polynomial in another variable. */
+    if (!failed && c[0] && IS_SUM(c[0])) {
+        c[0] = horner(c[0], arena);
+        failed = !c[0];
+    }
+
+    tx_expr *p = 0;
+    if (!failed) {
+        p = c[top];
+        c[top] = 0;
+    }
+    for (d = last = top; p && d-- > 0; ) {
+        if (!c[d]) continue;
+        p = horner_step(p, horner_z(type, z, last - d, arena), c[d], arena);
+        c[d] = 0;
+        last = d;
+    }
+    if (p && last) p = horner_step(p, horner_z(type, z, last, arena), 0, arena);
+
+    if (!p) {
+        for (d = 0; d <= top; ++d) free_expr(arena, c[d]);
+    }
+    return p;
+}
+
+
+static int horner_terms(tx_expr *n, tx_arena *arena) {
+    /* Rewrites inside the terms of the sum n. Returns 0 when out of memory. */
+    const int arity = ARITY(n->type);
+    int i;
+    for (i = 0; i < arity; ++i) {
+        tx_expr *t = n->parameters[i];
+        if (IS_SUM(t) || IS_CALL(t, 1, negate)) {
+            if (!horner_terms(t, arena)) return 0;
+        } else {
+            n->parameters[i] = horner(t, arena);
+            if (!n->parameters[i]) return 0;
         }
-        printf("\n");
-        for(i = 0; i < arity; i++) {
-            pn(n->parameters[i], depth + 1);
+    }
+    return 1;
+}
+
+
+static tx_expr *horner(tx_expr *n, tx_arena *arena) {
+    /* Rewrites the polynomial sums in n, the terms of a sum before the sum itself. */
+    /* Returns NULL when out of memory. */
+    const int arity = ARITY(n->type);
+    int i;
+
+    if (IS_SUM(n)) {
+        const tx_expr *z = 0;
+        int top = 1;
+        if (!horner_terms(n, arena)) {
+            free_expr(arena, n);
+            return NULL;
         }
-        break;
+        horner_pick(n, 1, &z, &top);
+        if (z) top = horner_top(n, z->bound);
+        return (z && top >= 2) ? horner_rewrite(n, z, top, arena) : n;
+    }
+
+    for (i = 0; i < arity; ++i) {
+        n->parameters[i] = horner(n->parameters[i], arena);
+        CHECK_NULL(n->parameters[i], free_expr(arena, n));
     }
+    return n;
 }
 
+#undef HORNER_MAX_DEGREE
+#undef IS_SUM
+#undef IS_CALL
+#undef IS_VALUE
 
-void tx_print(const tx_expr *n) {
-    pn(n, 0);
+
+/* Complex built-ins that map real arguments to real results, and the */
+/* kernels that compute them on doubles. */
+static const struct {const void *cx; const void *re;} real_kernels[] = {
+    {add, radd}, {sub, rsub}, {mul, rmul}, {divide, rdivide}, {negate, rnegate},
+    {square, rsquare}, {ipow, ripow}, {_cabs, rabs},
+    {csin, rsin}, {ccos, rcos}, {ctan, rtan}, {csinh, rsinh}, {ccosh, rcosh}, {ctanh, rtanh},
+    {cexp, rexp}, {catan, ratan}, {casinh, rasinh}, {cfma, rfma},
+    {0, 0}
+};
+
+
+static int realify(tx_expr *n) {
+    /* Marks subtrees that are provably real and moves them onto double kernels. */
+    /* Returns whether n is real. */
+    const int arity = ARITY(n->type);
+    int real = 1, last = 0;
+    int i;
+
+    switch (TYPE_MASK(n->type)) {
+    case TX_CONSTANT: return cimag(n->value) == 0;
+    case TX_VARIABLE: return (n->type & TX_FLAG_REAL) != 0;
+    }
+
+    for (i = 0; i < arity; ++i) {
+        last = realify(n->parameters[i]);
+        if (!last) real = 0;
+    }
+    if (!IS_FUNCTION(n->type) || !IS_PURE(n->type)) return 0;
+
+    /* Real whatever the argument. */
+    if (n->function == _carg || n->function == _creal || n->function == _cimag) return 1;
+    if (n->function == _cabs && !real) return 1;
+
+    if (n->function == comma) return last;
+    if (!real) return 0;
+
+    for (i = 0; real_kernels[i].cx; ++i) {
+        if (n->function == real_kernels[i].cx) {
+            n->function = real_kernels[i].re;
+            return 1;
+        }
+        if (n->function == real_kernels[i].re) return 1;
+    }
+    return n->function == conj;
+}
+
+
+static void fast_math(tx_expr *n, int flags) {
+    /* Puts the approximations of the tier in flags in place of the built-ins, or */
+    /* the built-ins back without a tier. */
+    const int arity = ARITY(n->type);
+    int i;
+    for (i = 0; i < arity; ++i) fast_math(n->parameters[i], flags);
+    if (!IS_FUNCTION(n->type) || IS_ARRAY(n->type)) return;
+
+    const int k = fast_find(n->function);
+    if (k < 0) return;
+    if (flags & TX_FAST_MATH_LOW) n->function = fast_kernels[k].low;
+    else if (flags & TX_FAST_MATH) n->function = fast_kernels[k].fast;
+    else n->function = fast_kernels[k].exact;
+}
+
+
+static int fast_tier(const tx_expr *n) {
+    /* The flag of the first approximation found in n, or 0. */
+    const int arity = ARITY(n->type);
+    int i, tier = 0;
+    if (IS_FUNCTION(n->type) && !IS_ARRAY(n->type)) {
+        const int k = fast_find(n->function);
+        if (k >= 0 && n->function == fast_kernels[k].fast) return TX_FAST_MATH;
+        if (k >= 0 && n->function == fast_kernels[k].low) return TX_FAST_MATH_LOW;
+    }
+    for (i = 0; i < arity && !tier; ++i) tier = fast_tier(n->parameters[i]);
+    return tier;
+}
+
+
+static tx_expr *compile(const char *expression, const tx_variable *variables, int var_count,
+                        const tx_options *options, tx_arena *arena, tx_compiler *compiler, int *error) {
+    const int flags = options ? options->flags : 0;
+    state s;
+    s.start = s.next = expression;
+    s.lookup = variables;
+    s.lookup_len = var_count;
+    s.symtab = options ? options->symtab : 0;
+    s.arena = arena;
+    s.compiler = compiler;
+    s.flags = flags;
+    s.scope = 0;
+
+    tx_expr *root;
+    if (flags & TX_PARSE_ITERATIVE) {
+        s.end = expression + (options->length ? options->length : strlen(expression));
+        root = parse_iterative(&s, options->max_depth, error);
+        CHECK_NULL(root);
+    } else {
+        s.end = 0;
+        tx_next_token(&s);
+        root = list(&s);
+        if (root == NULL) {
+            if (error) *error = -1;
+            return NULL;
+        }
+
+        if (s.type != TOK_END) {
+            free_expr(arena, root);
+            if (error) {
+                *error = (s.next - s.start);
+                if (*error == 0) *error = 1;
+            }
+            return 0;
+        }
+    }
+
+    optimize(root, arena);
+    root = simplify(root, arena, flags);
+    if (root && (flags & TX_SIMPLIFY_HORNER)) root = horner(root, arena);
+    if (root == NULL) {
+        if (error) *error = -1;
+        return NULL;
+    }
+    optimize(root, arena);
+    realify(root);
+    if (flags & (TX_FAST_MATH | TX_FAST_MATH_LOW)) fast_math(root, flags);
+    if (error) *error = 0;
+    return root;
+}
+
+
+tx_expr *tx_compile(const char *expression, const tx_variable *variables, int var_count, int *error) {
+    return compile(expression, variables, var_count, 0, 0, 0, error);
+}
+
+
+#define EXPR_ALIGN offsetof(struct {char c; tx_expr n;}, n)
+
+static size_t loop_packed_size(const loop *l);
+static loop *loop_pack(const loop *l, char **cursor);
+
+static size_t packed_size(const tx_expr *n) {
+    const int arity = ARITY(n->type);
+    size_t size = (node_size(n->type) + EXPR_ALIGN - 1) / EXPR_ALIGN * EXPR_ALIGN;
+    int i;
+    for (i = 0; i < arity; ++i) size += packed_size(n->parameters[i]);
+    if (is_loop(n)) size += loop_packed_size(n->parameters[arity]);
+    return size;
+}
+
+
+static tx_expr *pack(const tx_expr *n, char **cursor) {
+    /* Copies the subtree in pre-order, so the root comes first. */
+    const int arity = ARITY(n->type);
+    const int size = node_size(n->type);
+    tx_expr *ret = (tx_expr*)*cursor;
+    int i;
+
+    memcpy(ret, n, size);
+    *cursor += (size + EXPR_ALIGN - 1) / EXPR_ALIGN * EXPR_ALIGN;
+    for (i = 0; i < arity; ++i) ret->parameters[i] = pack(n->parameters[i], cursor);
+    if (is_loop(n)) ret->parameters[arity] = loop_pack(n->parameters[arity], cursor);
+    return ret;
+}
+
+
+static char *compile_packed(const char *expression, const tx_variable *variables, int var_count,
+                            const tx_options *options, size_t header, int *error) {
+    /* Parses into a private arena and packs the result into a single block, after */
+    /* header bytes left to the caller. */
+    tx_arena *arena = tx_arena_create(0);
+    if (!arena) {
+        if (error) *error = -1;
+        return NULL;
+    }
+
+    tx_expr *root = compile(expression, variables, var_count, options, arena, 0, error);
+    char *ret = 0;
+    if (root) {
+        const size_t size = packed_size(root);
+        ret = malloc(header + size);
+        if (ret) {
+            char *cursor = ret + header;
+            ALLOC_COUNT(packed_trees, 1);
+            ALLOC_COUNT(packed_bytes, header + size);
+            pack(root, &cursor);
+        } else if (error) {
+            *error = -1;
+        }
+    }
+
+    tx_arena_free(arena);
+    return ret;
+}
+
+
+tx_expr *tx_compile_ex(const char *expression, const tx_variable *variables, int var_count,
+                       const tx_options *options, int *error) {
+    tx_arena *arena = options ? options->arena : 0;
+    if (arena) return compile(expression, variables, var_count, options, arena, 0, error);
+
+    return (tx_expr*)compile_packed(expression, variables, var_count, options, 0, error);
+}
+
+
+/* Reentrant compilation. A compiler owns everything a compile touches besides
+ * the input: a private copy of the bindings, an arena and the iterative
+ * parser's stacks. Once these have grown to fit, compiles make no heap calls. */
+tx_compiler *tx_compiler_create(const tx_variable *variables, int var_count) {
+    tx_compiler *c = calloc(1, sizeof(tx_compiler));
+    CHECK_NULL(c);
+
+    c->arena = tx_arena_create(0);
+    c->symtab = tx_symtab_create(variables, var_count);
+    if (!c->arena || !c->symtab) {
+        tx_compiler_free(c);
+        return NULL;
+    }
+    return c;
+}
+
+
+tx_expr *tx_compiler_compile(tx_compiler *c, const char *expression, const tx_options *options, int *error) {
+    if (!c) {
+        if (error) *error = -1;
+        return NULL;
+    }
+
+    tx_options o;
+    if (options) {
+        o = *options;
+    } else {
+        memset(&o, 0, sizeof(o));
+    }
+    o.arena = c->arena;
+    o.symtab = c->symtab;
+    return compile(expression, 0, 0, &o, c->arena, c, error);
+}
+
+
+void tx_compiler_reset(tx_compiler *c) {
+    if (c) tx_arena_reset(c->arena);
+}
+
+
+void tx_compiler_free(tx_compiler *c) {
+    if (!c) return;
+    tx_arena_free(c->arena);
+    tx_symtab_free(c->symtab);
+    free(c->operands);
+    free(c->operators);
+    free(c);
+}
+
+
+d_cx tx_interp(const char *expression, int *error) {
+    tx_expr *n = tx_compile(expression, 0, 0, error);
+
+    d_cx ret;
+    if (n) {
+        ret = tx_eval(n);
+        tx_free(n);
+    } else {
+        ret = NAN;
+    }
+    return ret;
+}
+
+
+/* Flat postfix bytecode. Built-in infix operators and constants get their own
+ * opcodes so that the evaluation loop neither chases child pointers nor makes
+ * indirect calls for them. */
+enum {
+    OP_CONST, OP_VAR,
+    OP_ADD, OP_SUB, OP_MUL, OP_DIV, OP_POW, OP_NEG, OP_COMMA,
+    OP_RADD, OP_RSUB, OP_RMUL, OP_RDIV, OP_RNEG,
+    OP_FUNCTION, OP_CLOSURE,
+    OP_STORE, OP_LOAD, OP_ARG, OP_OUT, OP_ARRAY
+};
+
+
+typedef struct tx_instr {
+    int op;
+    int arity;
+    union {d_cx value; const d_cx *bound; const void *function; int slot;};
+    void *context;
+} tx_instr;
+
+
+struct tx_program {
+    int length;
+    int depth;
+    int slots;
+    int outputs;        /* Values popped by OP_OUT; 0 for a single expression. */
+    tx_instr code[1];
+};
+
+
+/* Programs needing no more stack and slots than this evaluate without touching the heap. */
+#define PROGRAM_STACK 64
+
+
+static int infix_op(const tx_expr *n) {
+    if (TYPE_MASK(n->type) == TX_FUNCTION1) {
+        if (n->function == negate) return OP_NEG;
+        if (n->function == rnegate) return OP_RNEG;
+    } else if (TYPE_MASK(n->type) == TX_FUNCTION2) {
+        if (n->function == add) return OP_ADD;
+        if (n->function == sub) return OP_SUB;
+        if (n->function == mul) return OP_MUL;
+        if (n->function == divide) return OP_DIV;
+        if (n->function == cpow) return OP_POW;
+        if (n->function == comma) return OP_COMMA;
+        if (n->function == radd) return OP_RADD;
+        if (n->function == rsub) return OP_RSUB;
+        if (n->function == rmul) return OP_RMUL;
+        if (n->function == rdivide) return OP_RDIV;
+    }
+    return -1;
+}
+
+
+/* Lowering shares identical pure subtrees. Every node gets a class by
+ * hash-consing on its type, payload and child classes; a class that is used
+ * more than once is computed the first time, kept in a slot and loaded from
+ * there afterwards. Bound variables are assumed not to change during one
+ * evaluation. */
+
+typedef struct cse_class {
+    const tx_expr *node;
+    unsigned hash;
+    int children[7];
+    int shared;
+    int uses;
+    int slot;
+} cse_class;
+
+
+typedef struct lowering {
+    int *ids;           /* Class of every node, in pre-order. */
+    int *sizes;         /* Subtree size of every node, in pre-order. */
+    cse_class *classes;
+    int class_count;
+    int *table;
+    unsigned table_mask;
+    int slots;
+    tx_instr *code;
+    int length;
+} lowering;
+
+
+static int node_count(const tx_expr *n) {
+    const int arity = ARITY(n->type);
+    int count = 1;
+    int i;
+    for (i = 0; i < arity; ++i) count += node_count(n->parameters[i]);
+    return count;
+}
+
+
+static int same_payload(const tx_expr *a, const tx_expr *b) {
+    if (a->type != b->type) return 0;
+    switch (TYPE_MASK(a->type)) {
+    case TX_CONSTANT: return memcmp(&a->value, &b->value, sizeof(d_cx)) == 0;
+    case TX_VARIABLE: return a->bound == b->bound;
+    }
+    if (a->function != b->function) return 0;
+    return !IS_CLOSURE(a->type) || a->parameters[ARITY(a->type)] == b->parameters[ARITY(b->type)];
+}
+
+
+static int lower_classify(lowering *l, const tx_expr *n, int *index) {
+    const int at = (*index)++;
+    const int arity = ARITY(n->type);
+    cse_class c;
+    int i;
+
+    memset(&c, 0, sizeof(c));
+    c.node = n;
+    c.slot = -1;
+
+    switch (TYPE_MASK(n->type)) {
+    case TX_CONSTANT: c.shared = 1; c.hash = hash_bytes(2166136261u, &n->value, sizeof(d_cx)); break;
+    case TX_VARIABLE: c.shared = 1; c.hash = hash_bytes(2166136261u, &n->bound, sizeof(n->bound)); break;
+    default:
+        c.shared = (IS_FUNCTION(n->type) || IS_CLOSURE(n->type)) && IS_PURE(n->type);
+        c.hash = hash_bytes(2166136261u, &n->function, sizeof(n->function));
+        if (IS_CLOSURE(n->type)) c.hash = hash_bytes(c.hash, &n->parameters[arity], sizeof(void*));
+        break;
+    }
+    c.hash = hash_bytes(c.hash, &n->type, sizeof(n->type));
+
+    for (i = 0; i < arity; ++i) {
+        c.children[i] = lower_classify(l, n->parameters[i], index);
+        c.shared = c.shared && l->classes[c.children[i]].shared;
+        c.hash = hash_bytes(c.hash, &c.children[i], sizeof(int));
+    }
+    l->sizes[at] = *index - at;
+
+    /* Only pure subtrees are looked up; anything else is a class of its own. */
+    unsigned probe = c.hash & l->table_mask;
+    if (c.shared) {
+        for (; l->table[probe] >= 0; probe = (probe + 1) & l->table_mask) {
+            const cse_class *o = l->classes + l->table[probe];
+            if (o->hash == c.hash && same_payload(o->node, n)
+                && memcmp(o->children, c.children, sizeof(int) * arity) == 0) {
+                return l->ids[at] = l->table[probe];
+            }
+        }
+        l->table[probe] = l->class_count;
+    }
+
+    l->classes[l->class_count] = c;
+    return l->ids[at] = l->class_count++;
+}
+
+
+static void lower_count(lowering *l, const tx_expr *n, int *index) {
+    /* Counts uses, not descending into repeated occurrences of a pure class. */
+    const int at = (*index)++;
+    const int arity = ARITY(n->type);
+    cse_class *c = l->classes + l->ids[at];
+    int i;
+
+    if (c->uses++ && c->shared) {
+        *index = at + l->sizes[at];
+        return;
+    }
+    for (i = 0; i < arity; ++i) lower_count(l, n->parameters[i], index);
+}
+
+
+static void lower_instr(const tx_expr *n, tx_instr *ins) {
+    const int arity = ARITY(n->type);
+
+    memset(ins, 0, sizeof(tx_instr));
+    ins->arity = arity;
+
+    switch (TYPE_MASK(n->type)) {
+    case TX_CONSTANT: ins->op = OP_CONST; ins->value = n->value; break;
+    case TX_VARIABLE: ins->op = OP_VAR; ins->bound = n->bound; break;
+
+    case TX_FUNCTION0: case TX_FUNCTION1: case TX_FUNCTION2: case TX_FUNCTION3:
+    case TX_FUNCTION4: case TX_FUNCTION5: case TX_FUNCTION6:
+        ins->op = infix_op(n);
+        if (ins->op < 0) ins->op = IS_ARRAY(n->type) ? OP_ARRAY : OP_FUNCTION;
+        ins->function = n->function;
+        break;
+
+    case TX_CLOSURE0: case TX_CLOSURE1: case TX_CLOSURE2: case TX_CLOSURE3:
+    case TX_CLOSURE4: case TX_CLOSURE5: case TX_CLOSURE6:
+        ins->op = IS_ARRAY(n->type) ? OP_ARRAY : OP_CLOSURE;
+        ins->function = n->function;
+        ins->context = n->parameters[arity];
+        break;
+
+    default: ins->op = OP_CONST; ins->value = NAN; break;
+    }
+}
+
+
+static void lower_emit(lowering *l, const tx_expr *n, int *index) {
+    const int at = (*index)++;
+    const int arity = ARITY(n->type);
+    cse_class *c = l->classes + l->ids[at];
+    const int reuse = c->shared && arity > 0 && c->uses > 1;
+    tx_instr *ins;
+    int i;
+
+    if (reuse && c->slot >= 0) {
+        ins = l->code + l->length++;
+        memset(ins, 0, sizeof(tx_instr));
+        ins->op = OP_LOAD;
+        ins->slot = c->slot;
+        *index = at + l->sizes[at];
+        return;
+    }
+
+    for (i = 0; i < arity; ++i) lower_emit(l, n->parameters[i], index);
+    lower_instr(n, l->code + l->length++);
+
+    if (reuse) {
+        c->slot = l->slots++;
+        ins = l->code + l->length++;
+        memset(ins, 0, sizeof(tx_instr));
+        ins->op = OP_STORE;
+        ins->slot = c->slot;
+    }
+}
+
+
+static int program_depth(const tx_program *p) {
+    int depth = 0, sp = 0;
+    int i;
+    for (i = 0; i < p->length; ++i) {
+        const tx_instr *ins = p->code + i;
+        switch (ins->op) {
+        case OP_CONST: case OP_VAR: case OP_LOAD: case OP_ARG: ++sp; break;
+        case OP_STORE: break;
+        case OP_OUT: --sp; break;
+        case OP_ADD: case OP_SUB: case OP_MUL: case OP_DIV: case OP_POW: case OP_COMMA: --sp; break;
+        case OP_RADD: case OP_RSUB: case OP_RMUL: case OP_RDIV: --sp; break;
+        case OP_NEG: case OP_RNEG: break;
+        default: sp += 1 - ins->arity; break;
+        }
+        if (sp > depth) depth = sp;
+    }
+    return depth;
+}
+
+
+static size_t loops_size(const tx_expr *n) {
+    const int arity = ARITY(n->type);
+    size_t size = is_loop(n) ? loop_packed_size(n->parameters[arity]) : 0;
+    int i;
+    for (i = 0; i < arity; ++i) size += loops_size(n->parameters[i]);
+    return size;
+}
+
+
+static void own_loops(tx_instr *code, int length, char *cursor) {
+    /* Programs keep their own copies of loops after the code, as they outlive the trees. */
+    int i;
+    for (i = 0; i < length; ++i) {
+        if (code[i].op == OP_CLOSURE && is_loop_call(code[i].function, code[i].arity)) {
+            code[i].context = loop_pack(code[i].context, &cursor);
+        }
+    }
+}
+
+
+static tx_program *lower_program(const tx_expr *const *roots, int count, int outputs) {
+    /* Lowers the roots in turn over one class table, so that they share their common */
+    /* subtrees. With outputs each root's value is then popped into its output. */
+    int nodes = 0, r;
+    size_t loops = 0;
+    for (r = 0; r < count; ++r) {
+        nodes += node_count(roots[r]);
+        loops += loops_size(roots[r]);
+    }
+
+    unsigned table_size = 1;
+    while (table_size < 2u * nodes) table_size *= 2;
+
+    lowering l;
+    memset(&l, 0, sizeof(l));
+    l.ids = malloc(sizeof(int) * nodes);
+    l.sizes = malloc(sizeof(int) * nodes);
+    l.classes = malloc(sizeof(cse_class) * nodes);
+    l.table = malloc(sizeof(int) * table_size);
+    l.table_mask = table_size - 1;
+
+    tx_program *p = 0;
+    if (l.ids && l.sizes && l.classes && l.table) {
+        int index = 0, stores = 0, i;
+        memset(l.table, -1, sizeof(int) * table_size);
+        for (r = 0; r < count; ++r) lower_classify(&l, roots[r], &index);
+        index = 0;
+        for (r = 0; r < count; ++r) lower_count(&l, roots[r], &index);
+
+        for (i = 0; i < l.class_count; ++i) {
+            const cse_class *c = l.classes + i;
+            if (c->shared && ARITY(c->node->type) > 0 && c->uses > 1) ++stores;
+        }
+
+        const int capacity = nodes + stores + (outputs ? count : 0);
+        p = malloc(sizeof(tx_program) + sizeof(tx_instr) * (capacity - 1) + loops);
+        if (p) {
+            l.code = p->code;
+            index = 0;
+            for (r = 0; r < count; ++r) {
+                lower_emit(&l, roots[r], &index);
+                if (outputs) {
+                    tx_instr *ins = l.code + l.length++;
+                    memset(ins, 0, sizeof(tx_instr));
+                    ins->op = OP_OUT;
+                    ins->slot = r;
+                }
+            }
+            p->length = l.length;
+            p->slots = l.slots;
+            p->outputs = outputs ? count : 0;
+            p->depth = program_depth(p);
+            if (loops) own_loops(p->code, p->length, (char*)(p->code + capacity));
+        }
+    }
+
+    free(l.ids);
+    free(l.sizes);
+    free(l.classes);
+    free(l.table);
+    return p;
+}
+
+
+tx_program *tx_compile_program(const tx_expr *n) {
+    CHECK_NULL(n);
+    return lower_program(&n, 1, 0);
+}
+
+
+tx_program *tx_compile_program_many(const tx_expr *const *roots, int count) {
+    int r;
+    if (!roots || count < 1) return NULL;
+    for (r = 0; r < count; ++r) CHECK_NULL(roots[r]);
+    return lower_program(roots, count, 1);
+}
+
+
+tx_program *tx_compile_many(const char *const *expressions, int count, const tx_variable *variables, int var_count,
+                            const tx_options *options, int *failed, int *error) {
+    /* The trees only live until they are lowered. */
+    if (failed) *failed = -1;
+    if (error) *error = -1;
+    if (!expressions || count < 1) return NULL;
+
+    tx_arena *arena = tx_arena_create(0);
+    const tx_expr **roots = malloc(sizeof(tx_expr*) * count);
+    tx_program *p = 0;
+    int r;
+
+    if (arena && roots) {
+        for (r = 0; r < count; ++r) {
+            roots[r] = compile(expressions[r], variables, var_count, options, arena, 0, error);
+            if (!roots[r]) break;
+        }
+        if (r < count && failed) *failed = r;
+        if (r == count) {
+            p = lower_program(roots, count, 1);
+            if (error) *error = p ? 0 : -1;
+        }
+    }
+
+    free(roots);
+    tx_arena_free(arena);
+    return p;
+}
+
+
+#define TX_FUN(...) ((d_cx(*)(__VA_ARGS__))ins->function)
+#define A(e) sp[e]
+
+
+static d_cx program_run(const tx_program *p, d_cx *stack, const d_cx *args, d_cx *out) {
+    const tx_instr *ins = p->code;
+    const tx_instr *const end = ins + p->length;
+    d_cx *const slots = stack + p->depth;
+    d_cx *sp = stack;
+
+    for (; ins != end; ++ins) {
+        switch (ins->op) {
+        case OP_CONST: *sp++ = ins->value; break;
+        case OP_VAR: *sp++ = *ins->bound; break;
+
+        case OP_ADD: --sp; sp[-1] = sp[-1] + sp[0]; break;
+        case OP_SUB: --sp; sp[-1] = sp[-1] - sp[0]; break;
+        case OP_MUL: --sp; sp[-1] = sp[-1] * sp[0]; break;
+        case OP_DIV: --sp; sp[-1] = sp[-1] / sp[0]; break;
+        case OP_POW: --sp; sp[-1] = cpow(sp[-1], sp[0]); break;
+        case OP_NEG: sp[-1] = -sp[-1]; break;
+        case OP_COMMA: --sp; sp[-1] = sp[0]; break;
+
+        case OP_RADD: --sp; sp[-1] = creal(sp[-1]) + creal(sp[0]); break;
+        case OP_RSUB: --sp; sp[-1] = creal(sp[-1]) - creal(sp[0]); break;
+        case OP_RMUL: --sp; sp[-1] = creal(sp[-1]) * creal(sp[0]); break;
+        case OP_RDIV: --sp; sp[-1] = creal(sp[-1]) / creal(sp[0]); break;
+        case OP_RNEG: sp[-1] = -creal(sp[-1]); break;
+
+        case OP_STORE: slots[ins->slot] = sp[-1]; break;
+        case OP_LOAD: *sp++ = slots[ins->slot]; break;
+        case OP_ARG: *sp++ = args[ins->slot]; break;
+        case OP_OUT: --sp; if (out) out[ins->slot] = sp[0]; break;
+
+        case OP_ARRAY:
+            sp -= ins->arity;
+            *sp = call_array(ins->function, ins->context, ins->arity, sp);
+            ++sp;
+            break;
+
+        case OP_FUNCTION:
+            sp -= ins->arity;
+            switch (ins->arity) {
+            case 0: *sp = TX_FUN(void)(); break;
+            case 1: *sp = TX_FUN(d_cx)(A(0)); break;
+            case 2: *sp = TX_FUN(d_cx, d_cx)(A(0), A(1)); break;
+            case 3: *sp = TX_FUN(d_cx, d_cx, d_cx)(A(0), A(1), A(2)); break;
+            case 4: *sp = TX_FUN(d_cx, d_cx, d_cx, d_cx)(A(0), A(1), A(2), A(3)); break;
+            case 5: *sp = TX_FUN(d_cx, d_cx, d_cx, d_cx, d_cx)(A(0), A(1), A(2), A(3), A(4)); break;
+            case 6: *sp = TX_FUN(d_cx, d_cx, d_cx, d_cx, d_cx, d_cx)(A(0), A(1), A(2), A(3), A(4), A(5)); break;
+            default: *sp = NAN; break;
+            }
+            ++sp;
+            break;
+
+        case OP_CLOSURE:
+            sp -= ins->arity;
+            switch (ins->arity) {
+            case 0: *sp = TX_FUN(void*)(ins->context); break;
+            case 1: *sp = TX_FUN(void*, d_cx)(ins->context, A(0)); break;
+            case 2: *sp = TX_FUN(void*, d_cx, d_cx)(ins->context, A(0), A(1)); break;
+            case 3: *sp = TX_FUN(void*, d_cx, d_cx, d_cx)(ins->context, A(0), A(1), A(2)); break;
+            case 4: *sp = TX_FUN(void*, d_cx, d_cx, d_cx, d_cx)(ins->context, A(0), A(1), A(2), A(3)); break;
+            case 5: *sp = TX_FUN(void*, d_cx, d_cx, d_cx, d_cx, d_cx)(ins->context, A(0), A(1), A(2), A(3), A(4)); break;
+            case 6: *sp = TX_FUN(void*, d_cx, d_cx, d_cx, d_cx, d_cx, d_cx)(ins->context, A(0), A(1), A(2), A(3), A(4), A(5)); break;
+            default: *sp = NAN; break;
+            }
+            ++sp;
+            break;
+        }
+    }
+
+    return stack[0];
+}
+
+#undef TX_FUN
+#undef A
+
+
+static d_cx program_eval(const tx_program *p, const d_cx *args, d_cx *out) {
+    if (!p) return NAN;
+
+    if (p->depth + p->slots <= PROGRAM_STACK) {
+        d_cx stack[PROGRAM_STACK];
+        return program_run(p, stack, args, out);
+    }
+
+    d_cx *stack = malloc(sizeof(d_cx) * (p->depth + p->slots));
+    if (!stack) return NAN;
+
+    const d_cx ret = program_run(p, stack, args, out);
+    free(stack);
+    return ret;
+}
+
+
+d_cx tx_program_eval(const tx_program *p) {
+    return program_eval(p, 0, 0);
+}
+
+
+void tx_program_eval_many(const tx_program *p, d_cx *out) {
+    if (!p) return;
+    if (p->outputs) program_eval(p, 0, out);
+    else out[0] = program_eval(p, 0, 0);
+}
+
+
+int tx_program_outputs(const tx_program *p) {
+    return p ? (p->outputs ? p->outputs : 1) : 0;
+}
+
+
+void tx_program_free(tx_program *p) {
+    free(p);
+}
+
+
+/* Serialized programs. The image is a header followed by fixed-size records
+ * and holds no pointers: variables and user functions are stored as indices
+ * into the caller's table, built-ins as indices into the table below. */
+static const void *const stored_functions[] = {
+    /* Append only, the indices are part of the format. */
+    i, _cabs, cacos, cacosh, _carg, casin, casinh, catan, catanh, conj, ccos, ccosh, e, cexp,
+    _cimag, infinity, clog, pi, cpow, _creal, csin, csinh, csqrt, ctan, ctanh,
+    add, sub, mul, divide, negate, comma, square, ipow,
+    radd, rsub, rmul, rdivide, rnegate, rsquare, rabs, rsin, rcos, rtan, rsinh, rcosh, rtanh,
+    rexp, ratan, rasinh, ripow, cfma, rfma,
+    cexp_fast, clog_fast, cpow_fast, csin_fast, ccos_fast, ctan_fast, csinh_fast, ccosh_fast, ctanh_fast,
+    rexp_fast, rsin_fast, rcos_fast, rtan_fast, rsinh_fast, rcosh_fast, rtanh_fast,
+    cexp_low, clog_low, cpow_low, csin_low, ccos_low, ctan_low, csinh_low, ccosh_low, ctanh_low,
+    rexp_low, rsin_low, rcos_low, rtan_low, rsinh_low, rcosh_low, rtanh_low,
+    0
+};
+
+#define STORED_MAGIC "TXP1"
+#define STORED_ORDER 0x01020304u
+
+enum {SOURCE_NONE, SOURCE_BUILTIN, SOURCE_TABLE};
+
+typedef struct stored_header {
+    char magic[4];
+    uint32_t order;
+    int32_t length;
+    int32_t depth;
+    int32_t slots;
+    int32_t outputs;
+} stored_header;
+
+typedef struct stored_instr {
+    int32_t op;
+    int32_t arity;
+    int32_t source;
+    int32_t index;
+    double value[2];
+} stored_instr;
+
+
+static int stored_index(const tx_instr *ins, const tx_variable *variables, int var_count, int32_t *source) {
+    /* Finds what the instruction refers to, or returns -1. */
+    int k;
+    *source = SOURCE_TABLE;
+    switch (ins->op) {
+    case OP_VAR:
+        for (k = 0; k < var_count; ++k) {
+            if (TYPE_MASK(variables[k].type) == TX_VARIABLE && variables[k].address == ins->bound) return k;
+        }
+        return -1;
+
+    case OP_FUNCTION:
+        for (k = 0; stored_functions[k]; ++k) {
+            if (stored_functions[k] == ins->function) {
+                *source = SOURCE_BUILTIN;
+                return k;
+            }
+        }
+        for (k = 0; k < var_count; ++k) {
+            if (IS_FUNCTION(variables[k].type) && variables[k].address == ins->function) return k;
+        }
+        return -1;
+
+    case OP_CLOSURE:
+        for (k = 0; k < var_count; ++k) {
+            if (IS_CLOSURE(variables[k].type) && variables[k].address == ins->function &&
+                variables[k].context == ins->context) return k;
+        }
+        return -1;
+
+    case OP_ARRAY:
+        for (k = 0; k < var_count; ++k) {
+            if (IS_ARRAY(variables[k].type) && variables[k].address == ins->function &&
+                (IS_CLOSURE(variables[k].type) ? variables[k].context == ins->context : !ins->context)) return k;
+        }
+        return -1;
+
+    case OP_STORE: case OP_LOAD: case OP_OUT:
+        *source = SOURCE_NONE;
+        return ins->slot;
+    }
+
+    *source = SOURCE_NONE;
+    return 0;
+}
+
+
+size_t tx_serialize(const tx_program *p, const tx_variable *variables, int var_count, void *buffer, size_t size) {
+    if (!p) return 0;
+
+    const size_t needed = sizeof(stored_header) + sizeof(stored_instr) * p->length;
+    unsigned char *out = buffer;
+    int i;
+
+    stored_header h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, STORED_MAGIC, 4);
+    h.order = STORED_ORDER;
+    h.length = p->length;
+    h.depth = p->depth;
+    h.slots = p->slots;
+    h.outputs = p->outputs;
+    if (buffer && size >= needed) memcpy(out, &h, sizeof(h));
+
+    for (i = 0; i < p->length; ++i) {
+        const tx_instr *ins = p->code + i;
+        stored_instr r;
+        memset(&r, 0, sizeof(r));
+
+        /* Argument reads only exist in programs made for native code. */
+        if (ins->op == OP_ARG) return 0;
+
+        r.op = ins->op;
+        r.arity = ins->arity;
+        r.index = stored_index(ins, variables, var_count, &r.source);
+        if (r.index < 0) return 0;
+        if (ins->op == OP_CONST) {
+            r.value[0] = creal(ins->value);
+            r.value[1] = cimag(ins->value);
+        }
+        if (buffer && size >= needed) memcpy(out + sizeof(h) + sizeof(r) * i, &r, sizeof(r));
+    }
+    return needed;
+}
+
+
+static int stored_instr_load(const stored_instr *r, const stored_header *h, const tx_variable *variables,
+                             int var_count, tx_instr *ins) {
+    /* Resolves one record, returning 0 where it does not fit the table. */
+    const tx_variable *var = (r->source == SOURCE_TABLE && r->index >= 0 && r->index < var_count)
+                             ? variables + r->index : 0;
+    int builtins = 0;
+    while (stored_functions[builtins]) ++builtins;
+
+    memset(ins, 0, sizeof(tx_instr));
+    ins->op = r->op;
+    ins->arity = r->arity;
+
+    switch (r->op) {
+    case OP_CONST:
+        ins->value = cx_make(r->value[0], r->value[1]);
+        return 1;
+
+    case OP_VAR:
+        if (!var || TYPE_MASK(var->type) != TX_VARIABLE) return 0;
+        ins->bound = var->address;
+        return 1;
+
+    case OP_STORE: case OP_LOAD:
+        ins->slot = r->index;
+        return r->index >= 0 && r->index < h->slots;
+
+    case OP_OUT:
+        ins->slot = r->index;
+        return r->index >= 0 && r->index < h->outputs;
+
+    case OP_FUNCTION:
+        if (r->arity < 0 || r->arity > 6) return 0;
+        if (r->source == SOURCE_BUILTIN && r->index >= 0 && r->index < builtins) {
+            ins->function = stored_functions[r->index];
+            return 1;
+        }
+        if (!var || !IS_FUNCTION(var->type) || ARITY(var->type) != r->arity) return 0;
+        ins->function = var->address;
+        return 1;
+
+    case OP_CLOSURE:
+        if (!var || !IS_CLOSURE(var->type) || ARITY(var->type) != r->arity) return 0;
+        ins->function = var->address;
+        ins->context = var->context;
+        return 1;
+
+    case OP_ARRAY:
+        if (!var || !IS_ARRAY(var->type) || ARITY(var->type) != r->arity) return 0;
+        if (!IS_FUNCTION(var->type) && !IS_CLOSURE(var->type)) return 0;
+        ins->function = var->address;
+        ins->context = IS_CLOSURE(var->type) ? var->context : 0;
+        return 1;
+
+    case OP_ADD: case OP_SUB: case OP_MUL: case OP_DIV: case OP_POW: case OP_NEG: case OP_COMMA:
+    case OP_RADD: case OP_RSUB: case OP_RMUL: case OP_RDIV: case OP_RNEG:
+        return 1;
+    }
+    return 0;
+}
+
+
+static int stack_pops(const tx_instr *ins) {
+    /* Values the instruction takes; every instruction but OP_OUT leaves one. */
+    switch (ins->op) {
+    case OP_CONST: case OP_VAR: case OP_LOAD: case OP_ARG: return 0;
+    case OP_STORE: case OP_NEG: case OP_RNEG: case OP_OUT: return 1;
+    case OP_FUNCTION: case OP_CLOSURE: case OP_ARRAY: return ins->arity;
+    default: return 2;
+    }
+}
+
+
+tx_program *tx_deserialize(const void *data, size_t size, const tx_variable *variables, int var_count,
+                           int *error) {
+    const unsigned char *in = data;
+    stored_header h;
+    int i;
+
+    if (error) *error = -1;
+    if (!data || size < sizeof(h)) return NULL;
+
+    memcpy(&h, in, sizeof(h));
+    if (memcmp(h.magic, STORED_MAGIC, 4) != 0 || h.order != STORED_ORDER) return NULL;
+    if (h.length < 1 || h.depth < 1 || h.slots < 0 || h.outputs < 0) return NULL;
+    if ((size - sizeof(h)) / sizeof(stored_instr) < (size_t)h.length) return NULL;
+
+    tx_program *p = malloc(sizeof(tx_program) + sizeof(tx_instr) * (h.length - 1));
+    CHECK_NULL(p);
+
+    p->length = h.length;
+    p->slots = h.slots;
+    p->outputs = h.outputs;
+
+    /* The stack is checked here so that a bad image cannot run off it. */
+    int sp = 0;
+    for (i = 0; i < h.length; ++i) {
+        stored_instr r;
+        memcpy(&r, in + sizeof(h) + sizeof(r) * i, sizeof(r));
+
+        if (!stored_instr_load(&r, &h, variables, var_count, p->code + i)) break;
+        const int pops = stack_pops(p->code + i);
+        if (sp < pops) break;
+        sp += (p->code[i].op != OP_OUT) - pops;
+    }
+
+    /* A fused program leaves nothing behind. */
+    if (i < h.length || (h.outputs ? sp != 0 : sp < 1)) {
+        if (error) *error = i + 1;
+        free(p);
+        return NULL;
+    }
+
+    p->depth = program_depth(p);
+    if (error) *error = 0;
+    return p;
+}
+
+#undef STORED_MAGIC
+#undef STORED_ORDER
+
+
+/* Native code generation. The program is translated one instruction at a
+ * time into x86-64 code that keeps the value stack in its own frame. Built-in
+ * operators are inlined and calls go straight to their targets; anything the
+ * generator does not handle leaves the program to the interpreter. */
+
+#if !defined(TX_NO_JIT) && defined(__x86_64__) && !defined(_WIN32) && (defined(__unix__) || defined(__APPLE__))
+#define JIT_X86_64
+#include <sys/mman.h>
+#endif
+
+
+struct tx_jit {
+    tx_program *program;
+    void *code;
+    size_t size;
+    tx_jit_fn function;
+};
+
+
+#if defined(JIT_X86_64)
+
+typedef struct jit_buf {
+    unsigned char *code;
+    size_t length;
+    size_t capacity;
+    int failed;
+} jit_buf;
+
+
+static void jit_byte(jit_buf *b, int c) {
+    if (b->length == b->capacity) {
+        const size_t capacity = b->capacity ? 2 * b->capacity : 4096;
+        unsigned char *code = realloc(b->code, capacity);
+        if (!code) {
+            b->failed = 1;
+            return;
+        }
+        b->code = code;
+        b->capacity = capacity;
+    }
+    b->code[b->length++] = (unsigned char)c;
+}
+
+
+static void jit_u32(jit_buf *b, uint32_t v) {
+    int i;
+    for (i = 0; i < 4; ++i) jit_byte(b, (v >> (8 * i)) & 0xFF);
+}
+
+
+static void jit_u64(jit_buf *b, uint64_t v) {
+    int i;
+    for (i = 0; i < 8; ++i) jit_byte(b, (v >> (8 * i)) & 0xFF);
+}
+
+
+enum {RAX = 0, RBX = 3, RSP = 4};
+
+static void jit_sse_mem(jit_buf *b, int prefix, int op, int xmm, int base, int disp) {
+    /* <op> xmm, [base+disp32] */
+    jit_byte(b, prefix);
+    jit_byte(b, 0x0F);
+    jit_byte(b, op);
+    jit_byte(b, 0x80 | (xmm << 3) | base);
+    if (base == RSP) jit_byte(b, 0x24);
+    jit_u32(b, (uint32_t)disp);
+}
+
+static void jit_sse_reg(jit_buf *b, int prefix, int op, int dst, int src) {
+    jit_byte(b, prefix);
+    jit_byte(b, 0x0F);
+    jit_byte(b, op);
+    jit_byte(b, 0xC0 | (dst << 3) | src);
+}
+
+#define MOVSD_LOAD 0x10
+#define MOVSD_STORE 0x11
+#define ADDSD 0x58
+#define MULSD 0x59
+#define SUBSD 0x5C
+#define MOVAPD 0x28
+#define UCOMISD 0x2E
+#define XORPD 0x57
+
+static void jit_load(jit_buf *b, int xmm, int base, int disp) {
+    /* Loads a complex value into xmm and xmm+1. */
+    jit_sse_mem(b, 0xF2, MOVSD_LOAD, xmm, base, disp);
+    jit_sse_mem(b, 0xF2, MOVSD_LOAD, xmm + 1, base, disp + 8);
+}
+
+static void jit_store(jit_buf *b, int xmm, int base, int disp) {
+    jit_sse_mem(b, 0xF2, MOVSD_STORE, xmm, base, disp);
+    jit_sse_mem(b, 0xF2, MOVSD_STORE, xmm + 1, base, disp + 8);
+}
+
+static void jit_arith(jit_buf *b, int op, int dst, int src) {
+    jit_sse_reg(b, 0xF2, op, dst, src);
+}
+
+static void jit_mov_imm(jit_buf *b, int reg, uint64_t v) {
+    /* mov reg, imm64 */
+    jit_byte(b, 0x48);
+    jit_byte(b, 0xB8 + reg);
+    jit_u64(b, v);
+}
+
+static void jit_call(jit_buf *b, const void *target) {
+    /* mov rax, target; call rax */
+    jit_mov_imm(b, RAX, (uint64_t)(uintptr_t)target);
+    jit_byte(b, 0xFF);
+    jit_byte(b, 0xD0);
+}
+
+static void jit_lea_rsp(jit_buf *b, int reg, int disp) {
+    /* lea reg, [rsp+disp32] */
+    jit_byte(b, 0x48);
+    jit_byte(b, 0x8D);
+    jit_byte(b, 0x80 | (reg << 3) | RSP);
+    jit_byte(b, 0x24);
+    jit_u32(b, (uint32_t)disp);
+}
+
+static void jit_store_imm(jit_buf *b, int disp, uint64_t v) {
+    /* mov rax, v; mov [rsp+disp32], rax */
+    jit_mov_imm(b, RAX, v);
+    jit_byte(b, 0x48);
+    jit_byte(b, 0x89);
+    jit_byte(b, 0x84);
+    jit_byte(b, 0x24);
+    jit_u32(b, (uint32_t)disp);
+}
+
+static void jit_sign_mask(jit_buf *b, int xmm) {
+    /* mov rax, sign bit; movq xmm, rax */
+    jit_mov_imm(b, RAX, 0x8000000000000000ull);
+    jit_byte(b, 0x66);
+    jit_byte(b, 0x48);
+    jit_byte(b, 0x0F);
+    jit_byte(b, 0x6E);
+    jit_byte(b, 0xC0 | (xmm << 3) | RAX);
+}
+
+static size_t jit_jump(jit_buf *b, int cc) {
+    /* Emits jcc/jmp rel32 and returns where to patch the target. */
+    if (cc < 0) {
+        jit_byte(b, 0xE9);
+    } else {
+        jit_byte(b, 0x0F);
+        jit_byte(b, cc);
+    }
+    jit_u32(b, 0);
+    return b->length;
+}
+
+static void jit_patch(jit_buf *b, size_t at) {
+    /* Points the jump ending at at to the current position. */
+    const uint32_t rel = (uint32_t)(b->length - at);
+    int i;
+    if (b->failed) return;
+    for (i = 0; i < 4; ++i) b->code[at - 4 + i] = (rel >> (8 * i)) & 0xFF;
+}
+
+#define JP 0x8A
+#define JNP 0x8B
+
+
+static void jit_mul_slow(d_cx *a) {a[0] = a[0] * a[1];}
+static void jit_div(d_cx *a) {a[0] = a[0] / a[1];}
+
+
+#define TX_FUN(...) ((d_cx(*)(__VA_ARGS__))ins->function)
+
+static void jit_call_wide(d_cx *a, const tx_instr *ins) {
+    /* Calls with more arguments than fit in registers. */
+    if (ins->op == OP_FUNCTION) {
+        switch (ins->arity) {
+        case 5: a[0] = TX_FUN(d_cx, d_cx, d_cx, d_cx, d_cx)(a[0], a[1], a[2], a[3], a[4]); break;
+        case 6: a[0] = TX_FUN(d_cx, d_cx, d_cx, d_cx, d_cx, d_cx)(a[0], a[1], a[2], a[3], a[4], a[5]); break;
+        }
+    } else {
+        switch (ins->arity) {
+        case 5: a[0] = TX_FUN(void*, d_cx, d_cx, d_cx, d_cx, d_cx)(ins->context, a[0], a[1], a[2], a[3], a[4]); break;
+        case 6: a[0] = TX_FUN(void*, d_cx, d_cx, d_cx, d_cx, d_cx, d_cx)(ins->context, a[0], a[1], a[2], a[3], a[4], a[5]); break;
+        }
+    }
+}
+
+#undef TX_FUN
+
+
+static int jit_emit(jit_buf *b, const tx_program *p) {
+    /* Stack entry k lives at [rsp+16k], slot s after the stack. */
+    const int frame = 16 * (p->depth + p->slots);
+    int sp = 0;
+    int i, k;
+
+#define AT(k) (16 * (k))
+#define SLOT(s) (16 * (p->depth + (s)))
+
+    jit_byte(b, 0x53);                              /* push rbx */
+    jit_byte(b, 0x48); jit_byte(b, 0x89); jit_byte(b, 0xFB);    /* mov rbx, rdi */
+    jit_byte(b, 0x48); jit_byte(b, 0x81); jit_byte(b, 0xEC);    /* sub rsp, frame */
+    jit_u32(b, frame);
+
+    for (i = 0; i < p->length; ++i) {
+        const tx_instr *ins = p->code + i;
+        uint64_t bits[2];
+        size_t check_im, store, done;
+
+        switch (ins->op) {
+        case OP_CONST:
+            memcpy(bits, &ins->value, sizeof(bits));
+            jit_store_imm(b, AT(sp), bits[0]);
+            jit_store_imm(b, AT(sp) + 8, bits[1]);
+            ++sp;
+            break;
+
+        case OP_VAR:
+            jit_mov_imm(b, RAX, (uint64_t)(uintptr_t)ins->bound);
+            jit_load(b, 0, RAX, 0);
+            jit_store(b, 0, RSP, AT(sp));
+            ++sp;
+            break;
+
+        case OP_ARG:
+            jit_load(b, 0, RBX, 16 * ins->slot);
+            jit_store(b, 0, RSP, AT(sp));
+            ++sp;
+            break;
+
+        case OP_LOAD:
+            jit_load(b, 0, RSP, SLOT(ins->slot));
+            jit_store(b, 0, RSP, AT(sp));
+            ++sp;
+            break;
+
+        case OP_STORE:
+            jit_load(b, 0, RSP, AT(sp - 1));
+            jit_store(b, 0, RSP, SLOT(ins->slot));
+            break;
+
+        case OP_COMMA:
+            --sp;
+            jit_load(b, 0, RSP, AT(sp));
+            jit_store(b, 0, RSP, AT(sp - 1));
+            break;
+
+        case OP_ADD: case OP_SUB: case OP_RADD: case OP_RSUB: case OP_RMUL: case OP_RDIV:
+            --sp;
+            jit_load(b, 0, RSP, AT(sp - 1));
+            jit_load(b, 2, RSP, AT(sp));
+            switch (ins->op) {
+            case OP_ADD: jit_arith(b, ADDSD, 0, 2); jit_arith(b, ADDSD, 1, 3); break;
+            case OP_SUB: jit_arith(b, SUBSD, 0, 2); jit_arith(b, SUBSD, 1, 3); break;
+            case OP_RADD: jit_arith(b, ADDSD, 0, 2); break;
+            case OP_RSUB: jit_arith(b, SUBSD, 0, 2); break;
+            case OP_RMUL: jit_arith(b, MULSD, 0, 2); break;
+            case OP_RDIV: jit_arith(b, 0x5E, 0, 2); break;
+            }
+            if (ins->op != OP_ADD && ins->op != OP_SUB) jit_sse_reg(b, 0x66, XORPD, 1, 1);
+            jit_store(b, 0, RSP, AT(sp - 1));
+            break;
+
+        case OP_NEG: case OP_RNEG:
+            jit_load(b, 0, RSP, AT(sp - 1));
+            jit_sign_mask(b, 4);
+            jit_sse_reg(b, 0x66, XORPD, 0, 4);
+            if (ins->op == OP_NEG) {
+                jit_sse_reg(b, 0x66, XORPD, 1, 4);
+            } else {
+                jit_sse_reg(b, 0x66, XORPD, 1, 1);
+            }
+            jit_store(b, 0, RSP, AT(sp - 1));
+            break;
+
+        case OP_MUL:
+            /* Textbook product; only NaN+NaNI results take the C99 path. */
+            --sp;
+            jit_load(b, 0, RSP, AT(sp - 1));
+            jit_load(b, 2, RSP, AT(sp));
+            jit_sse_reg(b, 0x66, MOVAPD, 4, 0);
+            jit_arith(b, MULSD, 4, 2);
+            jit_sse_reg(b, 0x66, MOVAPD, 5, 1);
+            jit_arith(b, MULSD, 5, 3);
+            jit_arith(b, SUBSD, 4, 5);
+            jit_arith(b, MULSD, 0, 3);
+            jit_arith(b, MULSD, 1, 2);
+            jit_arith(b, ADDSD, 0, 1);
+            jit_sse_reg(b, 0x66, UCOMISD, 4, 4);
+            check_im = jit_jump(b, JP);
+            store = b->length;
+            jit_sse_mem(b, 0xF2, MOVSD_STORE, 4, RSP, AT(sp - 1));
+            jit_sse_mem(b, 0xF2, MOVSD_STORE, 0, RSP, AT(sp - 1) + 8);
+            done = jit_jump(b, -1);
+            jit_patch(b, check_im);
+            jit_sse_reg(b, 0x66, UCOMISD, 0, 0);
+            jit_byte(b, 0x0F); jit_byte(b, JNP);
+            jit_u32(b, (uint32_t)(store - (b->length + 4)));
+            jit_lea_rsp(b, 7, AT(sp - 1));
+            jit_call(b, jit_mul_slow);
+            jit_patch(b, done);
+            break;
+
+        case OP_DIV:
+            --sp;
+            jit_lea_rsp(b, 7, AT(sp - 1));
+            jit_call(b, jit_div);
+            break;
+
+        case OP_POW:
+            --sp;
+            jit_load(b, 0, RSP, AT(sp - 1));
+            jit_load(b, 2, RSP, AT(sp));
+            jit_call(b, cpow);
+            jit_store(b, 0, RSP, AT(sp - 1));
+            break;
+
+        case OP_FUNCTION: case OP_CLOSURE:
+            sp -= ins->arity;
+            if (ins->arity <= 4) {
+                /* Complex arguments take two SSE registers each, the context goes in rdi. */
+                for (k = 0; k < ins->arity; ++k) jit_load(b, 2 * k, RSP, AT(sp + k));
+                if (ins->op == OP_CLOSURE) jit_mov_imm(b, 7, (uint64_t)(uintptr_t)ins->context);
+                jit_call(b, ins->function);
+                jit_store(b, 0, RSP, AT(sp));
+            } else {
+                jit_lea_rsp(b, 7, AT(sp));
+                jit_mov_imm(b, 6, (uint64_t)(uintptr_t)ins);
+                jit_call(b, jit_call_wide);
+            }
+            ++sp;
+            break;
+
+        default:
+            return 0;
+        }
+    }
+
+    jit_load(b, 0, RSP, AT(0));
+    jit_byte(b, 0x48); jit_byte(b, 0x81); jit_byte(b, 0xC4);    /* add rsp, frame */
+    jit_u32(b, frame);
+    jit_byte(b, 0x5B);                              /* pop rbx */
+    jit_byte(b, 0xC3);                              /* ret */
+
+#undef AT
+#undef SLOT
+
+    return !b->failed;
+}
+
+#undef MOVSD_LOAD
+#undef MOVSD_STORE
+#undef ADDSD
+#undef MULSD
+#undef SUBSD
+#undef MOVAPD
+#undef UCOMISD
+#undef XORPD
+#undef JP
+#undef JNP
+
+
+static void jit_native(tx_jit *j) {
+    jit_buf b;
+    memset(&b, 0, sizeof(b));
+
+    if (jit_emit(&b, j->program)) {
+        void *code = mmap(0, b.length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (code != MAP_FAILED) {
+            memcpy(code, b.code, b.length);
+            if (mprotect(code, b.length, PROT_READ | PROT_EXEC) == 0) {
+                j->code = code;
+                j->size = b.length;
+                j->function = (tx_jit_fn)(uintptr_t)code;
+            } else {
+                munmap(code, b.length);
+            }
+        }
+    }
+    free(b.code);
+}
+
+#endif
+
+
+tx_jit *tx_jit_compile(const tx_expr *n, const tx_variable *variables, int var_count) {
+    tx_jit *j = malloc(sizeof(tx_jit));
+    CHECK_NULL(j);
+
+    memset(j, 0, sizeof(tx_jit));
+    j->program = tx_compile_program(n);
+    CHECK_NULL(j->program, free(j));
+
+    /* Variables found in the table are read from the argument array. */
+    int i, k;
+    for (i = 0; i < j->program->length; ++i) {
+        tx_instr *ins = j->program->code + i;
+        if (ins->op != OP_VAR) continue;
+        for (k = 0; k < var_count; ++k) {
+            if (ins->bound == variables[k].address) {
+                ins->op = OP_ARG;
+                ins->slot = k;
+                break;
+            }
+        }
+    }
+
+#if defined(JIT_X86_64)
+    jit_native(j);
+#endif
+    return j;
+}
+
+
+tx_jit_fn tx_jit_function(const tx_jit *j) {
+    return j ? j->function : 0;
+}
+
+
+d_cx tx_jit_eval(const tx_jit *j, const d_cx *vars) {
+    if (!j) return NAN;
+    if (j->function) return j->function(vars);
+    return program_eval(j->program, vars, 0);
+}
+
+
+void tx_jit_free(tx_jit *j) {
+    if (!j) return;
+#if defined(JIT_X86_64)
+    if (j->code) munmap(j->code, j->size);
+#endif
+    tx_program_free(j->program);
+    free(j);
+}
+
+
+#define TX_FUN(...) ((d_cx(*)(__VA_ARGS__))n->function)
+
+static d_cx call_node(const tx_expr *n, const d_cx *a) {
+    /* Applies a function or closure node to already evaluated arguments. */
+    const int arity = ARITY(n->type);
+    if (IS_ARRAY(n->type) && (IS_FUNCTION(n->type) || IS_CLOSURE(n->type))) {
+        return call_array(n->function, IS_CLOSURE(n->type) ? n->parameters[arity] : 0, arity, a);
+    }
+    if (IS_FUNCTION(n->type)) {
+        switch (arity) {
+        case 0: return TX_FUN(void)();
+        case 1: return TX_FUN(d_cx)(a[0]);
+        case 2: return TX_FUN(d_cx, d_cx)(a[0], a[1]);
+        case 3: return TX_FUN(d_cx, d_cx, d_cx)(a[0], a[1], a[2]);
+        case 4: return TX_FUN(d_cx, d_cx, d_cx, d_cx)(a[0], a[1], a[2], a[3]);
+        case 5: return TX_FUN(d_cx, d_cx, d_cx, d_cx, d_cx)(a[0], a[1], a[2], a[3], a[4]);
+        case 6: return TX_FUN(d_cx, d_cx, d_cx, d_cx, d_cx, d_cx)(a[0], a[1], a[2], a[3], a[4], a[5]);
+        }
+    } else if (IS_CLOSURE(n->type)) {
+        void *context = n->parameters[arity];
+        switch (arity) {
+        case 0: return TX_FUN(void*)(context);
+        case 1: return TX_FUN(void*, d_cx)(context, a[0]);
+        case 2: return TX_FUN(void*, d_cx, d_cx)(context, a[0], a[1]);
+        case 3: return TX_FUN(void*, d_cx, d_cx, d_cx)(context, a[0], a[1], a[2]);
+        case 4: return TX_FUN(void*, d_cx, d_cx, d_cx, d_cx)(context, a[0], a[1], a[2], a[3]);
+        case 5: return TX_FUN(void*, d_cx, d_cx, d_cx, d_cx, d_cx)(context, a[0], a[1], a[2], a[3], a[4]);
+        case 6: return TX_FUN(void*, d_cx, d_cx, d_cx, d_cx, d_cx, d_cx)(context, a[0], a[1], a[2], a[3], a[4], a[5]);
+        }
+    }
+    return NAN;
+}
+
+#undef TX_FUN
+
+/* Loop evaluation. A loop node is a closure over the lower and upper bounds
+ * (the start value and count for iterate) and a comma chain of the variables
+ * the body reads from outside, so every other pass sees its dependencies
+ * without a limit on how many there are. The body reads those variables where
+ * they are bound, through a chain of frames: the loop variable and running
+ * powers of each enclosing loop, then the inputs of a batch point, then the
+ * variables themselves. Powers of the loop variable over bases that do not
+ * depend on it are carried from one step to the next instead of calling cpow. */
+enum {LOOP_STREAM_CX, LOOP_STREAM_PLANES, LOOP_STREAM_FLOAT, LOOP_STREAM_BOX};
+
+typedef struct loop_outside {
+    const tx_variable *streams;     /* The inputs of a batch, read at index. */
+    int count;
+    size_t index;
+    int format;
+} loop_outside;
+
+typedef struct loop_frame {
+    int count;
+    const d_cx *bound[1 + LOOP_POWERS];
+    d_cx value[1 + LOOP_POWERS];
+    const struct loop_frame *parent;
+    const loop_outside *outside;
+} loop_frame;
+
+
+static d_cx loop_read(const loop_frame *f, const d_cx *bound) {
+    int i;
+    for (; f; f = f->parent) {
+        for (i = 0; i < f->count; ++i) {
+            if (f->bound[i] == bound) return f->value[i];
+        }
+        if (f->outside) {
+            const loop_outside *o = f->outside;
+            for (i = 0; i < o->count; ++i) {
+                if (o->streams[i].address != bound) continue;
+                const void *src = o->streams[i].context;
+                if (o->format == LOOP_STREAM_PLANES) {
+                    const tx_planes *p = src;
+                    return cx_make(p->re[o->index], p->im[o->index]);
+                }
+                if (o->format == LOOP_STREAM_FLOAT) return (d_cx)((const f_cx*)src)[o->index];
+                if (o->format == LOOP_STREAM_BOX) return cx_make(((const tx_box*)src)->re_lo, ((const tx_box*)src)->im_lo);
+                return ((const d_cx*)src)[o->index];
+            }
+        }
+    }
+    return *bound;
+}
+
+
+static d_cx loop_run(const loop *l, const d_cx *a, const loop_frame *parent);
+
+static d_cx loop_eval(const tx_expr *n, const loop_frame *f) {
+    const int arity = ARITY(n->type);
+    d_cx a[6];
+    int i;
+
+    switch (TYPE_MASK(n->type)) {
+    case TX_CONSTANT: return n->value;
+    case TX_VARIABLE: return loop_read(f, n->bound);
+    }
+
+    for (i = 0; i < arity; ++i) a[i] = loop_eval(n->parameters[i], f);
+    if (is_loop(n)) return loop_run(n->parameters[arity], a, f);
+    return call_node(n, a);
+}
+
+
+static d_cx loop_run(const loop *l, const d_cx *a, const loop_frame *parent) {
+    loop_frame f;
+    d_cx base[LOOP_POWERS];
+    int i;
+
+    f.count = 1 + l->powers;
+    for (i = 0; i < f.count; ++i) {
+        f.bound[i] = loop_slots[l->depth] + i;
+        f.value[i] = 0;
+    }
+    f.parent = parent;
+    f.outside = 0;
+
+    /* Steps are counted in an integer, since k + 1 == k past 2^53. */
+    long long step, steps;
+    if (l->kind == LOOP_ITERATE) {
+        const double count = floor(creal(a[1]));
+        if (isinf(count) || !(count <= LOOP_MAX_TRIPS)) return NAN;
+        steps = count > 0 ? (long long)count : 0;
+        f.value[0] = a[0];
+        for (step = 0; step < steps; ++step) f.value[0] = loop_eval(l->body, &f);
+        return f.value[0];
+    }
+
+    const double lo = creal(a[0]), hi = creal(a[1]);
+    d_cx acc = l->kind == LOOP_SUM ? 0 : 1;
+    if (isnan(lo) || isnan(hi) || isinf(lo) || isinf(hi)) return NAN;
+    const double count = floor(hi - lo) + 1;
+    if (!(count <= LOOP_MAX_TRIPS)) return NAN;
+    steps = count > 0 ? (long long)count : 0;
+
+    for (i = 0; i < l->powers; ++i) {
+        base[i] = loop_eval(l->bases[i], &f);
+        f.value[1 + i] = cpow(base[i], lo);
+    }
+    for (step = 0; step < steps; ++step) {
+        f.value[0] = lo + (double)step;
+        const d_cx v = loop_eval(l->body, &f);
+        acc = l->kind == LOOP_SUM ? acc + v : acc * v;
+        for (i = 0; i < l->powers; ++i) f.value[1 + i] *= base[i];
+    }
+    return acc;
+}
+
+
+static d_cx loop_batch(const loop *l, d_cx lo, d_cx hi, const tx_variable *streams, int stream_count,
+                       size_t index, int format) {
+    /* Runs a loop for one point of a batch, whose inputs the body may read. */
+    const loop_outside o = {streams, stream_count, index, format};
+    loop_frame root;
+    const d_cx a[] = {lo, hi};
+    root.count = 0;
+    root.parent = 0;
+    root.outside = &o;
+    return loop_run(l, a, &root);
+}
+
+
+static d_cx loop_call(void *l, d_cx a, d_cx b, d_cx deps) {
+    const d_cx v[] = {a, b};
+    (void)deps;
+    return loop_run(l, v, 0);
+}
+
+
+static int is_loop_call(const void *function, int arity) {
+    return arity == 3 && function == (const void*)loop_call;
+}
+
+
+static int is_loop(const tx_expr *n) {
+    return IS_CLOSURE(n->type) && is_loop_call(n->function, ARITY(n->type));
+}
+
+
+static void loop_free(loop *l) {
+    int i;
+    if (!l) return;
+    tx_free(l->body);
+    for (i = 0; i < l->powers; ++i) tx_free(l->bases[i]);
+    free(l);
+}
+
+
+static tx_expr *copy_expr(const tx_expr *n);
+
+static loop *loop_copy(const loop *l) {
+    loop *ret = malloc(sizeof(loop));
+    int i;
+    CHECK_NULL(ret);
+
+    *ret = *l;
+    ret->powers = 0;
+    ret->body = copy_expr(l->body);
+    CHECK_NULL(ret->body, free(ret));
+    for (i = 0; i < l->powers; ++i) {
+        ret->bases[i] = copy_expr(l->bases[i]);
+        CHECK_NULL(ret->bases[i], loop_free(ret));
+        ++ret->powers;
+    }
+    return ret;
+}
+
+
+#define LOOP_SIZE ((sizeof(loop) + EXPR_ALIGN - 1) / EXPR_ALIGN * EXPR_ALIGN)
+
+static size_t loop_packed_size(const loop *l) {
+    size_t size = LOOP_SIZE + packed_size(l->body);
+    int i;
+    for (i = 0; i < l->powers; ++i) size += packed_size(l->bases[i]);
+    return size;
+}
+
+
+static loop *loop_pack(const loop *l, char **cursor) {
+    loop *ret = (loop*)*cursor;
+    int i;
+    *ret = *l;
+    *cursor += LOOP_SIZE;
+    ret->body = pack(l->body, cursor);
+    for (i = 0; i < l->powers; ++i) ret->bases[i] = pack(l->bases[i], cursor);
+    return ret;
+}
+
+
+static loop *loop_open(state *s) {
+    /* Reads "(" <name> "," after a loop keyword and brings the name into scope. */
+    const char *p = s->next;
+    const int kind = s->keyword;
+    const int depth = s->scope ? s->scope->depth + 1 : 0;
+
+#define AT_END(p) (s->end ? (p) == s->end : !*(p))
+#define SKIP_SPACE(p) while (!AT_END(p) && (*(p) == ' ' || *(p) == '\t' || *(p) == '\n' || *(p) == '\r')) ++(p)
+#define IS_NAME(c, first) (((c) >= 'a' && (c) <= 'z') || ((c) >= 'A' && (c) <= 'Z') || \
+                           (!(first) && (((c) >= '0' && (c) <= '9') || (c) == '_')))
+    SKIP_SPACE(p);
+    if (AT_END(p) || *p != '(') {
+        s->type = TOK_ERROR;
+        return NULL;
+    }
+    ++p;
+    SKIP_SPACE(p);
+    const char *name = p;
+    while (!AT_END(p) && IS_NAME(*p, p == name)) ++p;
+    const int length = p - name;
+    SKIP_SPACE(p);
+    if (!length || depth >= LOOP_DEPTH || AT_END(p) || *p != ',') {
+        s->next = p;
+        s->type = TOK_ERROR;
+        return NULL;
+    }
+    s->next = p + 1;
+#undef AT_END
+#undef SKIP_SPACE
+#undef IS_NAME
+
+    loop *l = s->arena ? arena_alloc(s->arena, sizeof(loop)) : malloc(sizeof(loop));
+    CHECK_NULL(l);
+
+    memset(l, 0, sizeof(loop));
+    l->kind = kind;
+    l->depth = depth;
+    l->name = name;
+    l->length = length;
+    l->scope = s->scope;
+    s->scope = l;
+    return l;
+}
+
+
+static void loop_discard(state *s, loop *l) {
+    s->scope = l->scope;
+    if (!s->arena) loop_free(l);
+}
+
+
+static int loop_reads(const tx_expr *n, const d_cx *slots) {
+    /* Whether n reads one of the placeholders of a loop. */
+    const int arity = ARITY(n->type);
+    int i;
+    if (TYPE_MASK(n->type) == TX_VARIABLE) return n->bound >= slots && n->bound < slots + 1 + LOOP_POWERS;
+    for (i = 0; i < arity; ++i) {
+        if (loop_reads(n->parameters[i], slots)) return 1;
+    }
+    return 0;
+}
+
+
+static int loop_pure(const tx_expr *n) {
+    const int arity = ARITY(n->type);
+    int i;
+    if ((IS_FUNCTION(n->type) || IS_CLOSURE(n->type)) && !IS_PURE(n->type)) return 0;
+    for (i = 0; i < arity; ++i) {
+        if (!loop_pure(n->parameters[i])) return 0;
+    }
+    return 1;
+}
+
+
+static void loop_powers(loop *l, tx_expr *n, tx_arena *arena) {
+    /* Moves pure bases of cpow(base, k) into l, leaving reads of the running powers. */
+    const int arity = ARITY(n->type);
+    const d_cx *slots = loop_slots[l->depth];
+    int i;
+
+    if (TYPE_MASK(n->type) == TX_FUNCTION2 && exact_kernel(n->function) == cpow && l->powers < LOOP_POWERS) {
+        tx_expr *b = n->parameters[0], *e = n->parameters[1];
+        if (TYPE_MASK(e->type) == TX_VARIABLE && e->bound == slots && !loop_reads(b, slots) && loop_pure(b)) {
+            free_expr(arena, e);
+            l->bases[l->powers] = b;
+            n->type = TX_VARIABLE;
+            n->bound = slots + 1 + l->powers++;
+            return;
+        }
+    }
+    for (i = 0; i < arity; ++i) loop_powers(l, n->parameters[i], arena);
+}
+
+
+static int loop_outer(const loop *l, const tx_expr *n, tx_arena *arena, tx_expr **deps) {
+    /* Adds the variables n reads from outside the loop to the comma chain deps, */
+    /* once each. Returns 0 when out of memory. */
+    const int arity = ARITY(n->type);
+    int i;
+
+    if (TYPE_MASK(n->type) == TX_VARIABLE) {
+        if (loop_reads(n, loop_slots[l->depth]) || (*deps && depends(*deps, n->bound))) return 1;
+        tx_expr *v = new_expr(arena, TX_VARIABLE | (n->type & TX_FLAG_REAL), 0);
+        if (!v) return 0;
+        v->bound = n->bound;
+        if (!*deps) {
+            *deps = v;
+            return 1;
+        }
+        tx_expr *c = NEW_EXPR(arena, TX_FUNCTION2 | TX_FLAG_PURE, v, *deps);
+        if (!c) {
+            free_expr(arena, v);
+            return 0;
+        }
+        c->function = comma;
+        *deps = c;
+        return 1;
+    }
+    for (i = 0; i < arity; ++i) {
+        if (!loop_outer(l, n->parameters[i], arena, deps)) return 0;
+    }
+    return 1;
+}
+
+
+static tx_expr *loop_close(state *s, loop *l, tx_expr *first, tx_expr *second, tx_expr *body) {
+    /* Builds the loop node, taking ownership of everything. Returns NULL with s->type */
+    /* set to TOK_ERROR when the loop is invalid, and NULL alone when out of memory. */
+    const d_cx *slots = loop_slots[l->depth];
+    tx_expr *deps = 0;
+    int valid = 1, deps_ok = 1, i;
+
+    s->scope = l->scope;
+    l->name = 0;
+    l->scope = 0;
+
+    if (body) {
+        optimize(body, s->arena);
+        body = simplify(body, s->arena, s->flags);
+        if (body && (s->flags & TX_SIMPLIFY_HORNER)) body = horner(body, s->arena);
+    }
+    if (body) {
+        optimize(body, s->arena);
+        realify(body);
+        if (s->flags & (TX_FAST_MATH | TX_FAST_MATH_LOW)) fast_math(body, s->flags);
+        if (l->kind != LOOP_ITERATE) loop_powers(l, body, s->arena);
+        l->body = body;
+
+        /* The bounds are read before the loop variable exists. */
+        valid = !loop_reads(first, slots) && !loop_reads(second, slots);
+        deps_ok = loop_outer(l, body, s->arena, &deps);
+        for (i = 0; deps_ok && i < l->powers; ++i) deps_ok = loop_outer(l, l->bases[i], s->arena, &deps);
+        if (deps_ok && !deps) {
+            deps = new_expr(s->arena, TX_CONSTANT, 0);
+            if (deps) deps->value = 0;
+            deps_ok = deps != 0;
+        }
+    }
+
+    tx_expr *ret = 0;
+    if (body && valid && deps_ok) {
+        ret = NEW_EXPR(s->arena, TX_CLOSURE3 | (loop_pure(body) ? TX_FLAG_PURE : 0), first, second, deps);
+    }
+    if (ret) {
+        ret->function = loop_call;
+        ret->parameters[3] = l;
+        return ret;
+    }
+
+    if (body && !valid) s->type = TOK_ERROR;
+    free_expr(s->arena, first);
+    free_expr(s->arena, second);
+    free_expr(s->arena, deps);
+    if (!body) free_expr(s->arena, l->body);
+    if (!s->arena) loop_free(l);
+    return NULL;
+}
+
+
+/* Differentiation. Both the symbolic and the forward mode know the built-in
+ * operators and functions; user functions and the non-holomorphic built-ins
+ * only differentiate where their arguments do not depend on the variable. */
+static const void *complex_kernel(const void *f) {
+    /* Maps a real kernel or an approximation back to the complex built-in it replaced. */
+    int i;
+    f = exact_kernel(f);
+    for (i = 0; real_kernels[i].cx; ++i) {
+        if (f == real_kernels[i].re) return real_kernels[i].cx;
+    }
+    return f;
+}
+
+
+static int depends(const tx_expr *n, const d_cx *wrt) {
+    const int arity = ARITY(n->type);
+    int i;
+    if (TYPE_MASK(n->type) == TX_VARIABLE) return n->bound == wrt;
+    for (i = 0; i < arity; ++i) {
+        if (depends(n->parameters[i], wrt)) return 1;
+    }
+    return 0;
+}
+
+
+static tx_expr *copy_expr(const tx_expr *n) {
+    const int arity = ARITY(n->type);
+    const int size = node_size(n->type);
+    tx_expr *ret = malloc(size);
+    int i;
+    CHECK_NULL(ret);
+
+    memcpy(ret, n, size);
+    for (i = 0; i < arity; ++i) ret->parameters[i] = 0;
+    if (is_loop(n)) ret->parameters[arity] = 0;
+    for (i = 0; i < arity; ++i) {
+        ret->parameters[i] = copy_expr(n->parameters[i]);
+        CHECK_NULL(ret->parameters[i], tx_free(ret));
+    }
+    if (is_loop(n)) {
+        ret->parameters[arity] = loop_copy(n->parameters[arity]);
+        CHECK_NULL(ret->parameters[arity], tx_free(ret));
+    }
+    return ret;
+}
+
+
+/* Constructors for the derivative tree. They take ownership of their */
+/* arguments and pass NULL on. */
+#define IS_ZERO(n) ((n)->type == TX_CONSTANT && (n)->value == 0)
+#define IS_ONE(n) ((n)->type == TX_CONSTANT && (n)->value == 1)
+
+static tx_expr *d_const(d_cx value) {
+    tx_expr *ret = new_expr(0, TX_CONSTANT, 0);
+    CHECK_NULL(ret);
+    ret->value = value;
+    return ret;
+}
+
+
+static tx_expr *d_call1(const void *f, tx_expr *a) {
+    CHECK_NULL(a);
+    tx_expr *ret = NEW_EXPR(0, TX_FUNCTION1 | TX_FLAG_PURE, a);
+    CHECK_NULL(ret, tx_free(a));
+    ret->function = f;
+    return ret;
+}
+
+
+static tx_expr *d_call2(const void *f, tx_expr *a, tx_expr *b) {
+    if (!a || !b) {
+        tx_free(a);
+        tx_free(b);
+        return NULL;
+    }
+    tx_expr *ret = NEW_EXPR(0, TX_FUNCTION2 | TX_FLAG_PURE, a, b);
+    CHECK_NULL(ret, tx_free(a), tx_free(b));
+    ret->function = f;
+    return ret;
+}
+
+
+static tx_expr *d_chain(tx_expr *coefficient, tx_expr *du) {
+    /* coefficient * du, dropping the term when du vanishes. */
+    if (coefficient && du && IS_ZERO(du)) {
+        tx_free(coefficient);
+        return du;
+    }
+    if (coefficient && du && IS_ONE(du)) {
+        tx_free(du);
+        return coefficient;
+    }
+    return d_call2(mul, coefficient, du);
+}
+
+
+static tx_expr *d_sum(tx_expr *a, tx_expr *b, const void *f) {
+    /* a + b or a - b, where either may vanish. */
+    if (a && b && IS_ZERO(b)) {
+        tx_free(b);
+        return a;
+    }
+    if (a && b && IS_ZERO(a)) {
+        tx_free(a);
+        return f == add ? b : d_call1(negate, b);
+    }
+    return d_call2(f, a, b);
+}
+
+
+#define U copy_expr(n->parameters[0])
+#define V copy_expr(n->parameters[1])
+#define N copy_expr(n)
+#define ONE d_const(1)
+
+static tx_expr *d_coefficient(const tx_expr *n, const void *f) {
+    /* The derivative of a built-in of one argument, at that argument. */
+    if (n->function == rabs) return d_call2(divide, U, N);
+    if (f == square) return d_call2(mul, d_const(2), U);
+    if (f == csqrt) return d_call2(divide, d_const(0.5), N);
+    if (f == cexp) return N;
+    if (f == clog) return d_call2(divide, ONE, U);
+    if (f == csin) return d_call1(ccos, U);
+    if (f == ccos) return d_call1(negate, d_call1(csin, U));
+    if (f == ctan) return d_call2(divide, ONE, d_call1(square, d_call1(ccos, U)));
+    if (f == csinh) return d_call1(ccosh, U);
+    if (f == ccosh) return d_call1(csinh, U);
+    if (f == ctanh) return d_call2(divide, ONE, d_call1(square, d_call1(ccosh, U)));
+    if (f == casin) return d_call2(divide, ONE, d_call1(csqrt, d_call2(sub, ONE, d_call1(square, U))));
+    if (f == cacos) return d_call2(divide, d_const(-1), d_call1(csqrt, d_call2(sub, ONE, d_call1(square, U))));
+    if (f == catan) return d_call2(divide, ONE, d_call2(add, ONE, d_call1(square, U)));
+    if (f == casinh) return d_call2(divide, ONE, d_call1(csqrt, d_call2(add, d_call1(square, U), ONE)));
+    if (f == cacosh) {
+        return d_call2(divide, ONE, d_call2(mul, d_call1(csqrt, d_call2(sub, U, ONE)),
+                                                 d_call1(csqrt, d_call2(add, U, ONE))));
+    }
+    if (f == catanh) return d_call2(divide, ONE, d_call2(sub, ONE, d_call1(square, U)));
+    return NULL;
+}
+
+
+static tx_expr *derive(const tx_expr *n, const d_cx *wrt) {
+    if (!depends(n, wrt)) return d_const(0);
+    if (TYPE_MASK(n->type) == TX_VARIABLE) return d_const(1);
+    if (!IS_FUNCTION(n->type) || !IS_PURE(n->type)) return NULL;
+
+    const void *f = complex_kernel(n->function);
+    const int arity = ARITY(n->type);
+    const tx_expr *b = arity > 1 ? n->parameters[1] : 0;
+
+#define DU derive(n->parameters[0], wrt)
+#define DV derive(n->parameters[1], wrt)
+
+    if (arity == 1 && f == negate) return d_call1(negate, DU);
+    if (arity == 1) return d_chain(d_coefficient(n, f), DU);
+    if (arity == 3 && f == cfma) {
+        return d_sum(d_sum(d_chain(V, DU), d_chain(U, DV), add), derive(n->parameters[2], wrt), add);
+    }
+    if (arity != 2) return NULL;
+
+    if (f == add || f == sub) return d_sum(DU, DV, f);
+    if (f == comma) return DV;
+    if (f == mul) return d_sum(d_chain(V, DU), d_chain(U, DV), add);
+    if (f == divide) {
+        if (!depends(b, wrt)) return d_call2(divide, DU, V);
+        return d_call2(divide, d_sum(d_chain(V, DU), d_chain(U, DV), sub), d_call1(square, V));
+    }
+    if (f == ipow) {
+        return d_chain(d_call2(mul, V, d_call2(ipow, U, d_const(creal(b->value) - 1))), DU);
+    }
+    if (f == cpow) {
+        if (!depends(b, wrt)) return d_chain(d_call2(mul, V, d_call2(cpow, U, d_call2(sub, V, ONE))), DU);
+
+        /* (u^v)' = u^v (v' log u + v u' / u) */
+        return d_call2(mul, N, d_sum(d_chain(d_call1(clog, U), DV), d_chain(d_call2(divide, V, U), DU), add));
+    }
+    return NULL;
+
+#undef DU
+#undef DV
+}
+
+#undef U
+#undef V
+#undef N
+#undef ONE
+#undef IS_ZERO
+#undef IS_ONE
+
+
+tx_expr *tx_derive(const tx_expr *n, const d_cx *wrt) {
+    CHECK_NULL(n);
+
+    tx_expr *d = derive(n, wrt);
+    CHECK_NULL(d);
+
+    /* Copied nodes keep their approximations, which realify does not know. */
+    const int tier = fast_tier(n);
+    optimize(d, 0);
+    d = simplify(d, 0, 0);
+    CHECK_NULL(d);
+    optimize(d, 0);
+    if (tier) fast_math(d, 0);
+    realify(d);
+    if (tier) fast_math(d, tier);
+    return d;
+}
+
+
+/* Specialization copies the tree with the frozen variables read into
+ * constants and the real kernels put back to their complex built-ins, so that
+ * folding and simplification see the tree as parsed before it is realified
+ * again. Loop bodies read outside variables themselves, so they are
+ * specialized the same way. */
+static tx_expr *specialize_tree(const tx_expr *n, const d_cx *const *frozen, int count, int tier);
+
+static loop *specialize_loop(const loop *l, const d_cx *const *frozen, int count, int tier) {
+    loop *ret = malloc(sizeof(loop));
+    int i;
+    CHECK_NULL(ret);
+
+    *ret = *l;
+    ret->powers = 0;
+    ret->body = specialize_tree(l->body, frozen, count, tier);
+    CHECK_NULL(ret->body, free(ret));
+    for (i = 0; i < l->powers; ++i) {
+        ret->bases[i] = specialize_tree(l->bases[i], frozen, count, tier);
+        CHECK_NULL(ret->bases[i], loop_free(ret));
+        ++ret->powers;
+    }
+    return ret;
+}
+
+
+static tx_expr *specialize(const tx_expr *n, const d_cx *const *frozen, int count, int tier) {
+    int i;
+    if (TYPE_MASK(n->type) == TX_VARIABLE) {
+        for (i = 0; i < count; ++i) {
+            if (n->bound == frozen[i]) return d_const(*n->bound);
+        }
+    }
+
+    const int arity = ARITY(n->type);
+    const int size = node_size(n->type);
+    tx_expr *ret = malloc(size);
+    CHECK_NULL(ret);
+
+    memcpy(ret, n, size);
+    if (IS_FUNCTION(n->type)) ret->function = complex_kernel(n->function);
+    for (i = 0; i < arity; ++i) ret->parameters[i] = 0;
+    if (is_loop(n)) ret->parameters[arity] = 0;
+    for (i = 0; i < arity; ++i) {
+        ret->parameters[i] = specialize(n->parameters[i], frozen, count, tier);
+        CHECK_NULL(ret->parameters[i], tx_free(ret));
+    }
+    if (is_loop(n)) {
+        ret->parameters[arity] = specialize_loop(n->parameters[arity], frozen, count, tier);
+        CHECK_NULL(ret->parameters[arity], tx_free(ret));
+    }
+    return ret;
+}
+
+
+static tx_expr *specialize_tree(const tx_expr *n, const d_cx *const *frozen, int count, int tier) {
+    tx_expr *ret = specialize(n, frozen, count, tier);
+    CHECK_NULL(ret);
+
+    optimize(ret, 0);
+    ret = simplify(ret, 0, 0);
+    CHECK_NULL(ret);
+    optimize(ret, 0);
+    realify(ret);
+    if (tier) fast_math(ret, tier);
+    return ret;
+}
+
+
+tx_expr *tx_specialize(const tx_expr *n, const d_cx *const *frozen, int count) {
+    CHECK_NULL(n);
+    return specialize_tree(n, frozen, count, fast_tier(n));
+}
+
+
+static int dual_partials(const tx_expr *n, const d_cx *a, d_cx value, d_cx *c) {
+    /* Partial derivatives of a built-in with respect to each argument. */
+    const void *f = complex_kernel(n->function);
+    if (n->function == rabs) c[0] = a[0] / value;
+    else if (f == add) c[0] = 1, c[1] = 1;
+    else if (f == sub) c[0] = 1, c[1] = -1;
+    else if (f == mul) c[0] = a[1], c[1] = a[0];
+    else if (f == cfma) c[0] = a[1], c[1] = a[0], c[2] = 1;
+    else if (f == divide) c[0] = 1 / a[1], c[1] = -value / a[1];
+    else if (f == negate) c[0] = -1;
+    else if (f == comma) c[0] = 0, c[1] = 1;
+    else if (f == square) c[0] = 2 * a[0];
+    else if (f == ipow) c[0] = a[1] * ipow(a[0], a[1] - 1), c[1] = 0;
+    else if (f == cpow) c[0] = a[1] * cpow(a[0], a[1] - 1), c[1] = value * clog(a[0]);
+    else if (f == csqrt) c[0] = 0.5 / value;
+    else if (f == cexp) c[0] = value;
+    else if (f == clog) c[0] = 1 / a[0];
+    else if (f == csin) c[0] = ccos(a[0]);
+    else if (f == ccos) c[0] = -csin(a[0]);
+    else if (f == ctan) c[0] = 1 + value * value;
+    else if (f == csinh) c[0] = ccosh(a[0]);
+    else if (f == ccosh) c[0] = csinh(a[0]);
+    else if (f == ctanh) c[0] = 1 - value * value;
+    else if (f == casin) c[0] = 1 / csqrt(1 - a[0] * a[0]);
+    else if (f == cacos) c[0] = -1 / csqrt(1 - a[0] * a[0]);
+    else if (f == catan) c[0] = 1 / (1 + a[0] * a[0]);
+    else if (f == casinh) c[0] = 1 / csqrt(a[0] * a[0] + 1);
+    else if (f == cacosh) c[0] = 1 / (csqrt(a[0] - 1) * csqrt(a[0] + 1));
+    else if (f == catanh) c[0] = 1 / (1 - a[0] * a[0]);
+    else return 0;
+    return 1;
+}
+
+
+static int dual_size(const tx_expr *n) {
+    /* Gradient vectors needed below n: one per argument on the deepest path. */
+    const int arity = ARITY(n->type);
+    int deepest = 0;
+    int i;
+    for (i = 0; i < arity; ++i) {
+        const int size = dual_size(n->parameters[i]);
+        if (size > deepest) deepest = size;
+    }
+    return arity + deepest;
+}
+
+
+static d_cx dual(const tx_expr *n, const tx_variable *variables, int count, d_cx *grad, d_cx *work, int *varies) {
+    /* Evaluates n into its value and grad. Arguments keep their gradients in */
+    /* work, the rest of work is handed down. */
+    const int arity = ARITY(n->type);
+    d_cx a[6], c[6];
+    int v[6];
+    int i, k;
+
+    *varies = 0;
+    for (k = 0; k < count; ++k) grad[k] = 0;
+
+    switch (TYPE_MASK(n->type)) {
+    case TX_CONSTANT: return n->value;
+    case TX_VARIABLE:
+        for (k = 0; k < count; ++k) {
+            if (variables[k].address == n->bound) grad[k] = 1, *varies = 1;
+        }
+        return *n->bound;
+    }
+
+    for (i = 0; i < arity; ++i) {
+        a[i] = dual(n->parameters[i], variables, count, work + i * count, work + arity * count, v + i);
+        *varies |= v[i];
+    }
+
+    const d_cx value = call_node(n, a);
+    if (!*varies) return value;
+
+    const int known = IS_FUNCTION(n->type) && IS_PURE(n->type) && dual_partials(n, a, value, c);
+
+    /* Arguments that do not vary contribute nothing, even where their partial is not finite. */
+    for (i = 0; i < arity; ++i) {
+        if (!v[i]) continue;
+        for (k = 0; k < count; ++k) {
+            const d_cx g = work[i * count + k];
+            if (known) {
+                grad[k] += c[i] * g;
+            } else if (g != 0) {
+                grad[k] = NAN;
+            }
+        }
+    }
+    return value;
+}
+
+
+d_cx tx_eval_dual(const tx_expr *n, const tx_variable *variables, int var_count, d_cx *partials) {
+    int k, varies;
+    if (!n) {
+        for (k = 0; k < var_count; ++k) partials[k] = NAN;
+        return NAN;
+    }
+
+    const int size = dual_size(n) * var_count;
+    d_cx *work = malloc(sizeof(d_cx) * (size ? size : 1));
+    if (!work) {
+        for (k = 0; k < var_count; ++k) partials[k] = NAN;
+        return NAN;
+    }
+
+    const d_cx ret = dual(n, variables, var_count, partials, work, &varies);
+    free(work);
+    return ret;
+}
+
+
+/* Incremental evaluation keeps the last value of every node, indexed in
+ * pre-order. Marking a variable dirty flags the paths from its leaves to the
+ * root, and evaluation only descends into flagged nodes. Calls to impure
+ * functions and closures are flagged for good, along with everything above them. */
+#define NODE_DIRTY 1
+#define NODE_VOLATILE 2
+
+typedef struct incremental_leaf {
+    const d_cx *bound;
+    int index;
+} incremental_leaf;
+
+struct tx_incremental {
+    const tx_expr *root;
+    int nodes;
+    int leaf_count;
+    int *sizes;
+    int *parents;
+    unsigned char *flags;
+    d_cx *values;
+    incremental_leaf *leaves;
+};
+
+
+static int incremental_index(tx_incremental *inc, const tx_expr *n, int index, int parent) {
+    /* Fills in the node at index and below it, returning its subtree size. */
+    const int arity = ARITY(n->type);
+    int size = 1;
+    int i;
+
+    inc->parents[index] = parent;
+    inc->flags[index] = NODE_DIRTY;
+    if (IS_FUNCTION(n->type) || IS_CLOSURE(n->type)) {
+        if (!IS_PURE(n->type)) inc->flags[index] |= NODE_VOLATILE;
+    } else if (TYPE_MASK(n->type) == TX_VARIABLE) {
+        inc->leaves[inc->leaf_count].bound = n->bound;
+        inc->leaves[inc->leaf_count].index = index;
+        ++inc->leaf_count;
+    }
+
+    for (i = 0; i < arity; ++i) {
+        const int child = index + size;
+        size += incremental_index(inc, n->parameters[i], child, index);
+        inc->flags[index] |= inc->flags[child] & NODE_VOLATILE;
+    }
+    inc->sizes[index] = size;
+    return size;
+}
+
+
+static int leaf_order(const void *a, const void *b) {
+    const uintptr_t x = (uintptr_t)((const incremental_leaf*)a)->bound;
+    const uintptr_t y = (uintptr_t)((const incremental_leaf*)b)->bound;
+    return x < y ? -1 : x > y;
+}
+
+
+tx_incremental *tx_incremental_create(const tx_expr *n) {
+    CHECK_NULL(n);
+
+    const int nodes = node_count(n);
+    tx_incremental *inc = malloc(sizeof(tx_incremental) + (sizeof(d_cx) + sizeof(incremental_leaf) +
+                                 2 * sizeof(int) + 1) * nodes);
+    CHECK_NULL(inc);
+
+    inc->root = n;
+    inc->nodes = nodes;
+    inc->leaf_count = 0;
+    inc->values = (d_cx*)(inc + 1);
+    inc->leaves = (incremental_leaf*)(inc->values + nodes);
+    inc->sizes = (int*)(inc->leaves + nodes);
+    inc->parents = inc->sizes + nodes;
+    inc->flags = (unsigned char*)(inc->parents + nodes);
+    incremental_index(inc, n, 0, -1);
+    qsort(inc->leaves, inc->leaf_count, sizeof(incremental_leaf), leaf_order);
+    return inc;
+}
+
+
+void tx_incremental_free(tx_incremental *inc) {
+    free(inc);
+}
+
+
+void tx_mark_dirty(tx_incremental *inc, const d_cx *variable) {
+    if (!inc) return;
+
+    int i;
+    if (!variable) {
+        for (i = 0; i < inc->nodes; ++i) inc->flags[i] |= NODE_DIRTY;
+        return;
+    }
+
+    /* First leaf bound to the variable. */
+    int lo = 0, hi = inc->leaf_count;
+    while (lo < hi) {
+        const int mid = lo + (hi - lo) / 2;
+        if ((uintptr_t)inc->leaves[mid].bound < (uintptr_t)variable) lo = mid + 1;
+        else hi = mid;
+    }
+
+    /* A flagged node already has its ancestors flagged. */
+    for (; lo < inc->leaf_count && inc->leaves[lo].bound == variable; ++lo) {
+        for (i = inc->leaves[lo].index; i >= 0 && !(inc->flags[i] & NODE_DIRTY); i = inc->parents[i]) {
+            inc->flags[i] |= NODE_DIRTY;
+        }
+    }
+}
+
+
+static d_cx incremental_eval(const tx_expr *n, tx_incremental *inc, int index) {
+    if (!inc->flags[index]) return inc->values[index];
+
+    const int arity = ARITY(n->type);
+    d_cx ret, a[6];
+    int i, child = index + 1;
+
+    switch (TYPE_MASK(n->type)) {
+    case TX_CONSTANT: ret = n->value; break;
+    case TX_VARIABLE: ret = *n->bound; break;
+    default:
+        for (i = 0; i < arity; ++i) {
+            a[i] = incremental_eval(n->parameters[i], inc, child);
+            child += inc->sizes[child];
+        }
+        ret = call_node(n, a);
+        break;
+    }
+
+    inc->values[index] = ret;
+    inc->flags[index] &= ~NODE_DIRTY;
+    return ret;
+}
+
+
+d_cx tx_eval_incremental(tx_incremental *inc) {
+    if (!inc) return NAN;
+    return incremental_eval(inc->root, inc, 0);
+}
+
+#undef NODE_DIRTY
+#undef NODE_VOLATILE
+
+
+/* Batch evaluation walks the tree once per chunk of points, so that the
+ * dispatch cost is paid per chunk and the arithmetic runs in tight loops. */
+#define BATCH_CHUNK 256
+
+#define RE(p, j) (((double*)(p))[2*(j)])
+#define IM(p, j) (((double*)(p))[2*(j)+1])
+
+
+typedef struct batch {
+    const tx_variable *streams;
+    int stream_count;
+    size_t offset;
+    int count;
+} batch;
+
+
+static int batch_slots(const tx_expr *n) {
+    /* Number of chunk buffers needed to evaluate the subtree. */
+    const int arity = ARITY(n->type);
+    int deepest = 0;
+    int i;
+    for (i = 0; i < arity; ++i) {
+        const int s = batch_slots(n->parameters[i]);
+        if (s > deepest) deepest = s;
+    }
+    return arity + deepest;
+}
+
+
+static const d_cx *batch_stream(const batch *b, const d_cx *bound) {
+    int i;
+    for (i = 0; i < b->stream_count; ++i) {
+        if (b->streams[i].address == bound) {
+            return (const d_cx*)b->streams[i].context + b->offset;
+        }
+    }
+    return 0;
+}
+
+
+static void batch_fill(d_cx *out, int count, d_cx value) {
+    int j;
+    for (j = 0; j < count; ++j) out[j] = value;
+}
+
+
+static void batch_mul(d_cx *out, const d_cx *a, const d_cx *b, int count) {
+    int j;
+    /* The textbook formula vectorizes; lanes where it produces NaN+NaNI are
+     * redone with the C99 rules, which recover infinities. */
+    for (j = 0; j < count; ++j) {
+        const double re = RE(a, j) * RE(b, j) - IM(a, j) * IM(b, j);
+        const double im = RE(a, j) * IM(b, j) + IM(a, j) * RE(b, j);
+        RE(out, j) = re;
+        IM(out, j) = im;
+    }
+    for (j = 0; j < count; ++j) {
+        if (RE(out, j) != RE(out, j) && IM(out, j) != IM(out, j)) out[j] = a[j] * b[j];
+    }
+}
+
+
+static void batch_fma(d_cx *out, const d_cx *a, const d_cx *b, const d_cx *c, int count) {
+    int j;
+    /* As batch_mul, with c added into each half of the product. */
+    for (j = 0; j < count; ++j) {
+        const double re = FMA(RE(a, j), RE(b, j), FMA(-IM(a, j), IM(b, j), RE(c, j)));
+        const double im = FMA(RE(a, j), IM(b, j), FMA(IM(a, j), RE(b, j), IM(c, j)));
+        RE(out, j) = re;
+        IM(out, j) = im;
+    }
+    for (j = 0; j < count; ++j) {
+        if (RE(out, j) != RE(out, j) && IM(out, j) != IM(out, j)) out[j] = a[j] * b[j] + c[j];
+    }
+}
+
+
+/* Interval evaluation. Values are bounded by rectangles in the complex
+ * plane, each side a real interval rounded outwards after every operation.
+ * The built-ins have enclosures of their own; anything else gets the whole
+ * plane unless all of its arguments are single points, where it is simply
+ * called. */
+typedef struct interval {
+    double lo, hi;
+} interval;
+
+typedef struct box {
+    interval re, im;
+} box;
+
+#define BOX_PI 3.14159265358979323846
+
+
+static interval iv_make(double lo, double hi) {
+    interval r;
+    if (lo != lo || hi != hi) lo = -INFINITY, hi = INFINITY;
+    r.lo = lo;
+    r.hi = hi;
+    return r;
+}
+
+
+static interval iv_out(interval a, int ulps) {
+    /* Widens by a few units in the last place for rounding in the operation. */
+    while (ulps--) {
+        a.lo = nextafter(a.lo, -INFINITY);
+        a.hi = nextafter(a.hi, INFINITY);
+    }
+    return a;
+}
+
+
+static interval iv_point(double v) {return iv_make(v, v);}
+static int iv_is_point(interval a) {return a.lo == a.hi;}
+static interval iv_clamp(interval a, double lo, double hi) {
+    return iv_make(a.lo < lo ? lo : a.lo, a.hi > hi ? hi : a.hi);
+}
+
+static interval iv_add(interval a, interval b) {return iv_out(iv_make(a.lo + b.lo, a.hi + b.hi), 1);}
+static interval iv_sub(interval a, interval b) {return iv_out(iv_make(a.lo - b.hi, a.hi - b.lo), 1);}
+static interval iv_neg(interval a) {return iv_make(-a.hi, -a.lo);}
+
+
+static double mul0(double a, double b) {
+    /* Zero times an unbounded end is zero, as no infinity is ever reached. */
+    return (a == 0 || b == 0) ? 0 : a * b;
+}
+
+static interval iv_mul(interval a, interval b) {
+    const double p[4] = {mul0(a.lo, b.lo), mul0(a.lo, b.hi), mul0(a.hi, b.lo), mul0(a.hi, b.hi)};
+    double lo = p[0], hi = p[0];
+    int k;
+    for (k = 1; k < 4; ++k) {
+        if (p[k] < lo) lo = p[k];
+        if (p[k] > hi) hi = p[k];
+    }
+    return iv_out(iv_make(lo, hi), 1);
+}
+
+
+static interval iv_sqr(interval a) {
+    const double l = a.lo * a.lo, h = a.hi * a.hi;
+    if (a.lo >= 0) return iv_out(iv_make(l, h), 1);
+    if (a.hi <= 0) return iv_out(iv_make(h, l), 1);
+    return iv_clamp(iv_out(iv_make(0, l > h ? l : h), 1), 0, INFINITY);
+}
+
+
+static interval iv_div(interval a, interval b) {
+    if (b.lo <= 0 && b.hi >= 0) return iv_make(-INFINITY, INFINITY);
+    const double p[4] = {a.lo / b.lo, a.lo / b.hi, a.hi / b.lo, a.hi / b.hi};
+    double lo = p[0], hi = p[0];
+    int k;
+    for (k = 1; k < 4; ++k) {
+        if (p[k] != p[k]) return iv_make(-INFINITY, INFINITY);
+        if (p[k] < lo) lo = p[k];
+        if (p[k] > hi) hi = p[k];
+    }
+    return iv_out(iv_make(lo, hi), 1);
+}
+
+
+static interval iv_abs(interval a) {
+    if (a.lo >= 0) return a;
+    if (a.hi <= 0) return iv_neg(a);
+    return iv_make(0, -a.lo > a.hi ? -a.lo : a.hi);
+}
+
+
+/* Monotone functions, with two units of slack for the library. */
+static interval iv_rising(double (*f)(double), interval a) {return iv_out(iv_make(f(a.lo), f(a.hi)), 2);}
+
+static interval iv_exp(interval a) {return iv_clamp(iv_rising(exp, a), 0, INFINITY);}
+
+static interval iv_log(interval a) {
+    if (a.hi <= 0) return iv_make(-INFINITY, INFINITY);
+    return iv_rising(log, iv_make(a.lo > 0 ? a.lo : 0, a.hi));
+}
+
+static interval iv_sqrt(interval a) {
+    if (a.hi < 0) return iv_make(-INFINITY, INFINITY);
+    return iv_clamp(iv_rising(sqrt, iv_make(a.lo > 0 ? a.lo : 0, a.hi)), 0, INFINITY);
+}
+
+static interval iv_cosh(interval a) {
+    if (a.lo >= 0) return iv_rising(cosh, a);
+    if (a.hi <= 0) return iv_rising(cosh, iv_neg(a));
+    const double h = cosh(-a.lo > a.hi ? -a.lo : a.hi);
+    return iv_out(iv_make(1, h), 2);
+}
+
+
+static interval iv_cos_shifted(interval a, double shift, double lo, double hi) {
+    /* Bounds cos(x - shift) over a, given its values lo and hi at the ends. */
+    if (!(a.hi - a.lo < 2 * BOX_PI)) return iv_make(-1, 1);
+
+    /* Extremes at the multiples of pi inside, counted generously. */
+    const double first = ceil((a.lo - shift) / BOX_PI - 1e-9);
+    const double last = floor((a.hi - shift) / BOX_PI + 1e-9);
+    int k;
+    if (lo > hi) {
+        const double t = lo;
+        lo = hi;
+        hi = t;
+    }
+    for (k = 0; first + k <= last; ++k) {
+        if (k > 2) return iv_make(-1, 1);
+        if (fmod(first + k, 2) == 0) hi = 1;
+        else lo = -1;
+    }
+    return iv_clamp(iv_out(iv_make(lo, hi), 2), -1, 1);
+}
+
+static interval iv_cos(interval a) {return iv_cos_shifted(a, 0, cos(a.lo), cos(a.hi));}
+static interval iv_sin(interval a) {return iv_cos_shifted(a, BOX_PI / 2, sin(a.lo), sin(a.hi));}
+
+static interval iv_tan(interval a) {
+    /* Rising between the poles at pi/2 + k pi. */
+    if (!(a.hi - a.lo < BOX_PI)) return iv_make(-INFINITY, INFINITY);
+    if (floor((a.lo - BOX_PI / 2) / BOX_PI - 1e-9) != floor((a.hi - BOX_PI / 2) / BOX_PI + 1e-9)) {
+        return iv_make(-INFINITY, INFINITY);
+    }
+    return iv_rising(tan, a);
+}
+
+
+static interval iv_ipow(interval a, int e) {
+    /* Squares where the exponent is even, which keeps the result non-negative. */
+    const int negative = e < 0;
+    interval r = iv_point(1);
+    if (negative) e = -e;
+    while (e) {
+        if (e & 1) r = iv_mul(r, a);
+        e >>= 1;
+        if (e) a = iv_sqr(a);
+    }
+    return negative ? iv_div(iv_point(1), r) : r;
+}
+
+
+static box box_make(interval re, interval im) {
+    box r;
+    r.re = re;
+    r.im = im;
+    return r;
+}
+
+static box box_point(d_cx v) {return box_make(iv_point(creal(v)), iv_point(cimag(v)));}
+static box box_real(interval re) {return box_make(re, iv_point(0));}
+static box box_whole(void) {return box_make(iv_make(-INFINITY, INFINITY), iv_make(-INFINITY, INFINITY));}
+
+static double box_norm(box a) {
+    /* Bounds |z| over the box from above. */
+    return fmax(fabs(a.re.lo), fabs(a.re.hi)) + fmax(fabs(a.im.lo), fabs(a.im.hi));
+}
+
+static box box_widen(box a, double relative, int real) {
+    /* Makes room for an error of relative times the largest value in the box. */
+    const double by = relative * box_norm(a);
+    a.re = iv_out(iv_make(a.re.lo - by, a.re.hi + by), 1);
+    if (!real) a.im = iv_out(iv_make(a.im.lo - by, a.im.hi + by), 1);
+    return a;
+}
+
+static box box_mul(box a, box b) {
+    return box_make(iv_sub(iv_mul(a.re, b.re), iv_mul(a.im, b.im)), iv_add(iv_mul(a.re, b.im), iv_mul(a.im, b.re)));
+}
+
+static box box_sqr(box a) {
+    return box_make(iv_sub(iv_sqr(a.re), iv_sqr(a.im)), iv_mul(iv_point(2), iv_mul(a.re, a.im)));
+}
+
+static box box_div(box a, box b) {
+    const interval d = iv_add(iv_sqr(b.re), iv_sqr(b.im));
+    return box_make(iv_div(iv_add(iv_mul(a.re, b.re), iv_mul(a.im, b.im)), d),
+                    iv_div(iv_sub(iv_mul(a.im, b.re), iv_mul(a.re, b.im)), d));
+}
+
+
+static interval box_abs(box a) {
+    /* From the nearest point of the box to the farthest corner. */
+    const double dx = a.re.lo > 0 ? a.re.lo : a.re.hi < 0 ? -a.re.hi : 0;
+    const double dy = a.im.lo > 0 ? a.im.lo : a.im.hi < 0 ? -a.im.hi : 0;
+    const double fx = -a.re.lo > a.re.hi ? -a.re.lo : a.re.hi;
+    const double fy = -a.im.lo > a.im.hi ? -a.im.lo : a.im.hi;
+    return iv_clamp(iv_out(iv_make(hypot(dx, dy), hypot(fx, fy)), 1), 0, INFINITY);
+}
+
+
+static interval box_arg(box a) {
+    /* Boxes touching the origin or the negative real axis see every argument. */
+    if (a.re.lo <= 0 && a.im.lo <= 0 && a.im.hi >= 0) return iv_make(-BOX_PI, BOX_PI);
+
+    /* Otherwise the box lies in a sector bounded by two of its corners. */
+    const double c[4] = {atan2(a.im.lo, a.re.lo), atan2(a.im.lo, a.re.hi), atan2(a.im.hi, a.re.lo),
+                         atan2(a.im.hi, a.re.hi)};
+    double lo = c[0], hi = c[0];
+    int k;
+    for (k = 1; k < 4; ++k) {
+        if (c[k] < lo) lo = c[k];
+        if (c[k] > hi) hi = c[k];
+    }
+    return iv_clamp(iv_out(iv_make(lo, hi), 2), -BOX_PI, BOX_PI);
+}
+
+
+static box box_exp(box a) {
+    const interval r = iv_exp(a.re);
+    return box_make(iv_mul(r, iv_cos(a.im)), iv_mul(r, iv_sin(a.im)));
+}
+
+static box box_log(box a) {return box_make(iv_log(box_abs(a)), box_arg(a));}
+
+static box box_sqrt(box a) {
+    /* Half the argument, as the principal root has a non-negative real part. */
+    const interval r = iv_sqrt(box_abs(a));
+    const interval t = box_arg(a);
+    const interval h = iv_out(iv_make(t.lo / 2, t.hi / 2), 1);
+    return box_make(iv_clamp(iv_mul(r, iv_cos(h)), 0, INFINITY), iv_mul(r, iv_sin(h)));
+}
+
+static box box_sin(box a) {
+    return box_make(iv_mul(iv_sin(a.re), iv_cosh(a.im)), iv_mul(iv_cos(a.re), iv_rising(sinh, a.im)));
+}
+
+static box box_cos(box a) {
+    return box_make(iv_mul(iv_cos(a.re), iv_cosh(a.im)), iv_neg(iv_mul(iv_sin(a.re), iv_rising(sinh, a.im))));
+}
+
+static box box_sinh(box a) {
+    return box_make(iv_mul(iv_rising(sinh, a.re), iv_cos(a.im)), iv_mul(iv_cosh(a.re), iv_sin(a.im)));
+}
+
+static box box_cosh(box a) {
+    return box_make(iv_mul(iv_cosh(a.re), iv_cos(a.im)), iv_mul(iv_rising(sinh, a.re), iv_sin(a.im)));
+}
+
+static box box_ipow(box a, box b);
+
+static box box_pow(box a, box b) {
+    /* exp(b log a), which cpow follows away from zero, or a product for integers. */
+    if (iv_is_point(b.re) && iv_is_point(b.im) && b.im.lo == 0 && b.re.lo == floor(b.re.lo) &&
+        fabs(b.re.lo) <= SIMPLIFY_MAX_POWER) {
+        /* cpow itself goes through exp and log, so its rounding shows in both parts. */
+        box r = box_ipow(a, b);
+        double m = 0;
+        const double ends[4] = {fabs(r.re.lo), fabs(r.re.hi), fabs(r.im.lo), fabs(r.im.hi)};
+        int k;
+        for (k = 0; k < 4; ++k) if (ends[k] > m) m = ends[k];
+        m *= 16 * DBL_EPSILON;
+        return box_make(iv_make(r.re.lo - m, r.re.hi + m), iv_make(r.im.lo - m, r.im.hi + m));
+    }
+    if (a.re.lo <= 0 && a.re.hi >= 0 && a.im.lo <= 0 && a.im.hi >= 0) return box_whole();
+    return box_exp(box_mul(b, box_log(a)));
+}
+
+static box box_ipow(box a, box b) {
+    /* The exponent is a constant integer; even powers go through squares. */
+    if (!iv_is_point(b.re)) return box_whole();
+    int e = (int)b.re.lo;
+    const int negative = e < 0;
+    box r = box_point(1);
+    if (negative) e = -e;
+    while (e) {
+        if (e & 1) r = box_mul(r, a);
+        e >>= 1;
+        if (e) a = box_sqr(a);
+    }
+    return negative ? box_div(box_point(1), r) : r;
+}
+
+
+static int box_builtin(const tx_expr *n, const box *a, box *r) {
+    /* Encloses a built-in, returning 0 where there is no enclosure for it. */
+    const void *f = exact_kernel(n->function);
+
+    /* Real kernels, which only read the real parts. */
+    if (f == radd) *r = box_real(iv_add(a[0].re, a[1].re));
+    else if (f == rsub) *r = box_real(iv_sub(a[0].re, a[1].re));
+    else if (f == rmul) *r = box_real(iv_mul(a[0].re, a[1].re));
+    else if (f == rdivide) *r = box_real(iv_div(a[0].re, a[1].re));
+    else if (f == rnegate) *r = box_real(iv_neg(a[0].re));
+    else if (f == rsquare) *r = box_real(iv_sqr(a[0].re));
+    else if (f == rabs) *r = box_real(iv_abs(a[0].re));
+    else if (f == rsin) *r = box_real(iv_sin(a[0].re));
+    else if (f == rcos) *r = box_real(iv_cos(a[0].re));
+    else if (f == rtan) *r = box_real(iv_tan(a[0].re));
+    else if (f == rsinh) *r = box_real(iv_rising(sinh, a[0].re));
+    else if (f == rcosh) *r = box_real(iv_cosh(a[0].re));
+    else if (f == rtanh) *r = box_real(iv_clamp(iv_rising(tanh, a[0].re), -1, 1));
+    else if (f == rexp) *r = box_real(iv_exp(a[0].re));
+    else if (f == ratan) *r = box_real(iv_clamp(iv_rising(atan, a[0].re), -BOX_PI / 2, BOX_PI / 2));
+    else if (f == rasinh) *r = box_real(iv_rising(asinh, a[0].re));
+    else if (f == ripow) {
+        if (!iv_is_point(a[1].re)) return 0;
+        *r = box_real(iv_ipow(a[0].re, (int)a[1].re.lo));
+    }
+    else if (f == rfma) *r = box_real(iv_add(iv_mul(a[0].re, a[1].re), a[2].re));
+
+    else if (f == add) *r = box_make(iv_add(a[0].re, a[1].re), iv_add(a[0].im, a[1].im));
+    else if (f == sub) *r = box_make(iv_sub(a[0].re, a[1].re), iv_sub(a[0].im, a[1].im));
+    else if (f == mul) *r = box_mul(a[0], a[1]);
+    else if (f == cfma) {
+        const box m = box_mul(a[0], a[1]);
+        *r = box_make(iv_add(m.re, a[2].re), iv_add(m.im, a[2].im));
+    }
+    else if (f == divide) *r = box_div(a[0], a[1]);
+    else if (f == negate) *r = box_make(iv_neg(a[0].re), iv_neg(a[0].im));
+    else if (f == comma) *r = a[1];
+    else if (f == square) *r = box_sqr(a[0]);
+    else if (f == ipow) *r = box_ipow(a[0], a[1]);
+    else if (f == cpow) *r = box_pow(a[0], a[1]);
+    else if (f == conj) *r = box_make(a[0].re, iv_neg(a[0].im));
+    else if (f == _creal) *r = box_real(a[0].re);
+    else if (f == _cimag) *r = box_real(a[0].im);
+    else if (f == _cabs) *r = box_real(box_abs(a[0]));
+    else if (f == _carg) *r = box_real(box_arg(a[0]));
+    else if (f == cexp) *r = box_exp(a[0]);
+    else if (f == clog) *r = box_log(a[0]);
+    else if (f == csqrt) *r = box_sqrt(a[0]);
+    else if (f == csin) *r = box_sin(a[0]);
+    else if (f == ccos) *r = box_cos(a[0]);
+    else if (f == ctan) *r = box_div(box_sin(a[0]), box_cos(a[0]));
+    else if (f == csinh) *r = box_sinh(a[0]);
+    else if (f == ccosh) *r = box_cosh(a[0]);
+    else if (f == ctanh) *r = box_div(box_sinh(a[0]), box_cosh(a[0]));
+    else return 0;
+
+    if (f != n->function) {
+        /* pow inherits the error of log once for every unit of |b log a|. */
+        const int k = fast_find(f);
+        const double scale = f == cpow ? 1 + box_norm(box_mul(a[1], box_log(a[0]))) : 1;
+        *r = box_widen(*r, scale * fast_tolerance[n->function == fast_kernels[k].low], fast_kernels[k].real);
+    }
+    return 1;
+}
+
+
+static box box_eval(const tx_expr *n, const tx_variable *boxes, int box_count) {
+    const int arity = ARITY(n->type);
+    box a[6], r;
+    d_cx v[6];
+    int i, points = 1;
+
+    switch (TYPE_MASK(n->type)) {
+    case TX_CONSTANT: return box_point(n->value);
+    case TX_VARIABLE:
+        for (i = 0; i < box_count; ++i) {
+            if (boxes[i].address == n->bound) {
+                const tx_box *b = boxes[i].context;
+                return box_make(iv_make(b->re_lo, b->re_hi), iv_make(b->im_lo, b->im_hi));
+            }
+        }
+        return box_point(*n->bound);
+    }
+
+    for (i = 0; i < arity; ++i) {
+        a[i] = box_eval(n->parameters[i], boxes, box_count);
+        points &= iv_is_point(a[i].re) && iv_is_point(a[i].im);
+    }
+
+    if (IS_FUNCTION(n->type) && !IS_ARRAY(n->type) && box_builtin(n, a, &r)) return r;
+    if (!points) return box_whole();
+
+    /* A loop reads its outside variables itself, which must be points too. */
+    if (is_loop(n)) {
+        for (i = 0; i < box_count; ++i) {
+            const tx_box *b = boxes[i].context;
+            if ((b->re_lo != b->re_hi || b->im_lo != b->im_hi) && depends(n->parameters[2], boxes[i].address)) {
+                return box_whole();
+            }
+        }
+        return box_point(loop_batch(n->parameters[arity], cx_make(a[0].re.lo, a[0].im.lo),
+                                    cx_make(a[1].re.lo, a[1].im.lo), boxes, box_count, 0, LOOP_STREAM_BOX));
+    }
+
+    for (i = 0; i < arity; ++i) v[i] = cx_make(a[i].re.lo, a[i].im.lo);
+    return box_point(call_node(n, v));
+}
+
+
+tx_box tx_eval_box(const tx_expr *n, const tx_variable *boxes, int box_count) {
+    const box b = n ? box_eval(n, boxes, box_count) : box_whole();
+    tx_box ret;
+    ret.re_lo = b.re.lo;
+    ret.re_hi = b.re.hi;
+    ret.im_lo = b.im.lo;
+    ret.im_hi = b.im.hi;
+    return ret;
+}
+
+#undef BOX_PI
+
+
+/* Compact trees. The batch walk runs over a copy of the tree flattened into
+ * one array in evaluation order, children before their parent, with a node
+ * kind per shape so that it neither tests type bits nor chases pointers. The
+ * last child of a node sits right before it; other children are found by
+ * 32-bit index. */
+enum {NODE_CONSTANT, NODE_VARIABLE, NODE_UNARY, NODE_INFIX, NODE_CALL};
+
+typedef struct compact_node {
+    unsigned char kind;
+    unsigned char op;           /* Opcode of NODE_INFIX and NODE_UNARY, OP_FUNCTION for a plain call, */
+                                /* OP_ARRAY for an array-form one. */
+    unsigned char arity;
+    unsigned char closure;
+    uint32_t index;             /* Left child of NODE_INFIX, call entry of NODE_CALL. */
+    union {d_cx value; const d_cx *bound; const void *function;};
+} compact_node;
+
+typedef struct compact_call {
+    void *context;
+    uint32_t args[6];
+} compact_call;
+
+typedef struct compact_tree {
+    int count;
+    int slots;                  /* Chunk buffers needed, as by batch_slots. */
+    compact_node *nodes;
+    compact_call *calls;
+} compact_tree;
+
+
+static void compact_count(const tx_expr *n, int *nodes, int *calls) {
+    const int arity = ARITY(n->type);
+    int i;
+    ++*nodes;
+    if (IS_CLOSURE(n->type) || (IS_FUNCTION(n->type) && (arity != 1 || IS_ARRAY(n->type)) && infix_op(n) < 0)) {
+        ++*calls;
+    }
+    for (i = 0; i < arity; ++i) compact_count(n->parameters[i], nodes, calls);
+}
+
+
+static uint32_t compact_emit(compact_tree *t, const tx_expr *n, int *calls) {
+    /* Appends the subtree in evaluation order and returns the index of its root. */
+    const int arity = ARITY(n->type);
+    uint32_t args[6];
+    int i;
+
+    for (i = 0; i < arity; ++i) args[i] = compact_emit(t, n->parameters[i], calls);
+
+    compact_node *c = t->nodes + t->count;
+    memset(c, 0, sizeof(compact_node));
+    c->arity = arity;
+
+    switch (TYPE_MASK(n->type)) {
+    case TX_CONSTANT: c->kind = NODE_CONSTANT; c->value = n->value; break;
+    case TX_VARIABLE: c->kind = NODE_VARIABLE; c->bound = n->bound; break;
+    default:
+        c->function = n->function;
+        if (IS_FUNCTION(n->type) && infix_op(n) >= 0) {
+            c->kind = arity == 1 ? NODE_UNARY : NODE_INFIX;
+            c->op = infix_op(n);
+            c->index = args[0];
+        } else if (IS_FUNCTION(n->type) && arity == 1 && !IS_ARRAY(n->type)) {
+            c->kind = NODE_UNARY;
+            c->op = OP_FUNCTION;
+        } else {
+            compact_call *call = t->calls + (*calls)++;
+            c->kind = NODE_CALL;
+            c->op = IS_ARRAY(n->type) ? OP_ARRAY : OP_FUNCTION;
+            c->closure = IS_CLOSURE(n->type);
+            c->index = call - t->calls;
+            call->context = c->closure ? n->parameters[arity] : 0;
+            for (i = 0; i < arity; ++i) call->args[i] = args[i];
+        }
+        break;
+    }
+    return t->count++;
+}
+
+
+static compact_tree *compact_create(const tx_expr *n) {
+    /* One block holding the header, the nodes and the call entries. */
+    int nodes = 0, calls = 0;
+    CHECK_NULL(n);
+    compact_count(n, &nodes, &calls);
+
+    const size_t head = (sizeof(compact_tree) + sizeof(compact_node) - 1) / sizeof(compact_node);
+    compact_tree *t = malloc(sizeof(compact_node) * (head + nodes) + sizeof(compact_call) * calls);
+    CHECK_NULL(t);
+
+    t->count = 0;
+    t->slots = batch_slots(n);
+    t->nodes = (compact_node*)t + head;
+    t->calls = (compact_call*)(t->nodes + nodes);
+    calls = 0;
+    compact_emit(t, n, &calls);
+    return t;
+}
+
+
+static int fast_batch(const void *f, d_cx *out, const d_cx *const *a, int count);
+
+
+#define TX_FUN(...) ((d_cx(*)(__VA_ARGS__))c->function)
+#define A(e) a[e][j]
+
+
+static const d_cx *batch_eval(const compact_tree *t, uint32_t index, const batch *b, d_cx *out, d_cx *scratch) {
+    /* Evaluates b->count points of the subtree and returns where they are, */
+    /* which is either out or the input stream itself. */
+    const compact_node *c = t->nodes + index;
+    const int arity = c->arity;
+    const int count = b->count;
+    const d_cx *a[7];
+    const d_cx *src;
+    void *context;
+    int i, j;
+
+    switch (c->kind) {
+    case NODE_CONSTANT: batch_fill(out, count, c->value); return out;
+
+    case NODE_VARIABLE:
+        src = batch_stream(b, c->bound);
+        if (src) return src;
+        batch_fill(out, count, *c->bound);
+        return out;
+
+    case NODE_UNARY:
+        a[0] = batch_eval(t, index - 1, b, scratch, scratch + BATCH_CHUNK);
+        switch (c->op) {
+        case OP_NEG: for (j = 0; j < count; ++j) out[j] = -a[0][j]; return out;
+        case OP_RNEG: for (j = 0; j < count; ++j) {RE(out, j) = -RE(a[0], j); IM(out, j) = 0;} return out;
+        }
+        if (fast_batch(c->function, out, a, count)) return out;
+        for (j = 0; j < count; ++j) out[j] = TX_FUN(d_cx)(A(0));
+        return out;
+
+    case NODE_INFIX:
+        if (c->op == OP_COMMA) {
+            /* The left side runs only for its effects; the right one lands in out. */
+            batch_eval(t, c->index, b, scratch, scratch + BATCH_CHUNK);
+            src = batch_eval(t, index - 1, b, out, scratch);
+            if (src != out) memcpy(out, src, sizeof(d_cx) * count);
+            return out;
+        }
+        a[0] = batch_eval(t, c->index, b, scratch, scratch + 2 * BATCH_CHUNK);
+        a[1] = batch_eval(t, index - 1, b, scratch + BATCH_CHUNK, scratch + 2 * BATCH_CHUNK);
+        switch (c->op) {
+        case OP_ADD: for (j = 0; j < count; ++j) out[j] = a[0][j] + a[1][j]; return out;
+        case OP_SUB: for (j = 0; j < count; ++j) out[j] = a[0][j] - a[1][j]; return out;
+        case OP_MUL: batch_mul(out, a[0], a[1], count); return out;
+        case OP_DIV: for (j = 0; j < count; ++j) out[j] = a[0][j] / a[1][j]; return out;
+        case OP_POW: for (j = 0; j < count; ++j) out[j] = cpow(a[0][j], a[1][j]); return out;
+        case OP_RADD: for (j = 0; j < count; ++j) {RE(out, j) = RE(a[0], j) + RE(a[1], j); IM(out, j) = 0;} return out;
+        case OP_RSUB: for (j = 0; j < count; ++j) {RE(out, j) = RE(a[0], j) - RE(a[1], j); IM(out, j) = 0;} return out;
+        case OP_RMUL: for (j = 0; j < count; ++j) {RE(out, j) = RE(a[0], j) * RE(a[1], j); IM(out, j) = 0;} return out;
+        case OP_RDIV: for (j = 0; j < count; ++j) {RE(out, j) = RE(a[0], j) / RE(a[1], j); IM(out, j) = 0;} return out;
+        }
+        batch_fill(out, count, NAN);
+        return out;
+    }
+
+    const compact_call *call = t->calls + c->index;
+    for (i = 0; i < arity; ++i) {
+        a[i] = batch_eval(t, call->args[i], b, scratch + i * BATCH_CHUNK, scratch + arity * BATCH_CHUNK);
+    }
+
+    if (c->op == OP_ARRAY) {
+        ((tx_array_fn)c->function)(call->context, a, out, count);
+        return out;
+    }
+
+    if (c->closure && is_loop_call(c->function, arity)) {
+        for (j = 0; j < count; ++j) {
+            out[j] = loop_batch(call->context, A(0), A(1), b->streams, b->stream_count, b->offset + j, LOOP_STREAM_CX);
+        }
+    } else if (!c->closure && c->function == cfma) {
+        batch_fma(out, a[0], a[1], a[2], count);
+    } else if (!c->closure) {
+        if (fast_batch(c->function, out, a, count)) return out;
+        switch (arity) {
+        case 0: batch_fill(out, count, TX_FUN(void)()); break;
+        case 2: for (j = 0; j < count; ++j) out[j] = TX_FUN(d_cx, d_cx)(A(0), A(1)); break;
+        case 3: for (j = 0; j < count; ++j) out[j] = TX_FUN(d_cx, d_cx, d_cx)(A(0), A(1), A(2)); break;
+        case 4: for (j = 0; j < count; ++j) out[j] = TX_FUN(d_cx, d_cx, d_cx, d_cx)(A(0), A(1), A(2), A(3)); break;
+        case 5: for (j = 0; j < count; ++j) out[j] = TX_FUN(d_cx, d_cx, d_cx, d_cx, d_cx)(A(0), A(1), A(2), A(3), A(4)); break;
+        case 6: for (j = 0; j < count; ++j) out[j] = TX_FUN(d_cx, d_cx, d_cx, d_cx, d_cx, d_cx)(A(0), A(1), A(2), A(3), A(4), A(5)); break;
+        }
+    } else {
+        context = call->context;
+        switch (arity) {
+        case 0: for (j = 0; j < count; ++j) out[j] = TX_FUN(void*)(context); break;
+        case 1: for (j = 0; j < count; ++j) out[j] = TX_FUN(void*, d_cx)(context, A(0)); break;
+        case 2: for (j = 0; j < count; ++j) out[j] = TX_FUN(void*, d_cx, d_cx)(context, A(0), A(1)); break;
+        case 3: for (j = 0; j < count; ++j) out[j] = TX_FUN(void*, d_cx, d_cx, d_cx)(context, A(0), A(1), A(2)); break;
+        case 4: for (j = 0; j < count; ++j) out[j] = TX_FUN(void*, d_cx, d_cx, d_cx, d_cx)(context, A(0), A(1), A(2), A(3)); break;
+        case 5: for (j = 0; j < count; ++j) out[j] = TX_FUN(void*, d_cx, d_cx, d_cx, d_cx, d_cx)(context, A(0), A(1), A(2), A(3), A(4)); break;
+        case 6: for (j = 0; j < count; ++j) out[j] = TX_FUN(void*, d_cx, d_cx, d_cx, d_cx, d_cx, d_cx)(context, A(0), A(1), A(2), A(3), A(4), A(5)); break;
+        }
+    }
+
+    return out;
+}
+
+#undef TX_FUN
+#undef A
+
+
+static void batch_range(const compact_tree *t, const tx_variable *streams, int stream_count,
+                        size_t begin, size_t end, d_cx *out, d_cx *scratch) {
+    /* Evaluates points [begin, end) with scratch from batch_scratch. */
+    size_t done;
+    batch b;
+    b.streams = streams;
+    b.stream_count = stream_count;
+
+    for (done = begin; done < end; done += b.count) {
+        b.offset = done;
+        b.count = (end - done < BATCH_CHUNK) ? (int)(end - done) : BATCH_CHUNK;
+
+        const d_cx *r = batch_eval(t, t->count - 1, &b, scratch, scratch + BATCH_CHUNK);
+        memmove(out + done, r, sizeof(d_cx) * b.count);
+    }
+}
+
+
+static d_cx *batch_scratch(const compact_tree *t) {
+    return t ? malloc(sizeof(d_cx) * BATCH_CHUNK * (t->slots + 1)) : 0;
+}
+
+
+void tx_eval_batch(const tx_expr *n, const tx_variable *streams, int stream_count, size_t len, d_cx *out) {
+    compact_tree *t = compact_create(n);
+    d_cx *scratch = batch_scratch(t);
+    if (!scratch) {
+        size_t j;
+        for (j = 0; j < len; ++j) out[j] = NAN;
+        free(t);
+        return;
+    }
+
+    batch_range(t, streams, stream_count, 0, len, out, scratch);
+    free(scratch);
+    free(t);
+}
+
+
+/* Structure-of-arrays batch evaluation. Real and imaginary parts live in
+ * separate planes, so complex arithmetic maps onto plain SIMD lanes without
+ * shuffles. The kernels are picked at runtime from the CPU features. */
+
+#if !defined(TX_NO_SIMD) && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SOA_X86
+#include <immintrin.h>
+#elif !defined(TX_NO_SIMD) && (defined(__aarch64__) || defined(_M_ARM64))
+#define SOA_NEON
+#include <arm_neon.h>
+#endif
+
+
+typedef void (*soa_binary)(double *ore, double *oim, const double *are, const double *aim,
+                           const double *bre, const double *bim, int start, int count);
+typedef void (*soa_unary)(double *ore, double *oim, const double *are, const double *aim, int start, int count);
+typedef void (*soa_fast_real)(double *o, const double *a, int start, int count, int mode, int low);
+typedef void (*soa_fast_complex)(double *ore, double *oim, const double *are, const double *aim,
+                                 int start, int count, int mode, int low);
+typedef void (*soa_fast_pow)(double *ore, double *oim, const double *are, const double *aim,
+                             const double *bre, const double *bim, int start, int count, int low);
+
+typedef struct soa_kernels {
+    soa_binary add, sub, mul, div;
+    soa_unary neg, conj, real, imag, abs;
+    soa_fast_real fast_real;
+    soa_fast_complex fast_complex;
+    soa_fast_pow fast_pow;
+} soa_kernels;
+
+
+/* Portable kernels. They also finish the tail of every vector kernel. */
+
+static void soa_add_c(double *ore, double *oim, const double *are, const double *aim,
+                      const double *bre, const double *bim, int j, int count) {
+    for (; j < count; ++j) {ore[j] = are[j] + bre[j]; oim[j] = aim[j] + bim[j];}
+}
+
+static void soa_sub_c(double *ore, double *oim, const double *are, const double *aim,
+                      const double *bre, const double *bim, int j, int count) {
+    for (; j < count; ++j) {ore[j] = are[j] - bre[j]; oim[j] = aim[j] - bim[j];}
+}
+
+static void soa_mul_c(double *ore, double *oim, const double *are, const double *aim,
+                      const double *bre, const double *bim, int j, int count) {
+    for (; j < count; ++j) {
+        const double re = are[j] * bre[j] - aim[j] * bim[j];
+        const double im = are[j] * bim[j] + aim[j] * bre[j];
+        ore[j] = re;
+        oim[j] = im;
+    }
+}
+
+static void soa_div_c(double *ore, double *oim, const double *are, const double *aim,
+                      const double *bre, const double *bim, int j, int count) {
+    for (; j < count; ++j) {
+        const double d = bre[j] * bre[j] + bim[j] * bim[j];
+        const double re = (are[j] * bre[j] + aim[j] * bim[j]) / d;
+        const double im = (aim[j] * bre[j] - are[j] * bim[j]) / d;
+        ore[j] = re;
+        oim[j] = im;
+    }
+}
+
+static void soa_neg_c(double *ore, double *oim, const double *are, const double *aim, int j, int count) {
+    for (; j < count; ++j) {ore[j] = -are[j]; oim[j] = -aim[j];}
+}
+
+static void soa_conj_c(double *ore, double *oim, const double *are, const double *aim, int j, int count) {
+    for (; j < count; ++j) {ore[j] = are[j]; oim[j] = -aim[j];}
+}
+
+static void soa_real_c(double *ore, double *oim, const double *are, const double *aim, int j, int count) {
+    (void)aim;
+    for (; j < count; ++j) {ore[j] = are[j]; oim[j] = 0.0;}
+}
+
+static void soa_imag_c(double *ore, double *oim, const double *are, const double *aim, int j, int count) {
+    (void)are;
+    for (; j < count; ++j) {ore[j] = aim[j]; oim[j] = 0.0;}
+}
+
+static void soa_abs_c(double *ore, double *oim, const double *are, const double *aim, int j, int count) {
+    for (; j < count; ++j) {ore[j] = sqrt(are[j] * are[j] + aim[j] * aim[j]); oim[j] = 0.0;}
+}
+
+
+/* The textbook formulas used by the kernels lose the C99 treatment of
+ * infinities, and for division and abs also overflow or underflow early.
+ * The affected lanes are recomputed with the scalar library. */
+
+static void soa_mul_fixup(double *ore, double *oim, const double *are, const double *aim,
+                          const double *bre, const double *bim, int count) {
+    int j;
+    for (j = 0; j < count; ++j) {
+        if (ore[j] != ore[j] && oim[j] != oim[j]) {
+            const d_cx r = cx_make(are[j], aim[j]) * cx_make(bre[j], bim[j]);
+            ore[j] = creal(r);
+            oim[j] = cimag(r);
+        }
+    }
+}
+
+static void soa_fma(double *ore, double *oim, const tx_planes *a, int count) {
+    /* a[0]*a[1] + a[2], lanes left NaN+NaNI redone as in soa_mul_fixup. */
+    int j;
+    for (j = 0; j < count; ++j) {
+        const double re = FMA(a[0].re[j], a[1].re[j], FMA(-a[0].im[j], a[1].im[j], a[2].re[j]));
+        const double im = FMA(a[0].re[j], a[1].im[j], FMA(a[0].im[j], a[1].re[j], a[2].im[j]));
+        ore[j] = re;
+        oim[j] = im;
+    }
+    for (j = 0; j < count; ++j) {
+        if (ore[j] != ore[j] && oim[j] != oim[j]) {
+            const d_cx r = cx_make(a[0].re[j], a[0].im[j]) * cx_make(a[1].re[j], a[1].im[j]) +
+                           cx_make(a[2].re[j], a[2].im[j]);
+            ore[j] = creal(r);
+            oim[j] = cimag(r);
+        }
+    }
+}
+
+static int soa_div_safe(double v) {
+    return v == 0.0 || (fabs(v) >= 0x1p-400 && fabs(v) <= 0x1p400);
+}
+
+static void soa_div_fixup(double *ore, double *oim, const double *are, const double *aim,
+                          const double *bre, const double *bim, int count) {
+    int j;
+    for (j = 0; j < count; ++j) {
+        if (!soa_div_safe(are[j]) || !soa_div_safe(aim[j]) || !soa_div_safe(bre[j]) || !soa_div_safe(bim[j])
+            || (bre[j] == 0.0 && bim[j] == 0.0)) {
+            const d_cx r = cx_make(are[j], aim[j]) / cx_make(bre[j], bim[j]);
+            ore[j] = creal(r);
+            oim[j] = cimag(r);
+        }
+    }
+}
+
+static void soa_abs_fixup(double *ore, const double *are, const double *aim, int count) {
+    int j;
+    for (j = 0; j < count; ++j) {
+        if (!(ore[j] >= 0x1p-450 && ore[j] <= 0x1p450)) ore[j] = hypot(are[j], aim[j]);
+    }
+}
+
+
+/* Vector kernels are stamped out from the V_* primitives of each instruction set. */
+
+#define SOA_KERNELS(SFX, ATTR)                                                                          \
+static ATTR void soa_add_##SFX(double *ore, double *oim, const double *are, const double *aim,          \
+                               const double *bre, const double *bim, int j, int count) {                \
+    for (; j + V_WIDTH <= count; j += V_WIDTH) {                                                        \
+        V_STORE(ore + j, V_ADD(V_LOAD(are + j), V_LOAD(bre + j)));                                      \
+        V_STORE(oim + j, V_ADD(V_LOAD(aim + j), V_LOAD(bim + j)));                                      \
+    }                                                                                                   \
+    soa_add_c(ore, oim, are, aim, bre, bim, j, count);                                                  \
+}                                                                                                       \
+static ATTR void soa_sub_##SFX(double *ore, double *oim, const double *are, const double *aim,          \
+                               const double *bre, const double *bim, int j, int count) {                \
+    for (; j + V_WIDTH <= count; j += V_WIDTH) {                                                        \
+        V_STORE(ore + j, V_SUB(V_LOAD(are + j), V_LOAD(bre + j)));                                      \
+        V_STORE(oim + j, V_SUB(V_LOAD(aim + j), V_LOAD(bim + j)));                                      \
+    }                                                                                                   \
+    soa_sub_c(ore, oim, are, aim, bre, bim, j, count);                                                  \
+}                                                                                                       \
+static ATTR void soa_mul_##SFX(double *ore, double *oim, const double *are, const double *aim,          \
+                               const double *bre, const double *bim, int j, int count) {                \
+    for (; j + V_WIDTH <= count; j += V_WIDTH) {                                                        \
+        const V_TYPE ar = V_LOAD(are + j), ai = V_LOAD(aim + j);                                        \
+        const V_TYPE br = V_LOAD(bre + j), bi = V_LOAD(bim + j);                                        \
+        V_STORE(ore + j, V_SUB(V_MUL(ar, br), V_MUL(ai, bi)));                                          \
+        V_STORE(oim + j, V_ADD(V_MUL(ar, bi), V_MUL(ai, br)));                                          \
+    }                                                                                                   \
+    soa_mul_c(ore, oim, are, aim, bre, bim, j, count);                                                  \
+}                                                                                                       \
+static ATTR void soa_div_##SFX(double *ore, double *oim, const double *are, const double *aim,          \
+                               const double *bre, const double *bim, int j, int count) {                \
+    for (; j + V_WIDTH <= count; j += V_WIDTH) {                                                        \
+        const V_TYPE ar = V_LOAD(are + j), ai = V_LOAD(aim + j);                                        \
+        const V_TYPE br = V_LOAD(bre + j), bi = V_LOAD(bim + j);                                        \
+        const V_TYPE d = V_ADD(V_MUL(br, br), V_MUL(bi, bi));                                           \
+        V_STORE(ore + j, V_DIV(V_ADD(V_MUL(ar, br), V_MUL(ai, bi)), d));                                \
+        V_STORE(oim + j, V_DIV(V_SUB(V_MUL(ai, br), V_MUL(ar, bi)), d));                                \
+    }                                                                                                   \
+    soa_div_c(ore, oim, are, aim, bre, bim, j, count);                                                  \
+}                                                                                                       \
+static ATTR void soa_neg_##SFX(double *ore, double *oim, const double *are, const double *aim,          \
+                               int j, int count) {                                                      \
+    for (; j + V_WIDTH <= count; j += V_WIDTH) {                                                        \
+        V_STORE(ore + j, V_NEG(V_LOAD(are + j)));                                                       \
+        V_STORE(oim + j, V_NEG(V_LOAD(aim + j)));                                                       \
+    }                                                                                                   \
+    soa_neg_c(ore, oim, are, aim, j, count);                                                            \
+}                                                                                                       \
+static ATTR void soa_conj_##SFX(double *ore, double *oim, const double *are, const double *aim,         \
+                                int j, int count) {                                                     \
+    for (; j + V_WIDTH <= count; j += V_WIDTH) {                                                        \
+        V_STORE(ore + j, V_LOAD(are + j));                                                              \
+        V_STORE(oim + j, V_NEG(V_LOAD(aim + j)));                                                       \
+    }                                                                                                   \
+    soa_conj_c(ore, oim, are, aim, j, count);                                                           \
+}                                                                                                       \
+static ATTR void soa_real_##SFX(double *ore, double *oim, const double *are, const double *aim,         \
+                                int j, int count) {                                                     \
+    for (; j + V_WIDTH <= count; j += V_WIDTH) {                                                        \
+        V_STORE(ore + j, V_LOAD(are + j));                                                              \
+        V_STORE(oim + j, V_ZERO());                                                                     \
+    }                                                                                                   \
+    soa_real_c(ore, oim, are, aim, j, count);                                                           \
+}                                                                                                       \
+static ATTR void soa_imag_##SFX(double *ore, double *oim, const double *are, const double *aim,         \
+                                int j, int count) {                                                     \
+    for (; j + V_WIDTH <= count; j += V_WIDTH) {                                                        \
+        V_STORE(ore + j, V_LOAD(aim + j));                                                              \
+        V_STORE(oim + j, V_ZERO());                                                                     \
+    }                                                                                                   \
+    soa_imag_c(ore, oim, are, aim, j, count);                                                           \
+}                                                                                                       \
+static ATTR void soa_abs_##SFX(double *ore, double *oim, const double *are, const double *aim,          \
+                               int j, int count) {                                                      \
+    for (; j + V_WIDTH <= count; j += V_WIDTH) {                                                        \
+        const V_TYPE ar = V_LOAD(are + j), ai = V_LOAD(aim + j);                                        \
+        V_STORE(ore + j, V_SQRT(V_ADD(V_MUL(ar, ar), V_MUL(ai, ai))));                                  \
+        V_STORE(oim + j, V_ZERO());                                                                     \
+    }                                                                                                   \
+    soa_abs_c(ore, oim, are, aim, j, count);                                                            \
+}                                                                                                       \
+static const soa_kernels soa_##SFX = {                                                                  \
+    soa_add_##SFX, soa_sub_##SFX, soa_mul_##SFX, soa_div_##SFX,                                         \
+    soa_neg_##SFX, soa_conj_##SFX, soa_real_##SFX, soa_imag_##SFX, soa_abs_##SFX,                       \
+    fast_real_##SFX, fast_complex_##SFX, fast_pow_##SFX                                                 \
+};
+
+
+static const soa_kernels soa_c = {
+    soa_add_c, soa_sub_c, soa_mul_c, soa_div_c,
+    soa_neg_c, soa_conj_c, soa_real_c, soa_imag_c, soa_abs_c,
+    fast_real_c, fast_complex_c, fast_pow_c
+};
+
+
+/* Vector lanes never carry extra precision, so adding and taking away 1.5 * 2^52 rounds. */
+#define V_ROUND(a) V_SUB(V_ADD((a), V_SET1(FAST_ROUND)), V_SET1(FAST_ROUND))
+
+#if defined(SOA_X86)
+
+#define V_TYPE __m128d
+#define V_WIDTH 2
+#define V_LOAD(p) _mm_loadu_pd(p)
+#define V_STORE(p, v) _mm_storeu_pd((p), (v))
+#define V_ADD(a, b) _mm_add_pd((a), (b))
+#define V_SUB(a, b) _mm_sub_pd((a), (b))
+#define V_MUL(a, b) _mm_mul_pd((a), (b))
+#define V_DIV(a, b) _mm_div_pd((a), (b))
+#define V_SQRT(a) _mm_sqrt_pd(a)
+#define V_NEG(a) _mm_xor_pd((a), _mm_set1_pd(-0.0))
+#define V_ZERO() _mm_setzero_pd()
+#define V_SET1(c) _mm_set1_pd(c)
+#define V_MASK __m128d
+#define V_LT(a, b) _mm_cmplt_pd((a), (b))
+#define V_EQ(a, b) _mm_cmpeq_pd((a), (b))
+#define V_SELECT(m, a, b) _mm_or_pd(_mm_and_pd((m), (a)), _mm_andnot_pd((m), (b)))
+#define V_ABS(a) _mm_andnot_pd(_mm_set1_pd(-0.0), (a))
+#define V_COPYSIGN(a, s) _mm_or_pd(V_ABS(a), _mm_and_pd(_mm_set1_pd(-0.0), (s)))
+#define V_EXP2I(k) _mm_castsi128_pd(_mm_slli_epi64(_mm_castpd_si128(_mm_add_pd((k), _mm_set1_pd(0x1p52 + 1023))), 52))
+#define V_EXPONENT(a) _mm_sub_pd(_mm_or_pd(_mm_castsi128_pd(_mm_srli_epi64(_mm_castpd_si128(a), 52)), \
+                                           _mm_set1_pd(0x1p52)), _mm_set1_pd(0x1p52 + 1023))
+#define V_MANTISSA(a) _mm_or_pd(_mm_and_pd((a), _mm_castsi128_pd(_mm_set1_epi64x(0x000FFFFFFFFFFFFFll))), \
+                                _mm_set1_pd(1.0))
+FAST_KERNELS(sse2, __attribute__((target("sse2"))))
+SOA_KERNELS(sse2, __attribute__((target("sse2"))))
+#undef V_TYPE
+#undef V_WIDTH
+#undef V_LOAD
+#undef V_STORE
+#undef V_ADD
+#undef V_SUB
+#undef V_MUL
+#undef V_DIV
+#undef V_SQRT
+#undef V_NEG
+#undef V_ZERO
+#undef V_SET1
+#undef V_MASK
+#undef V_LT
+#undef V_EQ
+#undef V_SELECT
+#undef V_ABS
+#undef V_COPYSIGN
+#undef V_EXP2I
+#undef V_EXPONENT
+#undef V_MANTISSA
+
+#define V_TYPE __m256d
+#define V_WIDTH 4
+#define V_LOAD(p) _mm256_loadu_pd(p)
+#define V_STORE(p, v) _mm256_storeu_pd((p), (v))
+#define V_ADD(a, b) _mm256_add_pd((a), (b))
+#define V_SUB(a, b) _mm256_sub_pd((a), (b))
+#define V_MUL(a, b) _mm256_mul_pd((a), (b))
+#define V_DIV(a, b) _mm256_div_pd((a), (b))
+#define V_SQRT(a) _mm256_sqrt_pd(a)
+#define V_NEG(a) _mm256_xor_pd((a), _mm256_set1_pd(-0.0))
+#define V_ZERO() _mm256_setzero_pd()
+#define V_SET1(c) _mm256_set1_pd(c)
+#define V_MASK __m256d
+#define V_LT(a, b) _mm256_cmp_pd((a), (b), _CMP_LT_OQ)
+#define V_EQ(a, b) _mm256_cmp_pd((a), (b), _CMP_EQ_OQ)
+#define V_SELECT(m, a, b) _mm256_blendv_pd((b), (a), (m))
+#define V_ABS(a) _mm256_andnot_pd(_mm256_set1_pd(-0.0), (a))
+#define V_COPYSIGN(a, s) _mm256_or_pd(V_ABS(a), _mm256_and_pd(_mm256_set1_pd(-0.0), (s)))
+#define V_EXP2I(k) _mm256_castsi256_pd(_mm256_slli_epi64(_mm256_castpd_si256(_mm256_add_pd((k), \
+                                                         _mm256_set1_pd(0x1p52 + 1023))), 52))
+#define V_EXPONENT(a) _mm256_sub_pd(_mm256_or_pd(_mm256_castsi256_pd(_mm256_srli_epi64(_mm256_castpd_si256(a), 52)), \
+                                                 _mm256_set1_pd(0x1p52)), _mm256_set1_pd(0x1p52 + 1023))
+#define V_MANTISSA(a) _mm256_or_pd(_mm256_and_pd((a), _mm256_castsi256_pd(_mm256_set1_epi64x(0x000FFFFFFFFFFFFFll))), \
+                                   _mm256_set1_pd(1.0))
+FAST_KERNELS(avx2, __attribute__((target("avx2"))))
+SOA_KERNELS(avx2, __attribute__((target("avx2"))))
+#undef V_TYPE
+#undef V_WIDTH
+#undef V_LOAD
+#undef V_STORE
+#undef V_ADD
+#undef V_SUB
+#undef V_MUL
+#undef V_DIV
+#undef V_SQRT
+#undef V_NEG
+#undef V_ZERO
+#undef V_SET1
+#undef V_MASK
+#undef V_LT
+#undef V_EQ
+#undef V_SELECT
+#undef V_ABS
+#undef V_COPYSIGN
+#undef V_EXP2I
+#undef V_EXPONENT
+#undef V_MANTISSA
+
+#define V_TYPE __m512d
+#define V_WIDTH 8
+#define V_LOAD(p) _mm512_loadu_pd(p)
+#define V_STORE(p, v) _mm512_storeu_pd((p), (v))
+#define V_ADD(a, b) _mm512_add_pd((a), (b))
+#define V_SUB(a, b) _mm512_sub_pd((a), (b))
+#define V_MUL(a, b) _mm512_mul_pd((a), (b))
+#define V_DIV(a, b) _mm512_div_pd((a), (b))
+#define V_SQRT(a) _mm512_sqrt_pd(a)
+#define V_NEG(a) _mm512_castsi512_pd(_mm512_xor_si512(_mm512_castpd_si512(a), _mm512_set1_epi64(INT64_MIN)))
+#define V_ZERO() _mm512_setzero_pd()
+#define V_SET1(c) _mm512_set1_pd(c)
+#define V_MASK __mmask8
+#define V_LT(a, b) _mm512_cmp_pd_mask((a), (b), _CMP_LT_OQ)
+#define V_EQ(a, b) _mm512_cmp_pd_mask((a), (b), _CMP_EQ_OQ)
+#define V_SELECT(m, a, b) _mm512_mask_blend_pd((m), (b), (a))
+#define V_ABS(a) _mm512_abs_pd(a)
+#define V_COPYSIGN(a, s) _mm512_castsi512_pd(_mm512_or_si512(_mm512_castpd_si512(V_ABS(a)), \
+                                             _mm512_and_si512(_mm512_castpd_si512(s), _mm512_set1_epi64(INT64_MIN))))
+#define V_EXP2I(k) _mm512_castsi512_pd(_mm512_slli_epi64(_mm512_castpd_si512(_mm512_add_pd((k), \
+                                                         _mm512_set1_pd(0x1p52 + 1023))), 52))
+#define V_EXPONENT(a) _mm512_sub_pd(_mm512_castsi512_pd(_mm512_or_si512(_mm512_srli_epi64(_mm512_castpd_si512(a), 52), \
+                                                    _mm512_castpd_si512(_mm512_set1_pd(0x1p52)))), \
+                                    _mm512_set1_pd(0x1p52 + 1023))
+#define V_MANTISSA(a) _mm512_castsi512_pd(_mm512_or_si512(_mm512_and_si512(_mm512_castpd_si512(a), \
+                                                      _mm512_set1_epi64(0x000FFFFFFFFFFFFFll)), \
+                                                      _mm512_castpd_si512(_mm512_set1_pd(1.0))))
+FAST_KERNELS(avx512, __attribute__((target("avx512f"))))
+SOA_KERNELS(avx512, __attribute__((target("avx512f"))))
+#undef V_TYPE
+#undef V_WIDTH
+#undef V_LOAD
+#undef V_STORE
+#undef V_ADD
+#undef V_SUB
+#undef V_MUL
+#undef V_DIV
+#undef V_SQRT
+#undef V_NEG
+#undef V_ZERO
+#undef V_SET1
+#undef V_MASK
+#undef V_LT
+#undef V_EQ
+#undef V_SELECT
+#undef V_ABS
+#undef V_COPYSIGN
+#undef V_EXP2I
+#undef V_EXPONENT
+#undef V_MANTISSA
+
+#elif defined(SOA_NEON)
+
+#define V_TYPE float64x2_t
+#define V_WIDTH 2
+#define V_LOAD(p) vld1q_f64(p)
+#define V_STORE(p, v) vst1q_f64((p), (v))
+#define V_ADD(a, b) vaddq_f64((a), (b))
+#define V_SUB(a, b) vsubq_f64((a), (b))
+#define V_MUL(a, b) vmulq_f64((a), (b))
+#define V_DIV(a, b) vdivq_f64((a), (b))
+#define V_SQRT(a) vsqrtq_f64(a)
+#define V_NEG(a) vnegq_f64(a)
+#define V_ZERO() vdupq_n_f64(0.0)
+#define V_SET1(c) vdupq_n_f64(c)
+#define V_MASK uint64x2_t
+#define V_LT(a, b) vcltq_f64((a), (b))
+#define V_EQ(a, b) vceqq_f64((a), (b))
+#define V_SELECT(m, a, b) vbslq_f64((m), (a), (b))
+#define V_ABS(a) vabsq_f64(a)
+#define V_COPYSIGN(a, s) vbslq_f64(vdupq_n_u64(0x8000000000000000ull), (s), (a))
+#define V_EXP2I(k) vreinterpretq_f64_u64(vshlq_n_u64(vreinterpretq_u64_f64(vaddq_f64((k), vdupq_n_f64(0x1p52 + 1023))), 52))
+#define V_EXPONENT(a) vsubq_f64(vreinterpretq_f64_u64(vorrq_u64(vshrq_n_u64(vreinterpretq_u64_f64(a), 52), \
+                                                   vreinterpretq_u64_f64(vdupq_n_f64(0x1p52)))), \
+                                vdupq_n_f64(0x1p52 + 1023))
+#define V_MANTISSA(a) vreinterpretq_f64_u64(vorrq_u64(vandq_u64(vreinterpretq_u64_f64(a), vdupq_n_u64(0x000FFFFFFFFFFFFFull)), \
+                                                  vreinterpretq_u64_f64(vdupq_n_f64(1.0))))
+FAST_KERNELS(neon, )
+SOA_KERNELS(neon, )
+#undef V_TYPE
+#undef V_WIDTH
+#undef V_LOAD
+#undef V_STORE
+#undef V_ADD
+#undef V_SUB
+#undef V_MUL
+#undef V_DIV
+#undef V_SQRT
+#undef V_NEG
+#undef V_ZERO
+#undef V_SET1
+#undef V_MASK
+#undef V_LT
+#undef V_EQ
+#undef V_SELECT
+#undef V_ABS
+#undef V_COPYSIGN
+#undef V_EXP2I
+#undef V_EXPONENT
+#undef V_MANTISSA
+
+#endif
+
+#undef V_ROUND
+#undef SOA_KERNELS
+#undef FAST_KERNELS
+
+
+static const soa_kernels *soa_select(void) {
+#if defined(SOA_X86)
+    if (__builtin_cpu_supports("avx512f")) return &soa_avx512;
+    if (__builtin_cpu_supports("avx2")) return &soa_avx2;
+    if (__builtin_cpu_supports("sse2")) return &soa_sse2;
+#elif defined(SOA_NEON)
+    return &soa_neon;
+#endif
+    return &soa_c;
+}
+
+
+static void fast_fixup(int k, double *ore, double *oim, const tx_planes *a, int count) {
+    /* Redoes the lanes an approximation does not cover with the library. */
+    const int mode = fast_kernels[k].mode;
+    int j;
+    for (j = 0; j < count; ++j) {
+        const d_cx x = cx_make(a[0].re[j], fast_kernels[k].real ? 0 : a[0].im[j]);
+        if (fast_in_range(mode, creal(x), cimag(x)) && ore[j] == ore[j]) continue;
+        const d_cx v = mode == FAST_POW ? cpow(x, cx_make(a[1].re[j], a[1].im[j]))
+                                        : ((d_cx(*)(d_cx))fast_kernels[k].exact)(x);
+        ore[j] = creal(v);
+        oim[j] = cimag(v);
+    }
+}
+
+
+static void fast_soa(int k, int low, const soa_kernels *kernels, double *ore, double *oim, const tx_planes *a,
+                     int count) {
+    const int mode = fast_kernels[k].mode;
+    if (fast_kernels[k].real) {
+        kernels->fast_real(ore, a[0].re, 0, count, mode, low);
+        memset(oim, 0, sizeof(double) * count);
+    } else if (mode == FAST_POW) {
+        kernels->fast_pow(ore, oim, a[0].re, a[0].im, a[1].re, a[1].im, 0, count, low);
+    } else {
+        kernels->fast_complex(ore, oim, a[0].re, a[0].im, 0, count, mode, low);
+    }
+    fast_fixup(k, ore, oim, a, count);
+}
+
+
+static int fast_batch(const void *f, d_cx *out, const d_cx *const *a, int count) {
+    /* Runs an approximation over interleaved points through planes on the stack. */
+    /* Returns 0 for anything else. */
+    const int k = fast_find(f);
+    if (k < 0 || f == fast_kernels[k].exact) return 0;
+
+    const int arity = fast_kernels[k].mode == FAST_POW ? 2 : 1;
+    double in[2][2][BATCH_CHUNK], ore[BATCH_CHUNK], oim[BATCH_CHUNK];
+    tx_planes planes[2];
+    int i, j;
+    for (i = 0; i < arity; ++i) {
+        for (j = 0; j < count; ++j) {in[i][0][j] = RE(a[i], j); in[i][1][j] = IM(a[i], j);}
+        planes[i].re = in[i][0];
+        planes[i].im = in[i][1];
+    }
+    fast_soa(k, f == fast_kernels[k].low, soa_select(), ore, oim, planes, count);
+    for (j = 0; j < count; ++j) {RE(out, j) = ore[j]; IM(out, j) = oim[j];}
+    return 1;
+}
+
+
+typedef struct soa_batch {
+    const tx_variable *streams;
+    int stream_count;
+    size_t offset;
+    int count;
+    const soa_kernels *k;
+} soa_batch;
+
+
+static tx_planes soa_eval(const tx_expr *n, const soa_batch *b, double *out, double *scratch) {
+    /* Evaluates b->count points of the subtree into the planes of out, or */
+    /* returns the planes of an input stream directly. */
+    const int arity = ARITY(n->type);
+    const int count = b->count;
+    double *const ore = out;
+    double *const oim = out + BATCH_CHUNK;
+    tx_planes a[7];
+    tx_planes r;
+    d_cx args[7];
+    int i, j;
+
+    r.re = ore;
+    r.im = oim;
+
+    switch (TYPE_MASK(n->type)) {
+    case TX_CONSTANT:
+        for (j = 0; j < count; ++j) {ore[j] = creal(n->value); oim[j] = cimag(n->value);}
+        return r;
+
+    case TX_VARIABLE:
+        for (i = 0; i < b->stream_count; ++i) {
+            if (b->streams[i].address == n->bound) {
+                const tx_planes *p = b->streams[i].context;
+                r.re = p->re + b->offset;
+                r.im = p->im + b->offset;
+                return r;
+            }
+        }
+        for (j = 0; j < count; ++j) {ore[j] = creal(*n->bound); oim[j] = cimag(*n->bound);}
+        return r;
+
+    case TX_FUNCTION0: case TX_FUNCTION1: case TX_FUNCTION2: case TX_FUNCTION3:
+    case TX_FUNCTION4: case TX_FUNCTION5: case TX_FUNCTION6:
+    case TX_CLOSURE0: case TX_CLOSURE1: case TX_CLOSURE2: case TX_CLOSURE3:
+    case TX_CLOSURE4: case TX_CLOSURE5: case TX_CLOSURE6:
+        for (i = 0; i < arity; ++i) {
+            a[i] = soa_eval(n->parameters[i], b, scratch + 2 * i * BATCH_CHUNK, scratch + 2 * arity * BATCH_CHUNK);
+        }
+        break;
+
+    default:
+        for (j = 0; j < count; ++j) {ore[j] = NAN; oim[j] = NAN;}
+        return r;
+    }
+
+    if (IS_FUNCTION(n->type)) {
+        switch (infix_op(n)) {
+        case OP_ADD: b->k->add(ore, oim, a[0].re, a[0].im, a[1].re, a[1].im, 0, count); return r;
+        case OP_SUB: b->k->sub(ore, oim, a[0].re, a[0].im, a[1].re, a[1].im, 0, count); return r;
+        case OP_MUL:
+            b->k->mul(ore, oim, a[0].re, a[0].im, a[1].re, a[1].im, 0, count);
+            soa_mul_fixup(ore, oim, a[0].re, a[0].im, a[1].re, a[1].im, count);
+            return r;
+        case OP_DIV:
+            b->k->div(ore, oim, a[0].re, a[0].im, a[1].re, a[1].im, 0, count);
+            soa_div_fixup(ore, oim, a[0].re, a[0].im, a[1].re, a[1].im, count);
+            return r;
+        case OP_NEG: b->k->neg(ore, oim, a[0].re, a[0].im, 0, count); return r;
+        case OP_COMMA:
+            memcpy(ore, a[1].re, sizeof(double) * count);
+            memcpy(oim, a[1].im, sizeof(double) * count);
+            return r;
+        case OP_RADD: for (j = 0; j < count; ++j) {ore[j] = a[0].re[j] + a[1].re[j]; oim[j] = 0;} return r;
+        case OP_RSUB: for (j = 0; j < count; ++j) {ore[j] = a[0].re[j] - a[1].re[j]; oim[j] = 0;} return r;
+        case OP_RMUL: for (j = 0; j < count; ++j) {ore[j] = a[0].re[j] * a[1].re[j]; oim[j] = 0;} return r;
+        case OP_RDIV: for (j = 0; j < count; ++j) {ore[j] = a[0].re[j] / a[1].re[j]; oim[j] = 0;} return r;
+        case OP_RNEG: for (j = 0; j < count; ++j) {ore[j] = -a[0].re[j]; oim[j] = 0;} return r;
+        }
+
+        const int k = IS_ARRAY(n->type) ? -1 : fast_find(n->function);
+        if (k >= 0 && n->function != fast_kernels[k].exact) {
+            fast_soa(k, n->function == fast_kernels[k].low, b->k, ore, oim, a, count);
+            return r;
+        }
+        if (n->function == cfma) {soa_fma(ore, oim, a, count); return r;}
+        if (n->function == rfma) {
+            for (j = 0; j < count; ++j) {ore[j] = FMA(a[0].re[j], a[1].re[j], a[2].re[j]); oim[j] = 0;}
+            return r;
+        }
+        if (n->function == conj) {b->k->conj(ore, oim, a[0].re, a[0].im, 0, count); return r;}
+        if (n->function == _creal) {b->k->real(ore, oim, a[0].re, a[0].im, 0, count); return r;}
+        if (n->function == _cimag) {b->k->imag(ore, oim, a[0].re, a[0].im, 0, count); return r;}
+        if (n->function == _cabs) {
+            b->k->abs(ore, oim, a[0].re, a[0].im, 0, count);
+            soa_abs_fixup(ore, a[0].re, a[0].im, count);
+            return r;
+        }
+    }
+
+    for (j = 0; j < count; ++j) {
+        for (i = 0; i < arity; ++i) args[i] = cx_make(a[i].re[j], a[i].im[j]);
+        const d_cx v = is_loop(n) ? loop_batch(n->parameters[arity], args[0], args[1], b->streams, b->stream_count,
+                                               b->offset + j, LOOP_STREAM_PLANES) : call_node(n, args);
+        ore[j] = creal(v);
+        oim[j] = cimag(v);
+    }
+    return r;
+}
+
+
+void tx_eval_batch_soa(const tx_expr *n, const tx_variable *streams, int stream_count, size_t len,
+                       double *out_re, double *out_im) {
+    size_t done;
+    double *scratch = 0;
+
+    if (n) scratch = malloc(sizeof(double) * 2 * BATCH_CHUNK * (batch_slots(n) + 1));
+    if (!scratch) {
+        for (done = 0; done < len; ++done) out_re[done] = out_im[done] = NAN;
+        return;
+    }
+
+    soa_batch b;
+    b.streams = streams;
+    b.stream_count = stream_count;
+    b.k = soa_select();
+
+    for (done = 0; done < len; done += b.count) {
+        b.offset = done;
+        b.count = (len - done < BATCH_CHUNK) ? (int)(len - done) : BATCH_CHUNK;
+
+        const tx_planes r = soa_eval(n, &b, scratch, scratch + 2 * BATCH_CHUNK);
+        memmove(out_re + done, r.re, sizeof(double) * b.count);
+        memmove(out_im + done, r.im, sizeof(double) * b.count);
+    }
+
+    free(scratch);
+}
+
+
+/* Single precision. Programs lowered with tx_compile_program_f hold their
+ * constants as floats and call the float versions of the built-ins; user
+ * functions still take doubles and are called with their arguments widened.
+ * The batch form runs the program over chunks of points, one loop per
+ * instruction. */
+static f_cx fi(void) {return I;}
+static f_cx fpi(void) {return 3.14159265358979323846f;}
+static f_cx fe(void) {return 2.71828182845904523536f;}
+static f_cx finfinity(void) {return INFINITY;}
+
+static f_cx f_cabs(f_cx a) {return cabsf(a);}
+static f_cx f_carg(f_cx a) {return cargf(a);}
+static f_cx f_cimag(f_cx a) {return cimagf(a);}
+static f_cx f_creal(f_cx a) {return crealf(a);}
+static f_cx squaref(f_cx a) {return a*a;}
+
+static f_cx ipowf(f_cx a, f_cx b) {
+    int e = (int)crealf(b);
+    const int negative = e < 0;
+    f_cx r = 1;
+    if (negative) e = -e;
+    while (e) {
+        if (e & 1) r *= a;
+        e >>= 1;
+        if (e) a *= a;
+    }
+    return negative ? 1 / r : r;
+}
+
+static f_cx rsquaref(f_cx a) {return crealf(a) * crealf(a);}
+static f_cx rabsf(f_cx a) {return fabsf(crealf(a));}
+static f_cx rsinf(f_cx a) {return sinf(crealf(a));}
+static f_cx rcosf(f_cx a) {return cosf(crealf(a));}
+static f_cx rtanf(f_cx a) {return tanf(crealf(a));}
+static f_cx rsinhf(f_cx a) {return sinhf(crealf(a));}
+static f_cx rcoshf(f_cx a) {return coshf(crealf(a));}
+static f_cx rtanhf(f_cx a) {return tanhf(crealf(a));}
+static f_cx rexpf(f_cx a) {return expf(crealf(a));}
+static f_cx ratanf(f_cx a) {return atanf(crealf(a));}
+static f_cx rasinhf(f_cx a) {return asinhf(crealf(a));}
+
+#if defined(FP_FAST_FMAF)
+#define FMAF(a, b, c) fmaf((a), (b), (c))
+#else
+#define FMAF(a, b, c) ((a) * (b) + (c))
+#endif
+
+static f_cx cfmaf(f_cx a, f_cx b, f_cx c) {
+    const float re = FMAF(crealf(a), crealf(b), FMAF(-cimagf(a), cimagf(b), crealf(c)));
+    const float im = FMAF(crealf(a), cimagf(b), FMAF(cimagf(a), crealf(b), cimagf(c)));
+    f_cx r;
+    if (re != re && im != im) return a * b + c;
+    ((float*)&r)[0] = re;
+    ((float*)&r)[1] = im;
+    return r;
+}
+
+static f_cx rfmaf(f_cx a, f_cx b, f_cx c) {return FMAF(crealf(a), crealf(b), crealf(c));}
+
+static f_cx ripowf(f_cx a, f_cx b) {
+    int e = (int)crealf(b);
+    const int negative = e < 0;
+    float x = crealf(a), r = 1;
+    if (negative) e = -e;
+    while (e) {
+        if (e & 1) r *= x;
+        e >>= 1;
+        if (e) x *= x;
+    }
+    return negative ? 1 / r : r;
+}
+
+
+static const void *const float_builtins[][2] = {
+    /* Double built-in, then its float version. */
+    {i, fi}, {pi, fpi}, {e, fe}, {infinity, finfinity},
+    {_cabs, f_cabs}, {_carg, f_carg}, {_cimag, f_cimag}, {_creal, f_creal}, {conj, conjf},
+    {cacos, cacosf}, {cacosh, cacoshf}, {casin, casinf}, {casinh, casinhf}, {catan, catanf}, {catanh, catanhf},
+    {ccos, ccosf}, {ccosh, ccoshf}, {csin, csinf}, {csinh, csinhf}, {ctan, ctanf}, {ctanh, ctanhf},
+    {cexp, cexpf}, {clog, clogf}, {cpow, cpowf}, {csqrt, csqrtf}, {square, squaref}, {ipow, ipowf},
+    {rsquare, rsquaref}, {rabs, rabsf}, {rsin, rsinf}, {rcos, rcosf}, {rtan, rtanf}, {rsinh, rsinhf},
+    {rcosh, rcoshf}, {rtanh, rtanhf}, {rexp, rexpf}, {ratan, ratanf}, {rasinh, rasinhf}, {ripow, ripowf},
+    {cfma, cfmaf}, {rfma, rfmaf},
+    {0, 0}
+};
+
+static const void *float_builtin(const void *f) {
+    int k;
+    for (k = 0; float_builtins[k][0]; ++k) {
+        if (float_builtins[k][0] == f) return float_builtins[k][1];
+    }
+    return 0;
+}
+
+
+/* Calls to float built-ins; OP_FUNCTION is left to user functions. */
+enum {OP_FLOAT = OP_ARRAY + 1};
+
+typedef struct float_instr {
+    int op;
+    int arity;
+    union {f_cx value; const d_cx *bound; const void *function; int slot;};
+    void *context;
+} float_instr;
+
+struct tx_program_f {
+    int length;
+    int depth;
+    int slots;
+    float_instr code[1];
+};
+
+
+tx_program_f *tx_compile_program_f(const tx_expr *n) {
+    tx_program *p = tx_compile_program(n);
+    CHECK_NULL(p);
+
+    size_t loops = 0;
+    int k;
+    for (k = 0; k < p->length; ++k) {
+        if (p->code[k].op == OP_CLOSURE && is_loop_call(p->code[k].function, p->code[k].arity)) {
+            loops += loop_packed_size(p->code[k].context);
+        }
+    }
+
+    tx_program_f *f = malloc(sizeof(tx_program_f) + sizeof(float_instr) * (p->length - 1) + loops);
+    CHECK_NULL(f, tx_program_free(p));
+    char *cursor = (char*)(f->code + p->length);
+
+    f->length = p->length;
+    f->depth = p->depth;
+    f->slots = p->slots;
+
+    for (k = 0; k < p->length; ++k) {
+        const tx_instr *ins = p->code + k;
+        float_instr *out = f->code + k;
+        memset(out, 0, sizeof(float_instr));
+        out->op = ins->op;
+        out->arity = ins->arity;
+        out->context = ins->context;
+
+        switch (ins->op) {
+        case OP_CONST: out->value = (f_cx)ins->value; break;
+        case OP_VAR: out->bound = ins->bound; break;
+        case OP_STORE: case OP_LOAD: out->slot = ins->slot; break;
+        case OP_FUNCTION:
+            out->function = float_builtin(exact_kernel(ins->function));
+            if (out->function) out->op = OP_FLOAT;
+            else out->function = ins->function;
+            break;
+        case OP_CLOSURE: case OP_ARRAY: out->function = ins->function; break;
+        }
+        if (ins->op == OP_CLOSURE && is_loop_call(ins->function, ins->arity)) {
+            out->context = loop_pack(ins->context, &cursor);
+        }
+    }
+
+    tx_program_free(p);
+    return f;
+}
+
+
+void tx_program_free_f(tx_program_f *p) {
+    free(p);
+}
+
+
+#define TX_FUN(...) ((f_cx(*)(__VA_ARGS__))ins->function)
+#define TX_WIDE(...) (f_cx)((d_cx(*)(__VA_ARGS__))ins->function)
+#define A(e) sp[e]
+#define W(e) (d_cx)sp[e]
+
+
+static f_cx float_run(const tx_program_f *p, f_cx *stack) {
+    const float_instr *ins = p->code;
+    const float_instr *const end = ins + p->length;
+    f_cx *const slots = stack + p->depth;
+    f_cx *sp = stack;
+    int k;
+
+    for (; ins != end; ++ins) {
+        switch (ins->op) {
+        case OP_CONST: *sp++ = ins->value; break;
+        case OP_VAR: *sp++ = (f_cx)*ins->bound; break;
+
+        case OP_ADD: --sp; sp[-1] = sp[-1] + sp[0]; break;
+        case OP_SUB: --sp; sp[-1] = sp[-1] - sp[0]; break;
+        case OP_MUL: --sp; sp[-1] = sp[-1] * sp[0]; break;
+        case OP_DIV: --sp; sp[-1] = sp[-1] / sp[0]; break;
+        case OP_POW: --sp; sp[-1] = cpowf(sp[-1], sp[0]); break;
+        case OP_NEG: sp[-1] = -sp[-1]; break;
+        case OP_COMMA: --sp; sp[-1] = sp[0]; break;
+
+        case OP_RADD: --sp; sp[-1] = crealf(sp[-1]) + crealf(sp[0]); break;
+        case OP_RSUB: --sp; sp[-1] = crealf(sp[-1]) - crealf(sp[0]); break;
+        case OP_RMUL: --sp; sp[-1] = crealf(sp[-1]) * crealf(sp[0]); break;
+        case OP_RDIV: --sp; sp[-1] = crealf(sp[-1]) / crealf(sp[0]); break;
+        case OP_RNEG: sp[-1] = -crealf(sp[-1]); break;
+
+        case OP_STORE: slots[ins->slot] = sp[-1]; break;
+        case OP_LOAD: *sp++ = slots[ins->slot]; break;
+
+        case OP_FLOAT:
+            sp -= ins->arity;
+            switch (ins->arity) {
+            case 0: *sp = TX_FUN(void)(); break;
+            case 1: *sp = TX_FUN(f_cx)(A(0)); break;
+            case 2: *sp = TX_FUN(f_cx, f_cx)(A(0), A(1)); break;
+            case 3: *sp = TX_FUN(f_cx, f_cx, f_cx)(A(0), A(1), A(2)); break;
+            default: *sp = NAN; break;
+            }
+            ++sp;
+            break;
+
+        case OP_ARRAY: {
+            d_cx wide[6];
+            sp -= ins->arity;
+            for (k = 0; k < ins->arity; ++k) wide[k] = sp[k];
+            *sp++ = (f_cx)call_array(ins->function, ins->context, ins->arity, wide);
+            break;
+        }
+
+        case OP_FUNCTION:
+            sp -= ins->arity;
+            switch (ins->arity) {
+            case 0: *sp = TX_WIDE(void)(); break;
+            case 1: *sp = TX_WIDE(d_cx)(W(0)); break;
+            case 2: *sp = TX_WIDE(d_cx, d_cx)(W(0), W(1)); break;
+            case 3: *sp = TX_WIDE(d_cx, d_cx, d_cx)(W(0), W(1), W(2)); break;
+            case 4: *sp = TX_WIDE(d_cx, d_cx, d_cx, d_cx)(W(0), W(1), W(2), W(3)); break;
+            case 5: *sp = TX_WIDE(d_cx, d_cx, d_cx, d_cx, d_cx)(W(0), W(1), W(2), W(3), W(4)); break;
+            case 6: *sp = TX_WIDE(d_cx, d_cx, d_cx, d_cx, d_cx, d_cx)(W(0), W(1), W(2), W(3), W(4), W(5)); break;
+            default: *sp = NAN; break;
+            }
+            ++sp;
+            break;
+
+        case OP_CLOSURE:
+            sp -= ins->arity;
+            switch (ins->arity) {
+            case 0: *sp = TX_WIDE(void*)(ins->context); break;
+            case 1: *sp = TX_WIDE(void*, d_cx)(ins->context, W(0)); break;
+            case 2: *sp = TX_WIDE(void*, d_cx, d_cx)(ins->context, W(0), W(1)); break;
+            case 3: *sp = TX_WIDE(void*, d_cx, d_cx, d_cx)(ins->context, W(0), W(1), W(2)); break;
+            case 4: *sp = TX_WIDE(void*, d_cx, d_cx, d_cx, d_cx)(ins->context, W(0), W(1), W(2), W(3)); break;
+            case 5: *sp = TX_WIDE(void*, d_cx, d_cx, d_cx, d_cx, d_cx)(ins->context, W(0), W(1), W(2), W(3), W(4)); break;
+            case 6: *sp = TX_WIDE(void*, d_cx, d_cx, d_cx, d_cx, d_cx, d_cx)(ins->context, W(0), W(1), W(2), W(3), W(4), W(5)); break;
+            default: *sp = NAN; break;
+            }
+            ++sp;
+            break;
+        }
+    }
+
+    return stack[0];
+}
+
+
+f_cx tx_program_eval_f(const tx_program_f *p) {
+    if (!p) return NAN;
+
+    if (p->depth + p->slots <= PROGRAM_STACK) {
+        f_cx stack[PROGRAM_STACK];
+        return float_run(p, stack);
+    }
+
+    f_cx *stack = malloc(sizeof(f_cx) * (p->depth + p->slots));
+    if (!stack) return NAN;
+
+    const f_cx ret = float_run(p, stack);
+    free(stack);
+    return ret;
+}
+
+#undef A
+#undef W
+
+
+#define FRE(p, j) (((float*)(p))[2*(j)])
+#define FIM(p, j) (((float*)(p))[2*(j)+1])
+#define A(e) sp[e][j]
+#define W(e) (d_cx)sp[e][j]
+
+
+static void float_mul(f_cx *out, const f_cx *a, const f_cx *b, int count) {
+    int j;
+    /* As in batch_mul, lanes left NaN+NaNI by the textbook formula are redone. */
+    for (j = 0; j < count; ++j) {
+        const float re = FRE(a, j) * FRE(b, j) - FIM(a, j) * FIM(b, j);
+        const float im = FRE(a, j) * FIM(b, j) + FIM(a, j) * FRE(b, j);
+        FRE(out, j) = re;
+        FIM(out, j) = im;
+    }
+    for (j = 0; j < count; ++j) {
+        if (FRE(out, j) != FRE(out, j) && FIM(out, j) != FIM(out, j)) out[j] = a[j] * b[j];
+    }
+}
+
+
+static void float_chunk(const tx_program_f *p, const tx_variable *streams, int stream_count, size_t offset,
+                        int count, f_cx **stack, d_cx *wide, f_cx *out) {
+    /* Runs the program over count points; stack holds depth + slots chunk buffers, and */
+    /* wide seven double chunks for array-form calls. */
+    const float_instr *ins = p->code;
+    const float_instr *const end = ins + p->length;
+    f_cx **const slots = stack + p->depth;
+    f_cx **sp = stack;
+    int j, k;
+
+    for (; ins != end; ++ins) {
+        f_cx *const r = sp[0];
+        switch (ins->op) {
+        case OP_CONST: for (j = 0; j < count; ++j) r[j] = ins->value; ++sp; break;
+        case OP_VAR:
+            for (k = 0; k < stream_count && streams[k].address != ins->bound; ++k) {}
+            if (k < stream_count) {
+                memcpy(r, (const f_cx*)streams[k].context + offset, sizeof(f_cx) * count);
+            } else {
+                const f_cx v = (f_cx)*ins->bound;
+                for (j = 0; j < count; ++j) r[j] = v;
+            }
+            ++sp;
+            break;
+
+        case OP_ADD: --sp; for (j = 0; j < count; ++j) sp[-1][j] += sp[0][j]; break;
+        case OP_SUB: --sp; for (j = 0; j < count; ++j) sp[-1][j] -= sp[0][j]; break;
+        case OP_MUL: --sp; float_mul(sp[-1], sp[-1], sp[0], count); break;
+        case OP_DIV: --sp; for (j = 0; j < count; ++j) sp[-1][j] /= sp[0][j]; break;
+        case OP_POW: --sp; for (j = 0; j < count; ++j) sp[-1][j] = cpowf(sp[-1][j], sp[0][j]); break;
+        case OP_NEG: for (j = 0; j < count; ++j) sp[-1][j] = -sp[-1][j]; break;
+        case OP_COMMA: --sp; memcpy(sp[-1], sp[0], sizeof(f_cx) * count); break;
+
+        case OP_RADD: --sp; for (j = 0; j < count; ++j) {FRE(sp[-1], j) += FRE(sp[0], j); FIM(sp[-1], j) = 0;} break;
+        case OP_RSUB: --sp; for (j = 0; j < count; ++j) {FRE(sp[-1], j) -= FRE(sp[0], j); FIM(sp[-1], j) = 0;} break;
+        case OP_RMUL: --sp; for (j = 0; j < count; ++j) {FRE(sp[-1], j) *= FRE(sp[0], j); FIM(sp[-1], j) = 0;} break;
+        case OP_RDIV: --sp; for (j = 0; j < count; ++j) {FRE(sp[-1], j) /= FRE(sp[0], j); FIM(sp[-1], j) = 0;} break;
+        case OP_RNEG: for (j = 0; j < count; ++j) {FRE(sp[-1], j) = -FRE(sp[-1], j); FIM(sp[-1], j) = 0;} break;
+
+        case OP_STORE: memcpy(slots[ins->slot], sp[-1], sizeof(f_cx) * count); break;
+        case OP_LOAD: memcpy(r, slots[ins->slot], sizeof(f_cx) * count); ++sp; break;
+
+        case OP_FLOAT:
+            sp -= ins->arity;
+            switch (ins->arity) {
+            case 0: {const f_cx v = TX_FUN(void)(); for (j = 0; j < count; ++j) sp[0][j] = v;} break;
+            case 1: for (j = 0; j < count; ++j) sp[0][j] = TX_FUN(f_cx)(A(0)); break;
+            case 2: for (j = 0; j < count; ++j) sp[0][j] = TX_FUN(f_cx, f_cx)(A(0), A(1)); break;
+            case 3: for (j = 0; j < count; ++j) sp[0][j] = TX_FUN(f_cx, f_cx, f_cx)(A(0), A(1), A(2)); break;
+            }
+            ++sp;
+            break;
+
+        case OP_ARRAY: {
+            const d_cx *args[6];
+            sp -= ins->arity;
+            for (k = 0; k < ins->arity; ++k) {
+                for (j = 0; j < count; ++j) wide[k * BATCH_CHUNK + j] = sp[k][j];
+                args[k] = wide + k * BATCH_CHUNK;
+            }
+            ((tx_array_fn)ins->function)(ins->context, args, wide + 6 * BATCH_CHUNK, count);
+            for (j = 0; j < count; ++j) sp[0][j] = (f_cx)wide[6 * BATCH_CHUNK + j];
+            ++sp;
+            break;
+        }
+
+        case OP_FUNCTION:
+            sp -= ins->arity;
+            switch (ins->arity) {
+            case 0: for (j = 0; j < count; ++j) sp[0][j] = TX_WIDE(void)(); break;
+            case 1: for (j = 0; j < count; ++j) sp[0][j] = TX_WIDE(d_cx)(W(0)); break;
+            case 2: for (j = 0; j < count; ++j) sp[0][j] = TX_WIDE(d_cx, d_cx)(W(0), W(1)); break;
+            case 3: for (j = 0; j < count; ++j) sp[0][j] = TX_WIDE(d_cx, d_cx, d_cx)(W(0), W(1), W(2)); break;
+            case 4: for (j = 0; j < count; ++j) sp[0][j] = TX_WIDE(d_cx, d_cx, d_cx, d_cx)(W(0), W(1), W(2), W(3)); break;
+            case 5: for (j = 0; j < count; ++j) sp[0][j] = TX_WIDE(d_cx, d_cx, d_cx, d_cx, d_cx)(W(0), W(1), W(2), W(3), W(4)); break;
+            case 6: for (j = 0; j < count; ++j) sp[0][j] = TX_WIDE(d_cx, d_cx, d_cx, d_cx, d_cx, d_cx)(W(0), W(1), W(2), W(3), W(4), W(5)); break;
+            }
+            ++sp;
+            break;
+
+        case OP_CLOSURE:
+            sp -= ins->arity;
+            if (is_loop_call(ins->function, ins->arity)) {
+                for (j = 0; j < count; ++j) {
+                    sp[0][j] = (f_cx)loop_batch(ins->context, W(0), W(1), streams, stream_count, offset + j,
+                                                LOOP_STREAM_FLOAT);
+                }
+                ++sp;
+                break;
+            }
+            switch (ins->arity) {
+            case 0: for (j = 0; j < count; ++j) sp[0][j] = TX_WIDE(void*)(ins->context); break;
+            case 1: for (j = 0; j < count; ++j) sp[0][j] = TX_WIDE(void*, d_cx)(ins->context, W(0)); break;
+            case 2: for (j = 0; j < count; ++j) sp[0][j] = TX_WIDE(void*, d_cx, d_cx)(ins->context, W(0), W(1)); break;
+            case 3: for (j = 0; j < count; ++j) sp[0][j] = TX_WIDE(void*, d_cx, d_cx, d_cx)(ins->context, W(0), W(1), W(2)); break;
+            case 4: for (j = 0; j < count; ++j) sp[0][j] = TX_WIDE(void*, d_cx, d_cx, d_cx, d_cx)(ins->context, W(0), W(1), W(2), W(3)); break;
+            case 5: for (j = 0; j < count; ++j) sp[0][j] = TX_WIDE(void*, d_cx, d_cx, d_cx, d_cx, d_cx)(ins->context, W(0), W(1), W(2), W(3), W(4)); break;
+            case 6: for (j = 0; j < count; ++j) sp[0][j] = TX_WIDE(void*, d_cx, d_cx, d_cx, d_cx, d_cx, d_cx)(ins->context, W(0), W(1), W(2), W(3), W(4), W(5)); break;
+            }
+            ++sp;
+            break;
+        }
+    }
+
+    memcpy(out, stack[0], sizeof(f_cx) * count);
+}
+
+#undef TX_FUN
+#undef TX_WIDE
+#undef A
+#undef W
+#undef FRE
+#undef FIM
+
+
+void tx_program_eval_batch_f(const tx_program_f *p, const tx_variable *streams, int stream_count, size_t len,
+                             f_cx *out) {
+    size_t done;
+    int k;
+    const int buffers = p ? p->depth + p->slots : 0;
+    f_cx **stack = p ? malloc(sizeof(f_cx*) * buffers + sizeof(f_cx) * BATCH_CHUNK * buffers) : 0;
+    int arrays = 0;
+    for (k = 0; p && k < p->length; ++k) arrays |= p->code[k].op == OP_ARRAY;
+    d_cx *wide = arrays ? malloc(sizeof(d_cx) * 7 * BATCH_CHUNK) : 0;
+    if (!stack || (arrays && !wide)) {
+        free(stack);
+        free(wide);
+        for (done = 0; done < len; ++done) out[done] = NAN;
+        return;
+    }
+
+    for (k = 0; k < buffers; ++k) stack[k] = (f_cx*)(stack + buffers) + k * BATCH_CHUNK;
+
+    for (done = 0; done < len; done += BATCH_CHUNK) {
+        const int count = (len - done < BATCH_CHUNK) ? (int)(len - done) : BATCH_CHUNK;
+        float_chunk(p, streams, stream_count, done, count, stack, wide, out + done);
+    }
+    free(stack);
+    free(wide);
+}
+
+
+void tx_eval_batch_f(const tx_expr *n, const tx_variable *streams, int stream_count, size_t len, f_cx *out) {
+    tx_program_f *p = tx_compile_program_f(n);
+    tx_program_eval_batch_f(p, streams, stream_count, len, out);
+    tx_program_free_f(p);
+}
+
+
+/* Parallel batch evaluation. The input range is cut into chunks that are
+ * dealt out to per-worker ranges; a worker that runs dry steals the back
+ * half of another worker's range. Evaluation never writes to the tree, so
+ * all workers share it, each with its own scratch. */
+#define PARALLEL_GRAIN (16 * BATCH_CHUNK)
+
+#if defined(__GNUC__)
+#define ATOMIC_LOAD(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define ATOMIC_STORE(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define ATOMIC_CAS(p, expected, desired) \
+    __atomic_compare_exchange_n((p), (expected), (desired), 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)
+#define HAVE_ATOMICS
+#endif
+
+#define RANGE(lo, hi) ((uint64_t)(lo) | ((uint64_t)(hi) << 32))
+#define RANGE_LO(r) ((uint32_t)(r))
+#define RANGE_HI(r) ((uint32_t)((r) >> 32))
+
+
+typedef struct deque {
+    uint64_t range;
+    char pad[64 - sizeof(uint64_t)];
+} deque;
+
+
+typedef struct parallel_job {
+    const compact_tree *tree;
+    const tx_variable *streams;
+    int stream_count;
+    size_t len;
+    size_t grain;
+    d_cx *out;
+    int workers;
+    deque *deques;
+} parallel_job;
+
+
+static int deque_pop(deque *d, uint32_t *chunk) {
+#if defined(HAVE_ATOMICS)
+    uint64_t old = ATOMIC_LOAD(&d->range);
+    while (RANGE_LO(old) < RANGE_HI(old)) {
+        if (ATOMIC_CAS(&d->range, &old, RANGE(RANGE_LO(old) + 1, RANGE_HI(old)))) {
+            *chunk = RANGE_LO(old);
+            return 1;
+        }
+    }
+    return 0;
+#else
+    if (RANGE_LO(d->range) >= RANGE_HI(d->range)) return 0;
+    *chunk = RANGE_LO(d->range);
+    d->range = RANGE(*chunk + 1, RANGE_HI(d->range));
+    return 1;
+#endif
+}
+
+
+static int deque_steal(deque *victim, deque *own, uint32_t *chunk) {
+#if defined(HAVE_ATOMICS)
+    uint64_t old = ATOMIC_LOAD(&victim->range);
+    while (RANGE_LO(old) < RANGE_HI(old)) {
+        const uint32_t mid = RANGE_HI(old) - (RANGE_HI(old) - RANGE_LO(old) + 1) / 2;
+        if (ATOMIC_CAS(&victim->range, &old, RANGE(RANGE_LO(old), mid))) {
+            *chunk = mid;
+            ATOMIC_STORE(&own->range, RANGE(mid + 1, RANGE_HI(old)));
+            return 1;
+        }
+    }
+#else
+    /* Without atomics every worker keeps to its own share. */
+    (void)victim; (void)own; (void)chunk;
+#endif
+    return 0;
+}
+
+
+static void parallel_worker(void *arg, int worker) {
+    parallel_job *job = arg;
+    d_cx *scratch = batch_scratch(job->tree);
+    uint32_t chunk;
+    int i;
+
+    for (;;) {
+        if (!deque_pop(job->deques + worker, &chunk)) {
+            for (i = 1; i < job->workers; ++i) {
+                if (deque_steal(job->deques + (worker + i) % job->workers, job->deques + worker, &chunk)) break;
+            }
+            if (i >= job->workers) break;
+        }
+
+        const size_t begin = (size_t)chunk * job->grain;
+        const size_t end = (job->len - begin < job->grain) ? job->len : begin + job->grain;
+        if (scratch) {
+            batch_range(job->tree, job->streams, job->stream_count, begin, end, job->out, scratch);
+        } else {
+            size_t j;
+            for (j = begin; j < end; ++j) job->out[j] = NAN;
+        }
+    }
+
+    free(scratch);
+}
+
+
+#if defined(TX_USE_PTHREADS) || defined(TX_USE_C11_THREADS)
+
+typedef struct thread_start {
+    tx_task task;
+    void *arg;
+    int worker;
+} thread_start;
+
+#if defined(TX_USE_PTHREADS)
+typedef pthread_t thread_handle;
+static void *thread_main(void *p) {
+    thread_start *t = p;
+    t->task(t->arg, t->worker);
+    return 0;
+}
+#define THREAD_CREATE(h, t) (pthread_create((h), 0, thread_main, (t)) == 0)
+#define THREAD_JOIN(h) pthread_join((h), 0)
+#else
+typedef thrd_t thread_handle;
+static int thread_main(void *p) {
+    thread_start *t = p;
+    t->task(t->arg, t->worker);
+    return 0;
+}
+#define THREAD_CREATE(h, t) (thrd_create((h), thread_main, (t)) == thrd_success)
+#define THREAD_JOIN(h) thrd_join((h), 0)
+#endif
+
+static void builtin_run(void *pool, int threads, tx_task task, void *arg) {
+    thread_handle *handles = malloc(sizeof(thread_handle) * threads);
+    thread_start *starts = malloc(sizeof(thread_start) * threads);
+    char *started = calloc(threads, 1);
+    int w;
+    (void)pool;
+
+    /* Workers that fail to start simply leave their share to be stolen. */
+    if (handles && starts && started) {
+        for (w = 1; w < threads; ++w) {
+            starts[w].task = task;
+            starts[w].arg = arg;
+            starts[w].worker = w;
+            started[w] = THREAD_CREATE(handles + w, starts + w);
+        }
+    }
+
+    task(arg, 0);
+
+    if (handles && starts && started) {
+        for (w = 1; w < threads; ++w) {
+            if (started[w]) THREAD_JOIN(handles[w]);
+        }
+    }
+
+    free(handles);
+    free(starts);
+    free(started);
+}
+
+#undef THREAD_CREATE
+#undef THREAD_JOIN
+
+#endif
+
+
+static int cpu_count(void) {
+#if (defined(TX_USE_PTHREADS) || defined(TX_USE_C11_THREADS)) && defined(_SC_NPROCESSORS_ONLN)
+    const long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (int)n : 1;
+#else
+    return 1;
+#endif
+}
+
+
+void tx_eval_batch_parallel(const tx_expr *n, const tx_variable *streams, int stream_count, size_t len,
+                            d_cx *out, const tx_parallel *parallel) {
+    void (*run)(void *pool, int threads, tx_task task, void *arg) = parallel ? parallel->run : 0;
+    int workers = parallel ? parallel->threads : 0;
+    size_t grain = (parallel && parallel->grain) ? parallel->grain : PARALLEL_GRAIN;
+    int w;
+
+#if defined(TX_USE_PTHREADS) || defined(TX_USE_C11_THREADS)
+    if (!run) run = builtin_run;
+#endif
+    if (!run) workers = 1;
+    if (workers <= 0) workers = cpu_count();
+
+    /* Chunk indices are 32 bits wide. */
+    while (len / grain >= 0xFFFFFFFFu) grain *= 2;
+
+    const size_t chunks = (len + grain - 1) / grain;
+    if ((size_t)workers > chunks) workers = chunks ? (int)chunks : 1;
+
+    deque *deques = malloc(sizeof(deque) * workers);
+    if (workers == 1 || !deques) {
+        free(deques);
+        tx_eval_batch(n, streams, stream_count, len, out);
+        return;
+    }
+
+    for (w = 0; w < workers; ++w) {
+        deques[w].range = RANGE(chunks * w / workers, chunks * (w + 1) / workers);
+    }
+
+    /* The workers share one compact copy of the tree. */
+    compact_tree *tree = compact_create(n);
+
+    parallel_job job;
+    job.tree = tree;
+    job.streams = streams;
+    job.stream_count = stream_count;
+    job.len = len;
+    job.grain = grain;
+    job.out = out;
+    job.workers = workers;
+    job.deques = deques;
+
+    run(parallel ? parallel->pool : 0, workers, parallel_worker, &job);
+    free(deques);
+    free(tree);
+}
+
+#undef RANGE
+#undef RANGE_LO
+#undef RANGE_HI
+
+
+/* Compiled expression cache. Each entry is one block holding its header, the
+ * expression text and the packed tree; the word right before the tree points
+ * back to the header. Entries evicted while still held are freed on their
+ * last release. */
+#if defined(TX_USE_PTHREADS)
+typedef pthread_mutex_t cache_lock;
+#define LOCK_INIT(m) (pthread_mutex_init((m), 0) == 0)
+#define LOCK_DESTROY(m) pthread_mutex_destroy(m)
+#define LOCK(m) pthread_mutex_lock(m)
+#define UNLOCK(m) pthread_mutex_unlock(m)
+#elif defined(TX_USE_C11_THREADS)
+typedef mtx_t cache_lock;
+#define LOCK_INIT(m) (mtx_init((m), mtx_plain) == thrd_success)
+#define LOCK_DESTROY(m) mtx_destroy(m)
+#define LOCK(m) mtx_lock(m)
+#define UNLOCK(m) mtx_unlock(m)
+#elif defined(HAVE_ATOMICS)
+typedef char cache_lock;
+#define LOCK_INIT(m) (*(m) = 0, 1)
+#define LOCK_DESTROY(m) ((void)(m))
+#define LOCK(m) do {} while (__atomic_test_and_set((m), __ATOMIC_ACQUIRE))
+#define UNLOCK(m) __atomic_clear((m), __ATOMIC_RELEASE)
+#else
+typedef char cache_lock;
+#define LOCK_INIT(m) (*(m) = 0, 1)
+#define LOCK_DESTROY(m) ((void)(m))
+#define LOCK(m) ((void)(m))
+#define UNLOCK(m) ((void)(m))
+#endif
+
+
+typedef struct cache_entry {
+    struct cache_entry *next;
+    struct cache_entry *newer;
+    struct cache_entry *older;
+    const tx_symtab *symtab;
+    unsigned symtab_hash;
+    unsigned hash;
+    size_t length;
+    int refs;
+    int evicted;
+    tx_expr *expr;
+} cache_entry;
+
+#define ENTRY_TEXT(e) ((char*)(e) + sizeof(cache_entry))
+
+
+struct tx_cache {
+    cache_lock lock;
+    unsigned mask;
+    cache_entry **buckets;
+    cache_entry *newest;
+    cache_entry *oldest;
+    tx_cache_stats stats;
+};
+
+
+tx_cache *tx_cache_create(int capacity) {
+    tx_cache *c = malloc(sizeof(tx_cache));
+    CHECK_NULL(c);
+
+    if (capacity < 1) capacity = 1;
+    unsigned size = 1;
+    while (size < 2u * (unsigned)capacity) size *= 2;
+
+    c->mask = size - 1;
+    c->buckets = calloc(size, sizeof(cache_entry*));
+    c->newest = c->oldest = 0;
+    memset(&c->stats, 0, sizeof(c->stats));
+    c->stats.capacity = capacity;
+    if (!c->buckets || !LOCK_INIT(&c->lock)) {
+        free(c->buckets);
+        free(c);
+        return NULL;
+    }
+    return c;
+}
+
+
+void tx_cache_free(tx_cache *c) {
+    if (!c) return;
+    cache_entry *e = c->newest;
+    while (e) {
+        cache_entry *older = e->older;
+        free(e);
+        e = older;
+    }
+    LOCK_DESTROY(&c->lock);
+    free(c->buckets);
+    free(c);
+}
+
+
+static unsigned cache_hash(const char *expression, size_t length, const tx_symtab *symtab) {
+    const unsigned symtab_hash = symtab ? symtab->hash : 0;
+    unsigned h = hash_bytes(2166136261u, expression, length);
+    h = hash_bytes(h, &symtab, sizeof(symtab));
+    return hash_bytes(h, &symtab_hash, sizeof(symtab_hash));
+}
+
+
+static cache_entry *cache_find(const tx_cache *c, unsigned hash, const char *expression, size_t length,
+                               const tx_symtab *symtab) {
+    /* A table freed and reallocated at the same address only matches with the same bindings. */
+    const unsigned symtab_hash = symtab ? symtab->hash : 0;
+    cache_entry *e;
+    for (e = c->buckets[hash & c->mask]; e; e = e->next) {
+        if (e->hash == hash && e->symtab == symtab && e->symtab_hash == symtab_hash &&
+            e->length == length && memcmp(ENTRY_TEXT(e), expression, length) == 0) {
+            return e;
+        }
+    }
+    return 0;
+}
+
+
+static void cache_unlink(tx_cache *c, cache_entry *e) {
+    if (e->newer) e->newer->older = e->older; else c->newest = e->older;
+    if (e->older) e->older->newer = e->newer; else c->oldest = e->newer;
+}
+
+
+static void cache_touch(tx_cache *c, cache_entry *e) {
+    /* Moves e to the front of the recency list. */
+    if (c->newest == e) return;
+    if (e->newer || e->older || c->oldest == e) cache_unlink(c, e);
+    e->newer = 0;
+    e->older = c->newest;
+    if (c->newest) c->newest->newer = e;
+    c->newest = e;
+    if (!c->oldest) c->oldest = e;
+}
+
+
+static void cache_evict(tx_cache *c) {
+    while (c->stats.entries > c->stats.capacity) {
+        cache_entry *e = c->oldest;
+        cache_entry **link = c->buckets + (e->hash & c->mask);
+        while (*link != e) link = &(*link)->next;
+        *link = e->next;
+        cache_unlink(c, e);
+
+        --c->stats.entries;
+        ++c->stats.evictions;
+        if (e->refs) {
+            e->evicted = 1;
+        } else {
+            free(e);
+        }
+    }
+}
+
+
+const tx_expr *tx_cache_get(tx_cache *c, const char *expression, const tx_symtab *symtab, int *error) {
+    if (!c || !expression) {
+        if (error) *error = -1;
+        return NULL;
+    }
+
+    const size_t length = strlen(expression);
+    const unsigned hash = cache_hash(expression, length, symtab);
+    cache_entry *e;
+
+    LOCK(&c->lock);
+    e = cache_find(c, hash, expression, length, symtab);
+    if (e) {
+        ++e->refs;
+        ++c->stats.hits;
+        cache_touch(c, e);
+        UNLOCK(&c->lock);
+        if (error) *error = 0;
+        return e->expr;
+    }
+    ++c->stats.misses;
+    UNLOCK(&c->lock);
+
+    /* Compiles without holding the lock; a racing thread may get there first. */
+    const size_t header = (sizeof(cache_entry) + length + 1 + sizeof(cache_entry*) + EXPR_ALIGN - 1)
+                          / EXPR_ALIGN * EXPR_ALIGN;
+    tx_options options;
+    memset(&options, 0, sizeof(options));
+    options.symtab = symtab;
+    char *block = compile_packed(expression, 0, 0, &options, header, error);
+    CHECK_NULL(block);
+
+    cache_entry *entry = (cache_entry*)block;
+    memset(entry, 0, sizeof(cache_entry));
+    entry->symtab = symtab;
+    entry->symtab_hash = symtab ? symtab->hash : 0;
+    entry->hash = hash;
+    entry->length = length;
+    entry->refs = 1;
+    entry->expr = (tx_expr*)(block + header);
+    memcpy(ENTRY_TEXT(entry), expression, length + 1);
+    memcpy(block + header - sizeof(cache_entry*), &entry, sizeof(cache_entry*));
+
+    LOCK(&c->lock);
+    e = cache_find(c, hash, expression, length, symtab);
+    if (e) {
+        ++e->refs;
+        cache_touch(c, e);
+        UNLOCK(&c->lock);
+        free(block);
+        return e->expr;
+    }
+
+    cache_entry **bucket = c->buckets + (hash & c->mask);
+    entry->next = *bucket;
+    *bucket = entry;
+    cache_touch(c, entry);
+    ++c->stats.entries;
+    cache_evict(c);
+    UNLOCK(&c->lock);
+    return entry->expr;
+}
+
+
+void tx_cache_release(tx_cache *c, const tx_expr *n) {
+    if (!c || !n) return;
+
+    cache_entry *e;
+    memcpy(&e, (const char*)n - sizeof(cache_entry*), sizeof(cache_entry*));
+
+    LOCK(&c->lock);
+    const int dead = --e->refs == 0 && e->evicted;
+    UNLOCK(&c->lock);
+    if (dead) free(e);
+}
+
+
+d_cx tx_cache_interp(tx_cache *c, const char *expression, const tx_symtab *symtab, int *error) {
+    const tx_expr *n = tx_cache_get(c, expression, symtab, error);
+    if (!n) return NAN;
+
+    const d_cx ret = tx_eval(n);
+    tx_cache_release(c, n);
+    return ret;
+}
+
+
+void tx_cache_get_stats(tx_cache *c, tx_cache_stats *stats) {
+    if (!c) {
+        memset(stats, 0, sizeof(tx_cache_stats));
+        return;
+    }
+    LOCK(&c->lock);
+    *stats = c->stats;
+    UNLOCK(&c->lock);
+}
+
+#undef ENTRY_TEXT
+#undef LOCK_INIT
+#undef LOCK_DESTROY
+#undef LOCK
+#undef UNLOCK
+
+
+/* Streaming evaluation. Columns that are regular files are mapped a window at
+ * a time and bound where they lie, with the next window mapped ahead so the
+ * kernel reads it in while the current one is evaluated. Other inputs are read
+ * into two buffers per column, filled ahead on a second thread when a thread
+ * backend is built in. Memory use depends on the chunk size only. */
+#if defined(__unix__) || defined(__APPLE__)
+#define STREAM_POSIX
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#endif
+
+#define STREAM_CHUNK 65536
+
+#if defined(STREAM_POSIX)
+
+#if defined(TX_USE_PTHREADS)
+#define STREAM_THREADS
+typedef pthread_t stream_thread;
+typedef pthread_mutex_t stream_lock;
+typedef pthread_cond_t stream_signal;
+#define LOCK_INIT(m) (pthread_mutex_init((m), 0) == 0)
+#define LOCK_DESTROY(m) pthread_mutex_destroy(m)
+#define LOCK(m) pthread_mutex_lock(m)
+#define UNLOCK(m) pthread_mutex_unlock(m)
+#define SIGNAL_INIT(c) (pthread_cond_init((c), 0) == 0)
+#define SIGNAL_DESTROY(c) pthread_cond_destroy(c)
+#define WAIT(c, m) pthread_cond_wait((c), (m))
+#define WAKE(c) pthread_cond_broadcast(c)
+#elif defined(TX_USE_C11_THREADS)
+#define STREAM_THREADS
+typedef thrd_t stream_thread;
+typedef mtx_t stream_lock;
+typedef cnd_t stream_signal;
+#define LOCK_INIT(m) (mtx_init((m), mtx_plain) == thrd_success)
+#define LOCK_DESTROY(m) mtx_destroy(m)
+#define LOCK(m) mtx_lock(m)
+#define UNLOCK(m) mtx_unlock(m)
+#define SIGNAL_INIT(c) (cnd_init(c) == thrd_success)
+#define SIGNAL_DESTROY(c) cnd_destroy(c)
+#define WAIT(c, m) cnd_wait((c), (m))
+#define WAKE(c) cnd_broadcast(c)
+#endif
+
+
+typedef struct stream_column {
+    int fd;
+    int mapped;
+    off_t base;             /* Offset of the first point in a mapped file. */
+    off_t end;
+    void *window[2];        /* Mappings, page aligned. */
+    size_t window_size[2];
+    const d_cx *data[2];    /* Points of each slot, in a window or a buffer. */
+    size_t points[2];
+} stream_column;
+
+
+typedef struct stream {
+    stream_column *columns;
+    int count;
+    size_t chunk;
+    size_t have[2];         /* Points read into each slot across the unmapped columns. */
+    size_t limit;           /* Points left in the shortest mapped column, which no read goes past. */
+    int failed;
+#if defined(STREAM_THREADS)
+    int threaded;
+    int full[2];
+    int stop;
+    int wake[2];            /* Pipe that stops a reader blocked on its input. */
+    stream_lock lock;
+    stream_signal signal;
+#endif
+} stream;
+
+
+static ssize_t read_full(int fd, void *buffer, size_t size, int cancel) {
+    /* Stops early, with what it has, once cancel is readable. */
+    size_t done = 0;
+    while (done < size) {
+        if (cancel >= 0) {
+            struct pollfd p[2] = {{fd, POLLIN, 0}, {cancel, POLLIN, 0}};
+            if (poll(p, 2, -1) < 0) {
+                if (errno == EINTR) continue;
+                return -1;
+            }
+            if (p[1].revents) break;
+        }
+        const ssize_t r = read(fd, (char*)buffer + done, size - done);
+        if (r == 0) break;
+        if (r < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        done += r;
+    }
+    return done;
+}
+
+
+static int write_full(int fd, const void *buffer, size_t size) {
+    size_t done = 0;
+    while (done < size) {
+        const ssize_t r = write(fd, (const char*)buffer + done, size - done);
+        if (r < 0) {
+            if (errno == EINTR) continue;
+            return 0;
+        }
+        done += r;
+    }
+    return 1;
+}
+
+
+static int stream_fill(stream *st, int slot, int cancel) {
+    /* Reads the next chunk of every unmapped column into slot. Returns 0 at the end. */
+    const size_t want = st->chunk < st->limit ? st->chunk : st->limit;
+    size_t have = want;
+    int i;
+    for (i = 0; i < st->count; ++i) {
+        stream_column *c = st->columns + i;
+        if (c->mapped) continue;
+        const ssize_t r = read_full(c->fd, (d_cx*)c->data[slot], sizeof(d_cx) * want, cancel);
+        if (r < 0) {
+            st->failed = 1;
+            have = 0;
+            break;
+        }
+        if ((size_t)r / sizeof(d_cx) < have) have = r / sizeof(d_cx);
+    }
+    st->have[slot] = have;
+    st->limit -= have;
+    return have == st->chunk;
+}
+
+
+static int stream_map(stream_column *c, int slot, size_t chunk, size_t index) {
+    /* Maps window index of a mapped column into slot, or nothing past the end. */
+    const long p = sysconf(_SC_PAGESIZE);
+    const size_t page = p > 0 ? (size_t)p : 4096;
+
+    c->window[slot] = 0;
+    c->data[slot] = 0;
+    c->points[slot] = 0;
+
+    const off_t offset = c->base + (off_t)(sizeof(d_cx) * chunk * index);
+    if (offset >= c->end) return 1;
+
+    size_t points = (size_t)(c->end - offset) / sizeof(d_cx);
+    if (points > chunk) points = chunk;
+    if (!points) return 1;
+
+    const off_t start = offset - offset % (off_t)page;
+    const size_t size = (size_t)(offset - start) + sizeof(d_cx) * points;
+    void *w = mmap(0, size, PROT_READ, MAP_PRIVATE, c->fd, start);
+    if (w == MAP_FAILED) return 0;
+#if defined(MADV_WILLNEED)
+    madvise(w, size, MADV_WILLNEED);
+#endif
+
+    c->window[slot] = w;
+    c->window_size[slot] = size;
+    c->data[slot] = (const d_cx*)((char*)w + (offset - start));
+    c->points[slot] = points;
+    return 1;
+}
+
+
+static void stream_unmap(stream_column *c, int slot) {
+    if (c->window[slot]) munmap(c->window[slot], c->window_size[slot]);
+    c->window[slot] = 0;
+}
+
+
+#if defined(STREAM_THREADS)
+
+static void stream_reader(stream *st) {
+    int slot = 0;
+    for (;;) {
+        LOCK(&st->lock);
+        while (st->full[slot] && !st->stop) WAIT(&st->signal, &st->lock);
+        const int stop = st->stop;
+        UNLOCK(&st->lock);
+        if (stop) return;
+
+        const int more = stream_fill(st, slot, st->wake[0]);
+
+        LOCK(&st->lock);
+        st->full[slot] = 1;
+        WAKE(&st->signal);
+        UNLOCK(&st->lock);
+        if (!more) return;
+        slot ^= 1;
+    }
+}
+
+#if defined(TX_USE_PTHREADS)
+static void *stream_main(void *p) {
+    stream_reader(p);
+    return 0;
+}
+#define THREAD_CREATE(h, st) (pthread_create((h), 0, stream_main, (st)) == 0)
+#define THREAD_JOIN(h) pthread_join((h), 0)
+#else
+static int stream_main(void *p) {
+    stream_reader(p);
+    return 0;
+}
+#define THREAD_CREATE(h, st) (thrd_create((h), stream_main, (st)) == thrd_success)
+#define THREAD_JOIN(h) thrd_join((h), 0)
+#endif
+
+#endif
+
+
+static void stream_wait(stream *st, int slot) {
+#if defined(STREAM_THREADS)
+    if (st->threaded) {
+        LOCK(&st->lock);
+        while (!st->full[slot]) WAIT(&st->signal, &st->lock);
+        UNLOCK(&st->lock);
+        return;
+    }
+#endif
+    stream_fill(st, slot, -1);
+}
+
+
+static void stream_done(stream *st, int slot) {
+#if defined(STREAM_THREADS)
+    if (st->threaded) {
+        LOCK(&st->lock);
+        st->full[slot] = 0;
+        WAKE(&st->signal);
+        UNLOCK(&st->lock);
+    }
+#else
+    (void)st;
+    (void)slot;
+#endif
+}
+
+
+static int stream_open(stream *st, const tx_column *columns) {
+    /* Maps or allocates buffers for each column. Returns the number read into buffers, or -1. */
+    int reading = 0;
+    int i;
+    for (i = 0; i < st->count; ++i) {
+        stream_column *c = st->columns + i;
+        struct stat info;
+        c->fd = columns[i].fd;
+
+        /* Mapped points must be aligned for d_cx; anything else is read. */
+        c->base = lseek(c->fd, 0, SEEK_CUR);
+        if (c->base >= 0 && c->base % (off_t)sizeof(double) == 0 &&
+            fstat(c->fd, &info) == 0 && S_ISREG(info.st_mode)) {
+            c->mapped = 1;
+            c->end = info.st_size;
+            const size_t points = c->end > c->base ? (size_t)(c->end - c->base) / sizeof(d_cx) : 0;
+            if (points < st->limit) st->limit = points;
+            continue;
+        }
+
+        d_cx *buffer = malloc(2 * sizeof(d_cx) * st->chunk);
+        if (!buffer) return -1;
+        c->data[0] = buffer;
+        c->data[1] = buffer + st->chunk;
+        ++reading;
+    }
+    return reading;
+}
+
+
+static void stream_close(stream *st) {
+    int i;
+    if (!st->columns) return;
+    for (i = 0; i < st->count; ++i) {
+        stream_column *c = st->columns + i;
+        if (c->mapped) {
+            stream_unmap(c, 0);
+            stream_unmap(c, 1);
+        } else {
+            free((d_cx*)c->data[0]);
+        }
+    }
+    free(st->columns);
+}
+
+
+static long long stream_run(stream *st, int reading, const compact_tree *tree, tx_variable *streams,
+                            d_cx *out, d_cx *scratch, int out_fd) {
+    const size_t chunk = st->chunk;
+    long long written = 0;
+    size_t index;
+    int i;
+
+    for (index = 0; ; ++index) {
+        const int slot = index & 1;
+        size_t len = chunk;
+
+        /* The window after this one is mapped now so that it is paged in meanwhile. */
+        for (i = 0; i < st->count; ++i) {
+            stream_column *c = st->columns + i;
+            if (!c->mapped) continue;
+            if ((index == 0 && !stream_map(c, slot, chunk, index)) || !stream_map(c, slot ^ 1, chunk, index + 1)) {
+                st->failed = 1;
+            }
+            if (c->points[slot] < len) len = c->points[slot];
+        }
+
+        if (reading) {
+            stream_wait(st, slot);
+            if (st->have[slot] < len) len = st->have[slot];
+        }
+
+        if (!st->failed) {
+            for (i = 0; i < st->count; ++i) streams[i].context = (void*)st->columns[i].data[slot];
+            batch_range(tree, streams, st->count, 0, len, out, scratch);
+            if (!write_full(out_fd, out, sizeof(d_cx) * len)) st->failed = 1;
+            written += len;
+        }
+
+        for (i = 0; i < st->count; ++i) {
+            if (st->columns[i].mapped) stream_unmap(st->columns + i, slot);
+        }
+        if (reading) stream_done(st, slot);
+        if (st->failed || len < chunk) break;
+    }
+
+    return st->failed ? -1 : written;
+}
+
+
+long long tx_eval_stream(const tx_expr *n, const tx_column *columns, int column_count, int out_fd, size_t chunk) {
+    if (!n || column_count < 0 || (column_count && !columns)) return -1;
+    if (!column_count) return 0;
+    if (!chunk) chunk = STREAM_CHUNK;
+    if (chunk > ((size_t)-1 / 2) / sizeof(d_cx)) return -1;
+
+    stream st;
+    memset(&st, 0, sizeof(st));
+    st.count = column_count;
+    st.chunk = chunk;
+    st.limit = (size_t)-1;
+    st.columns = calloc(column_count, sizeof(stream_column));
+
+    compact_tree *tree = compact_create(n);
+    d_cx *scratch = batch_scratch(tree);
+    d_cx *out = malloc(sizeof(d_cx) * chunk);
+    tx_variable *streams = calloc(column_count, sizeof(tx_variable));
+    const int reading = st.columns ? stream_open(&st, columns) : -1;
+    long long written = -1;
+    int i;
+
+    if (scratch && out && streams && reading >= 0) {
+        for (i = 0; i < column_count; ++i) streams[i].address = columns[i].address;
+
+#if defined(STREAM_THREADS)
+        stream_thread reader;
+        if (reading && pipe(st.wake) == 0) {
+            if (LOCK_INIT(&st.lock)) {
+                if (SIGNAL_INIT(&st.signal)) {
+                    st.threaded = THREAD_CREATE(&reader, &st);
+                    if (!st.threaded) SIGNAL_DESTROY(&st.signal);
+                }
+                if (!st.threaded) LOCK_DESTROY(&st.lock);
+            }
+            if (!st.threaded) {
+                close(st.wake[0]);
+                close(st.wake[1]);
+            }
+        }
+#endif
+
+        written = stream_run(&st, reading, tree, streams, out, scratch, out_fd);
+
+#if defined(STREAM_THREADS)
+        if (st.threaded) {
+            /* A reader still waiting on a pipe is woken by the byte, not the signal. */
+            const char byte = 0;
+            LOCK(&st.lock);
+            st.stop = 1;
+            WAKE(&st.signal);
+            UNLOCK(&st.lock);
+            while (write(st.wake[1], &byte, 1) < 0 && errno == EINTR) {}
+            THREAD_JOIN(reader);
+            SIGNAL_DESTROY(&st.signal);
+            LOCK_DESTROY(&st.lock);
+            close(st.wake[0]);
+            close(st.wake[1]);
+        }
+#endif
+    }
+
+    stream_close(&st);
+    free(streams);
+    free(out);
+    free(scratch);
+    free(tree);
+    return written;
+}
+
+#if defined(STREAM_THREADS)
+#undef THREAD_CREATE
+#undef THREAD_JOIN
+#undef LOCK_INIT
+#undef LOCK_DESTROY
+#undef LOCK
+#undef UNLOCK
+#undef SIGNAL_INIT
+#undef SIGNAL_DESTROY
+#undef WAIT
+#undef WAKE
+#endif
+
+#else
+
+long long tx_eval_stream(const tx_expr *n, const tx_column *columns, int column_count, int out_fd, size_t chunk) {
+    (void)n;
+    (void)columns;
+    (void)column_count;
+    (void)out_fd;
+    (void)chunk;
+    return -1;
+}
+
+#endif
+
+
+/* GPU offload. A tree made of built-ins is written out as an OpenCL C kernel
+ * that evaluates it at one point per work item, over a prelude with the
+ * complex functions OpenCL lacks. With TX_ENABLE_OPENCL the library is loaded
+ * at run time, kernels are built once per source and kept by its hash, and
+ * points go through the device in chunks. Anything else runs on the CPU. */
+#define GPU_CHUNK (1 << 20)
+#define GPU_KERNELS 64
+
+static const char gpu_prelude[] =
+    "#if defined(cl_khr_fp64)\n"
+    "#pragma OPENCL EXTENSION cl_khr_fp64 : enable\n"
+    "#endif\n"
+    "typedef double2 cx;\n"
+    "#ifndef CX\n"
+    "#define CX(a, b) ((double2)((a), (b)))\n"
+    "#endif\n"
+    "cx tx_i(void) {return CX(0.0, 1.0);}\n"
+    "cx tx_pi(void) {return CX(3.14159265358979323846, 0.0);}\n"
+    "cx tx_e(void) {return CX(2.71828182845904523536, 0.0);}\n"
+    "cx tx_inf(void) {return CX(INFINITY, 0.0);}\n"
+    "cx tx_add(cx a, cx b) {return CX(a.x + b.x, a.y + b.y);}\n"
+    "cx tx_sub(cx a, cx b) {return CX(a.x - b.x, a.y - b.y);}\n"
+    "cx tx_mul(cx a, cx b) {return CX(a.x * b.x - a.y * b.y, a.x * b.y + a.y * b.x);}\n"
+    "cx tx_div(cx a, cx b) {\n"
+    "    double r, d;\n"
+    "    if (b.x == 0.0 && b.y == 0.0) return CX(copysign(INFINITY, b.x) * a.x, copysign(INFINITY, b.x) * a.y);\n"
+    "    if (fabs(b.x) >= fabs(b.y)) {\n"
+    "        r = b.y / b.x; d = b.x + b.y * r;\n"
+    "        return CX((a.x + a.y * r) / d, (a.y - a.x * r) / d);\n"
+    "    }\n"
+    "    r = b.x / b.y; d = b.x * r + b.y;\n"
+    "    return CX((a.x * r + a.y) / d, (a.y * r - a.x) / d);\n"
+    "}\n"
+    "cx tx_neg(cx a) {return CX(-a.x, -a.y);}\n"
+    "cx tx_comma(cx a, cx b) {(void)a; return b;}\n"
+    "cx tx_square(cx a) {return tx_mul(a, a);}\n"
+    "cx tx_ipow(cx a, cx b) {\n"
+    "    int e = (int)b.x;\n"
+    "    const int negative = e < 0;\n"
+    "    cx r = CX(1.0, 0.0);\n"
+    "    if (negative) e = -e;\n"
+    "    while (e) {\n"
+    "        if (e & 1) r = tx_mul(r, a);\n"
+    "        e >>= 1;\n"
+    "        if (e) a = tx_mul(a, a);\n"
+    "    }\n"
+    "    return negative ? tx_div(CX(1.0, 0.0), r) : r;\n"
+    "}\n"
+    "cx tx_fma(cx a, cx b, cx c) {return CX(fma(a.x, b.x, fma(-a.y, b.y, c.x)), fma(a.x, b.y, fma(a.y, b.x, c.y)));}\n"
+    "cx tx_abs(cx a) {return CX(hypot(a.x, a.y), 0.0);}\n"
+    "cx tx_arg(cx a) {return CX(atan2(a.y, a.x), 0.0);}\n"
+    "cx tx_real(cx a) {return CX(a.x, 0.0);}\n"
+    "cx tx_imag(cx a) {return CX(a.y, 0.0);}\n"
+    "cx tx_conj(cx a) {return CX(a.x, -a.y);}\n"
+    "cx tx_exp(cx a) {\n"
+    "    const double r = exp(a.x);\n"
+    "    if (a.y == 0.0) return CX(r, a.y);\n"
+    "    return CX(r * cos(a.y), r * sin(a.y));\n"
+    "}\n"
+    "cx tx_log(cx a) {return CX(log(hypot(a.x, a.y)), atan2(a.y, a.x));}\n"
+    "cx tx_sqrt(cx a) {\n"
+    "    double t;\n"
+    "    if (a.x == 0.0 && a.y == 0.0) return CX(0.0, a.y);\n"
+    "    t = sqrt((fabs(a.x) + hypot(a.x, a.y)) / 2);\n"
+    "    if (a.x >= 0.0) return CX(t, a.y / (2 * t));\n"
+    "    return CX(fabs(a.y) / (2 * t), copysign(t, a.y));\n"
+    "}\n"
+    "cx tx_pow(cx a, cx b) {\n"
+    "    if (a.x == 0.0 && a.y == 0.0 && b.x > 0.0) return CX(0.0, 0.0);\n"
+    "    return tx_exp(tx_mul(b, tx_log(a)));\n"
+    "}\n"
+    "cx tx_sin(cx a) {return CX(sin(a.x) * cosh(a.y), cos(a.x) * sinh(a.y));}\n"
+    "cx tx_cos(cx a) {return CX(cos(a.x) * cosh(a.y), -sin(a.x) * sinh(a.y));}\n"
+    "cx tx_sinh(cx a) {return CX(sinh(a.x) * cos(a.y), cosh(a.x) * sin(a.y));}\n"
+    "cx tx_cosh(cx a) {return CX(cosh(a.x) * cos(a.y), sinh(a.x) * sin(a.y));}\n"
+    "cx tx_tanh(cx a) {\n"
+    "    double s, c, d;\n"
+    "    if (fabs(a.x) > 20.0) return CX(copysign(1.0, a.x), 4.0 * sin(a.y) * cos(a.y) * exp(-2.0 * fabs(a.x)));\n"
+    "    s = sinh(a.x); c = cos(a.y);\n"
+    "    d = s * s + c * c;\n"
+    "    return CX(s * cosh(a.x) / d, sin(a.y) * c / d);\n"
+    "}\n"
+    "cx tx_tan(cx a) {const cx t = tx_tanh(CX(-a.y, a.x)); return CX(t.y, -t.x);}\n"
+    "cx tx_asinh(cx a) {\n"
+    "    const double s = signbit(a.x) ? -1.0 : 1.0;\n"
+    "    const cx z = CX(s * a.x, s * a.y);\n"
+    "    const cx r = tx_log(tx_add(z, tx_sqrt(CX((z.x - z.y) * (z.x + z.y) + 1.0, 2.0 * z.x * z.y))));\n"
+    "    return CX(s * r.x, s * r.y);\n"
+    "}\n"
+    "cx tx_asin(cx a) {const cx r = tx_asinh(CX(-a.y, a.x)); return CX(r.y, -r.x);}\n"
+    "cx tx_acos(cx a) {const cx r = tx_asin(a); return CX(1.57079632679489661923 - r.x, -r.y);}\n"
+    "cx tx_acosh(cx a) {return tx_log(tx_add(a, tx_mul(tx_sqrt(CX(a.x + 1.0, a.y)), tx_sqrt(CX(a.x - 1.0, a.y)))));}\n"
+    "cx tx_atanh(cx a) {\n"
+    "    const double d = (1.0 - a.x) * (1.0 - a.x) + a.y * a.y;\n"
+    "    return CX(0.25 * log1p(4.0 * a.x / d), 0.5 * atan2(2.0 * a.y, (1.0 - a.x) * (1.0 + a.x) - a.y * a.y));\n"
+    "}\n"
+    "cx tx_atan(cx a) {const cx r = tx_atanh(CX(-a.y, a.x)); return CX(r.y, -r.x);}\n"
+    "cx tx_radd(cx a, cx b) {return CX(a.x + b.x, 0.0);}\n"
+    "cx tx_rsub(cx a, cx b) {return CX(a.x - b.x, 0.0);}\n"
+    "cx tx_rmul(cx a, cx b) {return CX(a.x * b.x, 0.0);}\n"
+    "cx tx_rdiv(cx a, cx b) {return CX(a.x / b.x, 0.0);}\n"
+    "cx tx_rneg(cx a) {return CX(-a.x, 0.0);}\n"
+    "cx tx_rsquare(cx a) {return CX(a.x * a.x, 0.0);}\n"
+    "cx tx_rabs(cx a) {return CX(fabs(a.x), 0.0);}\n"
+    "cx tx_rsin(cx a) {return CX(sin(a.x), 0.0);}\n"
+    "cx tx_rcos(cx a) {return CX(cos(a.x), 0.0);}\n"
+    "cx tx_rtan(cx a) {return CX(tan(a.x), 0.0);}\n"
+    "cx tx_rsinh(cx a) {return CX(sinh(a.x), 0.0);}\n"
+    "cx tx_rcosh(cx a) {return CX(cosh(a.x), 0.0);}\n"
+    "cx tx_rtanh(cx a) {return CX(tanh(a.x), 0.0);}\n"
+    "cx tx_rexp(cx a) {return CX(exp(a.x), 0.0);}\n"
+    "cx tx_ratan(cx a) {return CX(atan(a.x), 0.0);}\n"
+    "cx tx_rasinh(cx a) {return CX(asinh(a.x), 0.0);}\n"
+    "cx tx_ripow(cx a, cx b) {\n"
+    "    int e = (int)b.x;\n"
+    "    const int negative = e < 0;\n"
+    "    double x = a.x, r = 1.0;\n"
+    "    if (negative) e = -e;\n"
+    "    while (e) {\n"
+    "        if (e & 1) r *= x;\n"
+    "        e >>= 1;\n"
+    "        if (e) x *= x;\n"
+    "    }\n"
+    "    return CX(negative ? 1.0 / r : r, 0.0);\n"
+    "}\n"
+    "cx tx_rfma(cx a, cx b, cx c) {return CX(fma(a.x, b.x, c.x), 0.0);}\n";
+
+
+static const struct {const void *function; const char *name;} gpu_functions[] = {
+    {i, "tx_i"}, {pi, "tx_pi"}, {e, "tx_e"}, {infinity, "tx_inf"},
+    {add, "tx_add"}, {sub, "tx_sub"}, {mul, "tx_mul"}, {divide, "tx_div"}, {negate, "tx_neg"},
+    {comma, "tx_comma"}, {square, "tx_square"}, {ipow, "tx_ipow"}, {cfma, "tx_fma"},
+    {_cabs, "tx_abs"}, {_carg, "tx_arg"}, {_creal, "tx_real"}, {_cimag, "tx_imag"}, {conj, "tx_conj"},
+    {cexp, "tx_exp"}, {clog, "tx_log"}, {csqrt, "tx_sqrt"}, {cpow, "tx_pow"},
+    {csin, "tx_sin"}, {ccos, "tx_cos"}, {ctan, "tx_tan"}, {csinh, "tx_sinh"}, {ccosh, "tx_cosh"}, {ctanh, "tx_tanh"},
+    {casin, "tx_asin"}, {cacos, "tx_acos"}, {catan, "tx_atan"},
+    {casinh, "tx_asinh"}, {cacosh, "tx_acosh"}, {catanh, "tx_atanh"},
+    {radd, "tx_radd"}, {rsub, "tx_rsub"}, {rmul, "tx_rmul"}, {rdivide, "tx_rdiv"}, {rnegate, "tx_rneg"},
+    {rsquare, "tx_rsquare"}, {rabs, "tx_rabs"}, {rsin, "tx_rsin"}, {rcos, "tx_rcos"}, {rtan, "tx_rtan"},
+    {rsinh, "tx_rsinh"}, {rcosh, "tx_rcosh"}, {rtanh, "tx_rtanh"}, {rexp, "tx_rexp"}, {ratan, "tx_ratan"},
+    {rasinh, "tx_rasinh"}, {ripow, "tx_ripow"}, {rfma, "tx_rfma"},
+    {0, 0}
+};
+
+
+/* Source text, counted in full even where it does not fit. */
+typedef struct gpu_text {
+    char *buffer;
+    size_t size;
+    size_t length;
+} gpu_text;
+
+static void gpu_append(gpu_text *t, const char *format, ...) {
+    const size_t room = t->length < t->size ? t->size - t->length : 0;
+    va_list args;
+    va_start(args, format);
+    const int n = vsnprintf(room ? t->buffer + t->length : 0, room, format, args);
+    va_end(args);
+    if (n > 0) t->length += n;
+}
+
+
+static void gpu_number(gpu_text *t, double v) {
+    if (v != v) gpu_append(t, "NAN");
+    else if (isinf(v)) gpu_append(t, v < 0 ? "-INFINITY" : "INFINITY");
+    else gpu_append(t, "%a", v);
+}
+
+
+/* The variables of a kernel in order of appearance, each read from its */
+/* stream or from the fixed values passed at launch. */
+typedef struct gpu_vars {
+    const d_cx **bound;
+    int *stream;        /* Index into the streams, or -1. */
+    int count;
+    int capacity;
+} gpu_vars;
+
+
+static int gpu_find(const gpu_vars *v, const d_cx *bound) {
+    int i;
+    for (i = 0; i < v->count; ++i) {
+        if (v->bound[i] == bound) return i;
+    }
+    return -1;
+}
+
+
+static int gpu_collect(gpu_vars *v, const tx_expr *n, const tx_variable *streams, int stream_count) {
+    const int arity = ARITY(n->type);
+    int i;
+    if (TYPE_MASK(n->type) == TX_VARIABLE && gpu_find(v, n->bound) < 0) {
+        if (v->count == v->capacity) {
+            const int capacity = v->capacity ? 2 * v->capacity : 16;
+            const d_cx **bound = realloc(v->bound, sizeof(d_cx*) * capacity);
+            if (bound) v->bound = bound;
+            int *stream = realloc(v->stream, sizeof(int) * capacity);
+            if (stream) v->stream = stream;
+            if (!bound || !stream) return 0;
+            v->capacity = capacity;
+        }
+        v->bound[v->count] = n->bound;
+        v->stream[v->count] = -1;
+        for (i = 0; i < stream_count; ++i) {
+            if (streams[i].address == n->bound) {
+                v->stream[v->count] = i;
+                break;
+            }
+        }
+        ++v->count;
+    }
+    for (i = 0; i < arity; ++i) {
+        if (!gpu_collect(v, n->parameters[i], streams, stream_count)) return 0;
+    }
+    return 1;
+}
+
+
+static int gpu_emit(gpu_text *t, const tx_expr *n, const gpu_vars *v, int *next) {
+    /* Writes one temporary per node, children first, and returns its number. */
+    /* Returns -1 for anything without an OpenCL counterpart. */
+    const int arity = ARITY(n->type);
+    int args[7];
+    int i;
+
+    switch (TYPE_MASK(n->type)) {
+    case TX_CONSTANT:
+        gpu_append(t, "    const cx t%d = CX(", *next);
+        gpu_number(t, creal(n->value));
+        gpu_append(t, ", ");
+        gpu_number(t, cimag(n->value));
+        gpu_append(t, ");\n");
+        return (*next)++;
+    case TX_VARIABLE:
+        gpu_append(t, "    const cx t%d = v%d;\n", *next, gpu_find(v, n->bound));
+        return (*next)++;
+    }
+    if (IS_CLOSURE(n->type) || IS_ARRAY(n->type)) return -1;
+
+    const void *f = exact_kernel(n->function);
+    for (i = 0; gpu_functions[i].function && gpu_functions[i].function != f; ++i) {}
+    if (!gpu_functions[i].function) return -1;
+    const char *name = gpu_functions[i].name;
+
+    for (i = 0; i < arity; ++i) {
+        args[i] = gpu_emit(t, n->parameters[i], v, next);
+        if (args[i] < 0) return -1;
+    }
+    gpu_append(t, "    const cx t%d = %s(", *next, name);
+    for (i = 0; i < arity; ++i) gpu_append(t, i ? ", t%d" : "t%d", args[i]);
+    gpu_append(t, ");\n");
+    return (*next)++;
+}
+
+
+static int gpu_source(gpu_text *t, const tx_expr *n, const tx_variable *streams, int stream_count, gpu_vars *v) {
+    /* The kernel reads stream s at in[s*stride + j] and the other variables from fixed, */
+    /* in the order of v. Returns 0 where n cannot be translated. */
+    int i, fixed = 0, next = 0;
+    if (!gpu_collect(v, n, streams, stream_count)) return 0;
+
+    gpu_append(t, "%s\n", gpu_prelude);
+    gpu_append(t, "__kernel void tx_kernel(__global const cx *in, __global const cx *fixed, __global cx *out,\n"
+                  "                        const ulong stride, const ulong count) {\n"
+                  "    const ulong j = get_global_id(0);\n"
+                  "    if (j >= count) return;\n");
+    for (i = 0; i < v->count; ++i) {
+        if (v->stream[i] >= 0) gpu_append(t, "    const cx v%d = in[%d * stride + j];\n", i, v->stream[i]);
+        else gpu_append(t, "    const cx v%d = fixed[%d];\n", i, fixed++);
+    }
+    const int root = gpu_emit(t, n, v, &next);
+    if (root < 0) return 0;
+    gpu_append(t, "    out[j] = t%d;\n}\n", root);
+    return 1;
+}
+
+
+size_t tx_gpu_source(const tx_expr *n, const tx_variable *streams, int stream_count, char *buffer, size_t size) {
+    gpu_text t = {0, 0, 0};
+    gpu_vars v = {0, 0, 0, 0};
+    if (!n || stream_count < 0 || (stream_count && !streams)) return 0;
+
+    int ok = gpu_source(&t, n, streams, stream_count, &v);
+    if (ok && buffer && t.length < size) {
+        t.buffer = buffer;
+        t.size = size;
+        t.length = 0;
+        v.count = 0;
+        ok = gpu_source(&t, n, streams, stream_count, &v);
+    }
+    free(v.bound);
+    free(v.stream);
+    return ok ? t.length : 0;
+}
+
+
+#if defined(TX_ENABLE_OPENCL) && (defined(__unix__) || defined(__APPLE__))
+#define GPU_OPENCL
+#include <dlfcn.h>
+#endif
+
+#if defined(GPU_OPENCL)
+
+/* Just enough of the OpenCL 1.2 API to load it without its headers. */
+typedef int32_t cl_int;
+typedef uint32_t cl_uint;
+typedef uint64_t cl_ulong;
+typedef cl_ulong cl_bitfield;
+typedef struct _cl_platform_id *cl_platform_id;
+typedef struct _cl_device_id *cl_device_id;
+typedef struct _cl_context *cl_context;
+typedef struct _cl_command_queue *cl_command_queue;
+typedef struct _cl_program *cl_program;
+typedef struct _cl_kernel *cl_kernel;
+typedef struct _cl_mem *cl_mem;
+typedef struct _cl_event *cl_event;
+
+#define CL_SUCCESS 0
+#define CL_TRUE 1
+#define CL_FALSE 0
+#define CL_DEVICE_TYPE_GPU (1 << 2)
+#define CL_DEVICE_TYPE_ALL 0xFFFFFFFFu
+#define CL_DEVICE_DOUBLE_FP_CONFIG 0x1032
+#define CL_MEM_WRITE_ONLY (1 << 1)
+#define CL_MEM_READ_ONLY (1 << 2)
+
+typedef struct gpu_api {
+    cl_int (*GetPlatformIDs)(cl_uint, cl_platform_id*, cl_uint*);
+    cl_int (*GetDeviceIDs)(cl_platform_id, cl_bitfield, cl_uint, cl_device_id*, cl_uint*);
+    cl_int (*GetDeviceInfo)(cl_device_id, cl_uint, size_t, void*, size_t*);
+    cl_context (*CreateContext)(const intptr_t*, cl_uint, const cl_device_id*,
+                                void (*)(const char*, const void*, size_t, void*), void*, cl_int*);
+    cl_command_queue (*CreateCommandQueue)(cl_context, cl_device_id, cl_bitfield, cl_int*);
+    cl_program (*CreateProgramWithSource)(cl_context, cl_uint, const char**, const size_t*, cl_int*);
+    cl_int (*BuildProgram)(cl_program, cl_uint, const cl_device_id*, const char*, void (*)(cl_program, void*), void*);
+    cl_kernel (*CreateKernel)(cl_program, const char*, cl_int*);
+    cl_mem (*CreateBuffer)(cl_context, cl_bitfield, size_t, void*, cl_int*);
+    cl_int (*SetKernelArg)(cl_kernel, cl_uint, size_t, const void*);
+    cl_int (*EnqueueWriteBuffer)(cl_command_queue, cl_mem, cl_uint, size_t, size_t, const void*,
+                                 cl_uint, const cl_event*, cl_event*);
+    cl_int (*EnqueueReadBuffer)(cl_command_queue, cl_mem, cl_uint, size_t, size_t, void*,
+                                cl_uint, const cl_event*, cl_event*);
+    cl_int (*EnqueueNDRangeKernel)(cl_command_queue, cl_kernel, cl_uint, const size_t*, const size_t*,
+                                   const size_t*, cl_uint, const cl_event*, cl_event*);
+    cl_int (*ReleaseMemObject)(cl_mem);
+    cl_int (*ReleaseKernel)(cl_kernel);
+    cl_int (*ReleaseProgram)(cl_program);
+    cl_int (*ReleaseCommandQueue)(cl_command_queue);
+    cl_int (*ReleaseContext)(cl_context);
+} gpu_api;
+
+
+typedef struct gpu_kernel {
+    unsigned hash;
+    char *source;
+    cl_program program;
+    cl_kernel kernel;
+} gpu_kernel;
+
+
+typedef struct gpu_buffer {
+    cl_mem mem;
+    size_t size;
+} gpu_buffer;
+
+
+struct tx_gpu {
+    void *library;
+    gpu_api cl;
+    cl_device_id device;
+    cl_context context;
+    cl_command_queue queue;
+    gpu_kernel kernels[GPU_KERNELS];
+    int next;
+    gpu_buffer in, fixed, out;
+};
+
+
+static int gpu_load(tx_gpu *g) {
+    static const char *const names[] = {
+#if defined(__APPLE__)
+        "/System/Library/Frameworks/OpenCL.framework/OpenCL",
+#endif
+        "libOpenCL.so.1", "libOpenCL.so", 0
+    };
+    int i;
+    for (i = 0; names[i] && !g->library; ++i) g->library = dlopen(names[i], RTLD_NOW | RTLD_LOCAL);
+    if (!g->library) return 0;
+
+#define GPU_LOAD(name) ((*(void**)&g->cl.name = dlsym(g->library, "cl" #name)) != 0)
+    return GPU_LOAD(GetPlatformIDs) && GPU_LOAD(GetDeviceIDs) && GPU_LOAD(GetDeviceInfo) &&
+           GPU_LOAD(CreateContext) && GPU_LOAD(CreateCommandQueue) && GPU_LOAD(CreateProgramWithSource) &&
+           GPU_LOAD(BuildProgram) && GPU_LOAD(CreateKernel) && GPU_LOAD(CreateBuffer) && GPU_LOAD(SetKernelArg) &&
+           GPU_LOAD(EnqueueWriteBuffer) && GPU_LOAD(EnqueueReadBuffer) && GPU_LOAD(EnqueueNDRangeKernel) &&
+           GPU_LOAD(ReleaseMemObject) && GPU_LOAD(ReleaseKernel) && GPU_LOAD(ReleaseProgram) &&
+           GPU_LOAD(ReleaseCommandQueue) && GPU_LOAD(ReleaseContext);
+#undef GPU_LOAD
+}
+
+
+static int gpu_pick(tx_gpu *g) {
+    /* The first GPU with doubles, or else the first device of any kind with them. */
+    static const cl_bitfield kinds[] = {CL_DEVICE_TYPE_GPU, CL_DEVICE_TYPE_ALL};
+    cl_platform_id platforms[8];
+    cl_uint platform_count = 0, p, k;
+    if (g->cl.GetPlatformIDs(8, platforms, &platform_count) != CL_SUCCESS) return 0;
+    if (platform_count > 8) platform_count = 8;
+
+    for (k = 0; k < 2; ++k) {
+        for (p = 0; p < platform_count; ++p) {
+            cl_device_id devices[8];
+            cl_uint device_count = 0, d;
+            if (g->cl.GetDeviceIDs(platforms[p], kinds[k], 8, devices, &device_count) != CL_SUCCESS) continue;
+            if (device_count > 8) device_count = 8;
+            for (d = 0; d < device_count; ++d) {
+                cl_bitfield fp64 = 0;
+                if (g->cl.GetDeviceInfo(devices[d], CL_DEVICE_DOUBLE_FP_CONFIG, sizeof(fp64), &fp64, 0) == CL_SUCCESS
+                    && fp64) {
+                    g->device = devices[d];
+                    return 1;
+                }
+            }
+        }
+    }
+    return 0;
+}
+
+
+tx_gpu *tx_gpu_create(void) {
+    tx_gpu *g = calloc(1, sizeof(tx_gpu));
+    cl_int err = CL_SUCCESS;
+    CHECK_NULL(g);
+
+    if (gpu_load(g) && gpu_pick(g)) {
+        g->context = g->cl.CreateContext(0, 1, &g->device, 0, 0, &err);
+        if (g->context && err == CL_SUCCESS) g->queue = g->cl.CreateCommandQueue(g->context, g->device, 0, &err);
+    }
+    if (!g->queue || err != CL_SUCCESS) {
+        tx_gpu_free(g);
+        return NULL;
+    }
+    return g;
+}
+
+
+void tx_gpu_free(tx_gpu *g) {
+    int i;
+    if (!g) return;
+    for (i = 0; i < GPU_KERNELS; ++i) {
+        if (g->kernels[i].kernel) g->cl.ReleaseKernel(g->kernels[i].kernel);
+        if (g->kernels[i].program) g->cl.ReleaseProgram(g->kernels[i].program);
+        free(g->kernels[i].source);
+    }
+    if (g->in.mem) g->cl.ReleaseMemObject(g->in.mem);
+    if (g->fixed.mem) g->cl.ReleaseMemObject(g->fixed.mem);
+    if (g->out.mem) g->cl.ReleaseMemObject(g->out.mem);
+    if (g->queue) g->cl.ReleaseCommandQueue(g->queue);
+    if (g->context) g->cl.ReleaseContext(g->context);
+    if (g->library) dlclose(g->library);
+    free(g);
+}
+
+
+static cl_kernel gpu_kernel_get(tx_gpu *g, const char *source, size_t length) {
+    /* Builds the source on first sight, replacing the kernels round robin when full. */
+    const unsigned hash = hash_bytes(2166136261u, source, length);
+    int i;
+    for (i = 0; i < GPU_KERNELS; ++i) {
+        const gpu_kernel *k = g->kernels + i;
+        if (k->kernel && k->hash == hash && strcmp(k->source, source) == 0) return k->kernel;
+    }
+
+    gpu_kernel *k = g->kernels + g->next;
+    g->next = (g->next + 1) % GPU_KERNELS;
+    if (k->kernel) g->cl.ReleaseKernel(k->kernel);
+    if (k->program) g->cl.ReleaseProgram(k->program);
+    free(k->source);
+    memset(k, 0, sizeof(gpu_kernel));
+
+    cl_int err;
+    k->program = g->cl.CreateProgramWithSource(g->context, 1, &source, &length, &err);
+    if (!k->program || err != CL_SUCCESS) return 0;
+    if (g->cl.BuildProgram(k->program, 1, &g->device, "", 0, 0) != CL_SUCCESS) return 0;
+    k->kernel = g->cl.CreateKernel(k->program, "tx_kernel", &err);
+    if (!k->kernel || err != CL_SUCCESS) {
+        k->kernel = 0;
+        return 0;
+    }
+    k->source = malloc(length + 1);
+    if (!k->source) {
+        g->cl.ReleaseKernel(k->kernel);
+        k->kernel = 0;
+        return 0;
+    }
+    memcpy(k->source, source, length + 1);
+    k->hash = hash;
+    return k->kernel;
+}
+
+
+static int gpu_reserve(tx_gpu *g, gpu_buffer *b, cl_bitfield flags, size_t size) {
+    cl_int err;
+    if (b->mem && b->size >= size) return 1;
+    if (b->mem) g->cl.ReleaseMemObject(b->mem);
+    b->mem = g->cl.CreateBuffer(g->context, flags, size, 0, &err);
+    b->size = b->mem && err == CL_SUCCESS ? size : 0;
+    return b->size != 0;
+}
+
+
+static char *gpu_source_text(const tx_expr *n, const tx_variable *streams, int stream_count, gpu_vars *v,
+                             size_t *length) {
+    /* Measures the source, then writes it. */
+    gpu_text t = {0, 0, 0};
+    if (!gpu_source(&t, n, streams, stream_count, v)) return NULL;
+
+    t.buffer = malloc(t.length + 1);
+    CHECK_NULL(t.buffer);
+    t.size = t.length + 1;
+    t.length = 0;
+    v->count = 0;
+    gpu_source(&t, n, streams, stream_count, v);
+    *length = t.length;
+    return t.buffer;
+}
+
+
+static int gpu_run(tx_gpu *g, cl_kernel kernel, const gpu_vars *v, const tx_variable *streams, int stream_count,
+                   size_t len, d_cx *out) {
+    const size_t chunk = len < GPU_CHUNK ? len : GPU_CHUNK;
+    d_cx *fixed = malloc(sizeof(d_cx) * (v->count + 1));
+    int fixed_count = 0, i;
+    size_t start;
+    if (!fixed) return 0;
+
+    for (i = 0; i < v->count; ++i) {
+        if (v->stream[i] < 0) fixed[fixed_count++] = *v->bound[i];
+    }
+    int ok = gpu_reserve(g, &g->in, CL_MEM_READ_ONLY, sizeof(d_cx) * chunk * (stream_count ? stream_count : 1)) &&
+             gpu_reserve(g, &g->fixed, CL_MEM_READ_ONLY, sizeof(d_cx) * (fixed_count ? fixed_count : 1)) &&
+             gpu_reserve(g, &g->out, CL_MEM_WRITE_ONLY, sizeof(d_cx) * chunk);
+    if (ok && fixed_count) {
+        ok = g->cl.EnqueueWriteBuffer(g->queue, g->fixed.mem, CL_TRUE, 0, sizeof(d_cx) * fixed_count, fixed,
+                                      0, 0, 0) == CL_SUCCESS;
+    }
+    free(fixed);
+
+    const cl_ulong stride = chunk;
+    ok = ok && g->cl.SetKernelArg(kernel, 0, sizeof(cl_mem), &g->in.mem) == CL_SUCCESS &&
+         g->cl.SetKernelArg(kernel, 1, sizeof(cl_mem), &g->fixed.mem) == CL_SUCCESS &&
+         g->cl.SetKernelArg(kernel, 2, sizeof(cl_mem), &g->out.mem) == CL_SUCCESS &&
+         g->cl.SetKernelArg(kernel, 3, sizeof(cl_ulong), &stride) == CL_SUCCESS;
+
+    for (start = 0; ok && start < len; start += chunk) {
+        const size_t count = len - start < chunk ? len - start : chunk;
+        const size_t global = (count + 63) / 64 * 64;
+        const cl_ulong points = count;
+        for (i = 0; ok && i < v->count; ++i) {
+            const int s = v->stream[i];
+            if (s < 0) continue;
+            ok = g->cl.EnqueueWriteBuffer(g->queue, g->in.mem, CL_FALSE, sizeof(d_cx) * chunk * s,
+                                          sizeof(d_cx) * count, (const d_cx*)streams[s].context + start,
+                                          0, 0, 0) == CL_SUCCESS;
+        }
+        ok = ok && g->cl.SetKernelArg(kernel, 4, sizeof(cl_ulong), &points) == CL_SUCCESS &&
+             g->cl.EnqueueNDRangeKernel(g->queue, kernel, 1, 0, &global, 0, 0, 0, 0) == CL_SUCCESS &&
+             g->cl.EnqueueReadBuffer(g->queue, g->out.mem, CL_TRUE, 0, sizeof(d_cx) * count, out + start,
+                                     0, 0, 0) == CL_SUCCESS;
+    }
+    return ok;
+}
+
+
+int tx_gpu_eval_batch(tx_gpu *g, const tx_expr *n, const tx_variable *streams, int stream_count, size_t len,
+                      d_cx *out) {
+    gpu_vars v = {0, 0, 0, 0};
+    char *source = 0;
+    size_t length = 0;
+    int ok = 0;
+
+    if (g && n && len && stream_count >= 0 && (!stream_count || streams)) {
+        source = gpu_source_text(n, streams, stream_count, &v, &length);
+    }
+    if (source) {
+        const cl_kernel kernel = gpu_kernel_get(g, source, length);
+        ok = kernel && gpu_run(g, kernel, &v, streams, stream_count, len, out);
+    }
+    free(source);
+    free(v.bound);
+    free(v.stream);
+
+    if (!ok) tx_eval_batch(n, streams, stream_count, len, out);
+    return ok;
+}
+
+#else
+
+struct tx_gpu {
+    int unused;
+};
+
+tx_gpu *tx_gpu_create(void) {return NULL;}
+void tx_gpu_free(tx_gpu *g) {(void)g;}
+
+int tx_gpu_eval_batch(tx_gpu *g, const tx_expr *n, const tx_variable *streams, int stream_count, size_t len,
+                      d_cx *out) {
+    (void)g;
+    tx_eval_batch(n, streams, stream_count, len, out);
+    return 0;
+}
+
+#endif
+
+
+/* Statistics. Sharing is found with the hash-consing of the bytecode
+ * lowering. The cost is a rough weight per node, with loops multiplied out
+ * where their bounds are constants. */
+static double node_cost(const tx_expr *n) {
+    /* In complex additions. */
+    int i;
+    switch (TYPE_MASK(n->type)) {
+    case TX_CONSTANT: case TX_VARIABLE: return 1;
+    }
+    if (is_loop(n)) return 10;
+
+    switch (infix_op(n)) {
+    case OP_ADD: case OP_SUB: case OP_NEG: case OP_COMMA:
+    case OP_RADD: case OP_RSUB: case OP_RMUL: case OP_RNEG: return 1;
+    case OP_MUL: case OP_RDIV: return 4;
+    case OP_DIV: return 10;
+    }
+    if (n->function == square || n->function == rsquare || n->function == cfma || n->function == rfma) return 4;
+    if (IS_CLOSURE(n->type)) return 50;
+
+    i = fast_find(n->function);
+    if (i >= 0 && n->function != fast_kernels[i].exact) return 15;
+    for (i = 0; real_kernels[i].cx; ++i) {
+        if (n->function == real_kernels[i].re) return 20;
+    }
+    return 50;
+}
+
+
+static double loop_trips(const tx_expr *n) {
+    /* Iterations of a loop with constant bounds, or one. */
+    const loop *l = n->parameters[ARITY(n->type)];
+    const tx_expr *lo = n->parameters[0], *hi = n->parameters[1];
+    double trips;
+    if (TYPE_MASK(hi->type) != TX_CONSTANT) return 1;
+    if (l->kind == LOOP_ITERATE) {
+        trips = floor(creal(hi->value));
+    } else {
+        if (TYPE_MASK(lo->type) != TX_CONSTANT) return 1;
+        trips = floor(creal(hi->value) - creal(lo->value)) + 1;
+    }
+    return trips >= 0 && trips <= LOOP_MAX_TRIPS ? trips : 0;
+}
+
+
+static double stats_walk(const tx_expr *n, int depth, tx_expr_stats *s) {
+    /* Counts the subtree and returns its cost. */
+    const int arity = ARITY(n->type);
+    double cost = node_cost(n);
+    int i;
+
+    ++s->nodes;
+    if (depth > s->depth) s->depth = depth;
+    switch (TYPE_MASK(n->type)) {
+    case TX_CONSTANT: ++s->constants; break;
+    case TX_VARIABLE: ++s->variables; break;
+    default:
+        if (is_loop(n)) ++s->loops;
+        else if (IS_CLOSURE(n->type)) ++s->closures;
+        else if (infix_op(n) >= 0) ++s->operators;
+        else ++s->functions;
+        break;
+    }
+
+    for (i = 0; i < arity; ++i) cost += stats_walk(n->parameters[i], depth + 1, s);
+    if (is_loop(n)) {
+        const loop *l = n->parameters[arity];
+        const double body = stats_walk(l->body, depth + 1, s);
+        for (i = 0; i < l->powers; ++i) cost += stats_walk(l->bases[i], depth + 1, s) + 50;
+        cost += loop_trips(n) * (body + 1 + 4 * l->powers);
+    }
+    return cost;
+}
+
+
+static void stats_count(lowering *l, const tx_expr *n, int *index, tx_expr_stats *s) {
+    /* As lower_count, noting the repeated occurrences it skips. */
+    const int at = (*index)++;
+    const int arity = ARITY(n->type);
+    cse_class *c = l->classes + l->ids[at];
+    int i;
+
+    if (c->uses++ && c->shared) {
+        if (arity > 0) {
+            if (c->uses == 2) ++s->shared;
+            s->repeated += l->sizes[at];
+        }
+        *index = at + l->sizes[at];
+        return;
+    }
+    for (i = 0; i < arity; ++i) stats_count(l, n->parameters[i], index, s);
+}
+
+
+void tx_stats(const tx_expr *n, tx_expr_stats *stats) {
+    if (!stats) return;
+    memset(stats, 0, sizeof(tx_expr_stats));
+    if (!n) return;
+
+    stats->cost = stats_walk(n, 1, stats);
+    stats->bytes = packed_size(n);
+
+    const int nodes = node_count(n);
+    unsigned table_size = 1;
+    while (table_size < 2u * nodes) table_size *= 2;
+
+    lowering l;
+    memset(&l, 0, sizeof(l));
+    l.ids = malloc(sizeof(int) * nodes);
+    l.sizes = malloc(sizeof(int) * nodes);
+    l.classes = malloc(sizeof(cse_class) * nodes);
+    l.table = malloc(sizeof(int) * table_size);
+    l.table_mask = table_size - 1;
+    if (l.ids && l.sizes && l.classes && l.table) {
+        int index = 0;
+        memset(l.table, -1, sizeof(int) * table_size);
+        lower_classify(&l, n, &index);
+        index = 0;
+        stats_count(&l, n, &index, stats);
+        stats->unique = l.class_count;
+    }
+
+    free(l.ids);
+    free(l.sizes);
+    free(l.classes);
+    free(l.table);
+}
+
+
+void tx_alloc_get_stats(tx_alloc_stats *stats) {
+    if (!stats) return;
+#if defined(TX_ENABLE_ALLOC_STATS)
+    stats->nodes = ALLOC_READ(nodes);
+    stats->node_bytes = ALLOC_READ(node_bytes);
+    stats->heap_nodes = ALLOC_READ(heap_nodes);
+    stats->arena_blocks = ALLOC_READ(arena_blocks);
+    stats->arena_bytes = ALLOC_READ(arena_bytes);
+    stats->packed_trees = ALLOC_READ(packed_trees);
+    stats->packed_bytes = ALLOC_READ(packed_bytes);
+#else
+    memset(stats, 0, sizeof(tx_alloc_stats));
+#endif
+}
+
+
+void tx_alloc_reset_stats(void) {
+#if defined(TX_ENABLE_ALLOC_STATS)
+    ALLOC_CLEAR(nodes);
+    ALLOC_CLEAR(node_bytes);
+    ALLOC_CLEAR(heap_nodes);
+    ALLOC_CLEAR(arena_blocks);
+    ALLOC_CLEAR(arena_bytes);
+    ALLOC_CLEAR(packed_trees);
+    ALLOC_CLEAR(packed_bytes);
+#endif
+}
+
+
+/* Profiling. With TX_ENABLE_PROFILE, tx_eval_profile walks the tree like
+ * tx_eval and charges calls and clock ticks to each node by its pre-order
+ * index. Without it the entry points do nothing, and tx_eval is the same
+ * either way. */
+#if defined(TX_ENABLE_PROFILE)
+
+struct tx_profile {
+    const tx_expr *root;
+    int nodes;
+    int *sizes;
+    unsigned long long *calls;
+    unsigned long long *ticks;
+};
+
+
+static unsigned long long profile_ticks(void) {
+    /* Cycles where the time stamp counter is at hand, nanoseconds otherwise. */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    return __builtin_ia32_rdtsc();
+#elif defined(CLOCK_MONOTONIC)
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (unsigned long long)t.tv_sec * 1000000000ull + t.tv_nsec;
+#else
+    return (unsigned long long)clock() * (1000000000ull / CLOCKS_PER_SEC);
+#endif
+}
+
+
+static int profile_sizes(const tx_expr *n, int *sizes, int index) {
+    /* Fills in subtree sizes in pre-order and returns the size at index. */
+    const int arity = ARITY(n->type);
+    int size = 1;
+    int i;
+    for (i = 0; i < arity; ++i) size += profile_sizes(n->parameters[i], sizes, index + size);
+    sizes[index] = size;
+    return size;
+}
+
+
+tx_profile *tx_profile_create(const tx_expr *n) {
+    CHECK_NULL(n);
+
+    const int nodes = node_count(n);
+    tx_profile *p = malloc(sizeof(tx_profile) + (sizeof(int) + 2 * sizeof(unsigned long long)) * nodes);
+    CHECK_NULL(p);
+
+    p->root = n;
+    p->nodes = nodes;
+    p->calls = (unsigned long long*)(p + 1);
+    p->ticks = p->calls + nodes;
+    p->sizes = (int*)(p->ticks + nodes);
+    profile_sizes(n, p->sizes, 0);
+    tx_profile_reset(p);
+    return p;
+}
+
+
+void tx_profile_reset(tx_profile *p) {
+    if (!p) return;
+    memset(p->calls, 0, sizeof(unsigned long long) * p->nodes);
+    memset(p->ticks, 0, sizeof(unsigned long long) * p->nodes);
+}
+
+
+void tx_profile_free(tx_profile *p) {
+    free(p);
+}
+
+
+static d_cx profile_eval(const tx_expr *n, tx_profile *p, int index) {
+    const unsigned long long start = profile_ticks();
+    const int arity = ARITY(n->type);
+    d_cx ret, a[6];
+    int i, child = index + 1;
+
+    switch (TYPE_MASK(n->type)) {
+    case TX_CONSTANT: ret = n->value; break;
+    case TX_VARIABLE: ret = *n->bound; break;
+    default:
+        for (i = 0; i < arity; ++i) {
+            a[i] = profile_eval(n->parameters[i], p, child);
+            child += p->sizes[child];
+        }
+        ret = call_node(n, a);
+        break;
+    }
+
+    ++p->calls[index];
+    p->ticks[index] += profile_ticks() - start;
+    return ret;
+}
+
+
+d_cx tx_eval_profile(const tx_expr *n, tx_profile *p) {
+    if (!p || p->root != n) return tx_eval(n);
+    return profile_eval(n, p, 0);
+}
+
+
+int tx_profile_node(const tx_profile *p, int index, unsigned long long *calls, unsigned long long *ticks,
+                    unsigned long long *self) {
+    if (!p || index < 0 || index >= p->nodes) return 0;
+
+    unsigned long long children = 0;
+    int child = index + 1;
+    while (child < index + p->sizes[index]) {
+        children += p->ticks[child];
+        child += p->sizes[child];
+    }
+    if (calls) *calls = p->calls[index];
+    if (ticks) *ticks = p->ticks[index];
+    if (self) *self = p->ticks[index] > children ? p->ticks[index] - children : 0;
+    return 1;
+}
+
+
+#else
+
+tx_profile *tx_profile_create(const tx_expr *n) {(void)n; return NULL;}
+void tx_profile_reset(tx_profile *p) {(void)p;}
+void tx_profile_free(tx_profile *p) {(void)p;}
+d_cx tx_eval_profile(const tx_expr *n, tx_profile *p) {(void)p; return tx_eval(n);}
+int tx_profile_node(const tx_profile *p, int index, unsigned long long *calls, unsigned long long *ticks,
+                    unsigned long long *self) {
+    (void)p; (void)index; (void)calls; (void)ticks; (void)self;
+    return 0;
+}
+
+#endif
+
+
+static void pn (const tx_expr *n, int depth, const tx_profile *p, int *index) {
+    int i, arity;
+
+#if defined(TX_ENABLE_PROFILE)
+    /* Share of the root's time spent in the node itself and below it, hot nodes starred. */
+    if (p) {
+        unsigned long long calls, ticks, self;
+        const double all = p->ticks[0] ? (double)p->ticks[0] : 1;
+        tx_profile_node(p, *index, &calls, &ticks, &self);
+        printf("%c%6.1f%% %6.1f%% %10llu  ", self >= all / 10 ? '*' : ' ', 100 * self / all, 100 * ticks / all, calls);
+    }
+#else
+    (void)p;
+#endif
+    ++*index;
+    printf("%*s", depth, "");
+
+    switch(TYPE_MASK(n->type)) {
+    case TX_CONSTANT: tx_print_num(&n->value); break;
+    case TX_VARIABLE: printf("bound %p\n", n->bound); break;
+
+    case TX_FUNCTION0: case TX_FUNCTION1: case TX_FUNCTION2: case TX_FUNCTION3:
+    case TX_FUNCTION4: case TX_FUNCTION5: case TX_FUNCTION6:
+    case TX_CLOSURE0: case TX_CLOSURE1: case TX_CLOSURE2: case TX_CLOSURE3:
+    case TX_CLOSURE4: case TX_CLOSURE5: case TX_CLOSURE6:
+        arity = ARITY(n->type);
+        printf("f%d", arity);
+        for(i = 0; i < arity; i++) {
+            printf(" %p", n->parameters[i]);
+        }
+        printf("\n");
+        for(i = 0; i < arity; i++) {
+            pn(n->parameters[i], depth + 1, p, index);
+        }
+        break;
+    }
+}
+
+
+void tx_print(const tx_expr *n) {
+    int index = 0;
+    pn(n, 0, 0, &index);
+}
+
+
+void tx_profile_print(const tx_profile *p) {
+#if defined(TX_ENABLE_PROFILE)
+    int index = 0;
+    if (!p) return;
+    printf("    self   total      calls\n");
+    pn(p->root, 0, p, &index);
+#else
+    (void)p;
+#endif
 }
 
 
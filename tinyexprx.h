@@ -12,11 +12,14 @@
 #ifndef TINYEXPRX_H
 #define TINYEXPRX_H
 
+#include <stddef.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 typedef double _Complex d_cx;
+typedef float _Complex f_cx;
 
 typedef struct tx_expr {
     int type;
@@ -34,7 +37,43 @@ enum {
     TX_CLOSURE0 = 16, TX_CLOSURE1, TX_CLOSURE2, TX_CLOSURE3,
     TX_CLOSURE4, TX_CLOSURE5, TX_CLOSURE6,
 
-    TX_FLAG_PURE = 32
+    TX_FLAG_PURE = 32,
+
+    /* Variables that only ever hold real values. Subtrees that are real */
+    /* as a result evaluate on doubles. */
+    TX_FLAG_REAL = 64,
+
+    /* Functions and closures called on whole arrays of points, as tx_array_fn. */
+    /* Functions get a NULL context. */
+    TX_FLAG_ARRAY = 128
+};
+
+/* Writes out[j] for the n points j, reading argument i of point j at args[i][j]. */
+typedef void (*tx_array_fn)(void *context, const d_cx *const *args, d_cx *out, size_t n);
+
+/* Rewrites done by tx_compile_ex on request. They may change results in the */
+/* last bits, or for infinities, NaNs and signed zeros. */
+enum {
+    TX_SIMPLIFY_IDENTITIES = 1,     /* x+0, x-0, 0-x, x*1, x*-1, x/1, x^1 and x^0. */
+    TX_SIMPLIFY_POWERS = 2,         /* Integer powers as multiply chains, x^0.5 as sqrt(x). */
+    TX_SIMPLIFY_RECIPROCAL = 4,     /* x/c as x*(1/c) for constant c. */
+    TX_SIMPLIFY_HORNER = 16,        /* Polynomials in one variable in Horner form with fused multiply-adds. */
+    TX_SIMPLIFY_ALL = 23
+};
+
+/* Parses with an explicit stack instead of recursion, reading length bytes with */
+/* no terminator needed. Numbers are scanned without the C locale. */
+enum {
+    TX_PARSE_ITERATIVE = 8
+};
+
+/* Swaps exp, log, pow and the trigonometric and hyperbolic built-ins for polynomial */
+/* approximations, vectorized in the batch evaluators. Results stay within 1e-12 of the */
+/* exact value relative to its magnitude, or within 1e-7 with TX_FAST_MATH_LOW, except pow(a, b), */
+/* whose bound of 1e-13 or 7.5e-9 grows with (1 + |b log a|) as the exact function's does. */
+enum {
+    TX_FAST_MATH = 32,
+    TX_FAST_MATH_LOW = 64
 };
 
 typedef struct tx_variable {
@@ -44,6 +83,92 @@ typedef struct tx_variable {
     void *context;
 } tx_variable;
 
+typedef struct tx_planes {
+    const double *re;
+    const double *im;
+} tx_planes;
+
+typedef struct tx_column {
+    const d_cx *address;    /* The variable the column feeds. */
+    int fd;                 /* Points as interleaved re/im doubles, read from the current offset. */
+} tx_column;
+
+typedef struct tx_box {
+    double re_lo, re_hi;
+    double im_lo, im_hi;
+} tx_box;
+
+typedef struct tx_arena tx_arena;
+typedef struct tx_symtab tx_symtab;
+typedef struct tx_compiler tx_compiler;
+
+typedef struct tx_options {
+    tx_arena *arena;
+    int flags;
+    const tx_symtab *symtab;    /* Used in place of the variables array when set. */
+    size_t length;              /* With TX_PARSE_ITERATIVE, the input length; 0 reads up to a NUL. */
+    int max_depth;              /* With TX_PARSE_ITERATIVE, the deepest tree or nesting accepted; 0 for 10000. */
+} tx_options;
+
+typedef struct tx_program tx_program;
+typedef struct tx_program_f tx_program_f;
+
+typedef struct tx_cache tx_cache;
+
+typedef struct tx_cache_stats {
+    size_t hits;
+    size_t misses;
+    size_t evictions;
+    int entries;
+    int capacity;
+} tx_cache_stats;
+
+typedef struct tx_expr_stats {
+    int nodes;          /* All nodes, loop bodies included. */
+    int constants;
+    int variables;
+    int operators;      /* Infix operators and negation. */
+    int functions;      /* Other built-in and user functions. */
+    int closures;
+    int loops;
+    int depth;          /* Nodes on the longest path from the root. */
+    size_t bytes;       /* Bytes the tree takes packed; separate heap nodes add allocator overhead. */
+    int unique;         /* Distinct subtrees, with identical pure ones counted once. */
+    int shared;         /* Distinct pure subtrees above the leaves that occur more than once. */
+    int repeated;       /* Nodes in their repeated occurrences, which bytecode evaluates once. */
+    double cost;        /* Estimated cost of one tx_eval, in complex additions. */
+} tx_expr_stats;
+
+typedef struct tx_alloc_stats {
+    size_t nodes;           /* Nodes created by compiles and rewrites. */
+    size_t node_bytes;
+    size_t heap_nodes;      /* Those of them given a malloc of their own. */
+    size_t arena_blocks;
+    size_t arena_bytes;
+    size_t packed_trees;    /* Single blocks written by tx_compile_ex and the cache. */
+    size_t packed_bytes;
+} tx_alloc_stats;
+
+typedef struct tx_profile tx_profile;
+
+typedef struct tx_incremental tx_incremental;
+
+typedef struct tx_jit tx_jit;
+typedef d_cx (*tx_jit_fn)(const d_cx *vars);
+
+typedef struct tx_gpu tx_gpu;
+
+typedef void (*tx_task)(void *arg, int worker);
+
+typedef struct tx_parallel {
+    int threads;    /* Number of workers, 0 for one per CPU. */
+    size_t grain;   /* Points per scheduled chunk, 0 for the default. */
+
+    /* Optional thread pool. Must call task(arg, w) once for every w < threads */
+    /* and return when all calls have returned. */
+    void (*run)(void *pool, int threads, tx_task task, void *arg);
+    void *pool;
+} tx_parallel;
 
 
 /* Parses the input expression, evaluates it, and frees it. */
@@ -54,12 +179,88 @@ d_cx tx_interp(const char *expression, int *error);
 /* Returns NULL on error. */
 tx_expr *tx_compile(const char *expression, const tx_variable *variables, int var_count, int *error);
 
+/* Same as tx_compile, with all nodes allocated in one go. */
+/* With options->arena set, the tree lives in that arena and is released with it. */
+/* Otherwise the tree is packed into a single heap block that is released with free(). */
+/* Neither may be passed to tx_free. Options may be NULL. */
+/* Options->flags selects TX_SIMPLIFY_* rewrites, and options->symtab replaces variables. */
+tx_expr *tx_compile_ex(const char *expression, const tx_variable *variables, int var_count,
+                       const tx_options *options, int *error);
+
+/* Builds a hashed symbol table that can be shared by any number of compiles. */
+/* The entries are copied, the names they point to are not. Returns NULL on error. */
+tx_symtab *tx_symtab_create(const tx_variable *variables, int var_count);
+
+/* Frees the symbol table. */
+/* This is safe to call on NULL pointers. */
+void tx_symtab_free(tx_symtab *t);
+
+/* Creates a compiler owning a copy of the variable array, an arena and parser scratch. */
+/* The names, addresses and contexts the entries point to are not copied and must outlive it. */
+/* Compilers share nothing else, so each thread may compile through its own without contention. */
+/* Returns NULL on error. */
+tx_compiler *tx_compiler_create(const tx_variable *variables, int var_count);
+
+/* Same as tx_compile_ex into the compiler's arena, reusing its memory from earlier calls. */
+/* The arena and symtab of options, which may be NULL, are ignored. The tree is released */
+/* by tx_compiler_reset or tx_compiler_free. Returns NULL on error. */
+tx_expr *tx_compiler_compile(tx_compiler *c, const char *expression, const tx_options *options, int *error);
+
+/* Releases all trees compiled with c, keeping its memory for reuse. */
+void tx_compiler_reset(tx_compiler *c);
+
+/* This is safe to call on NULL pointers. */
+void tx_compiler_free(tx_compiler *c);
+
+/* Creates a bump arena that allocates block_size bytes at a time (0 is the default). */
+/* Returns NULL on error. */
+tx_arena *tx_arena_create(size_t block_size);
+
+/* Releases all trees compiled into the arena, keeping its blocks for reuse. */
+void tx_arena_reset(tx_arena *a);
+
+/* Frees the arena and all trees compiled into it. */
+/* This is safe to call on NULL pointers. */
+void tx_arena_free(tx_arena *a);
+
 /* Evaluates the expression. */
+/* Evaluation never modifies the tree, so one tree may be evaluated from many threads at once. */
 d_cx tx_eval(const tx_expr *n);
 
 /* Prints debugging information on the syntax tree. */
 void tx_print(const tx_expr *n);
 
+/* Fills in stats on the size, shape and cost of n. Loop bodies count towards everything */
+/* but the sharing, which follows the bytecode lowering. */
+void tx_stats(const tx_expr *n, tx_expr_stats *stats);
+
+/* Gets or clears the allocation counters shared by all threads, which are only kept with */
+/* TX_ENABLE_ALLOC_STATS and read as zeros otherwise. Each counter is atomic with GCC or Clang. */
+void tx_alloc_get_stats(tx_alloc_stats *stats);
+void tx_alloc_reset_stats(void);
+
+/* Profiling is only built with TX_ENABLE_PROFILE; otherwise tx_profile_create returns NULL */
+/* and tx_eval_profile is tx_eval. */
+/* Creates counters for each node of n, indexed in pre-order from the root at 0. */
+/* Returns NULL on error. */
+tx_profile *tx_profile_create(const tx_expr *n);
+
+/* Evaluates n, which must be the tree p was created for, recording calls and ticks per node. */
+d_cx tx_eval_profile(const tx_expr *n, tx_profile *p);
+
+/* Gets a node's calls and ticks, with and without its children. Ticks are cycles on x86 and */
+/* nanoseconds elsewhere. Returns 0 when index is out of range. */
+int tx_profile_node(const tx_profile *p, int index, unsigned long long *calls, unsigned long long *ticks,
+                    unsigned long long *self);
+
+/* Prints the tree as tx_print does, each node led by its share of the time. */
+void tx_profile_print(const tx_profile *p);
+
+void tx_profile_reset(tx_profile *p);
+
+/* This is safe to call on NULL pointers. */
+void tx_profile_free(tx_profile *p);
+
 /* Prints d_cx number. */
 void tx_print_num(const d_cx *n);
 
@@ -67,6 +268,173 @@ void tx_print_num(const d_cx *n);
 /* This is safe to call on NULL pointers. */
 void tx_free(tx_expr *n);
 
+/* Evaluates the expression at len points and writes the results to out. */
+/* Each stream binds the variable at address to an array of len inputs passed as context. */
+/* Variables without a stream keep their bound value. Writes NaN on error. */
+void tx_eval_batch(const tx_expr *n, const tx_variable *streams, int stream_count, size_t len, d_cx *out);
+
+/* Same as tx_eval_batch, with the points split across threads. Parallel may be NULL. */
+/* Without a run callback the threads come from the built-in backend, which is compiled in */
+/* with TX_USE_PTHREADS or TX_USE_C11_THREADS; otherwise evaluation stays on the calling thread. */
+void tx_eval_batch_parallel(const tx_expr *n, const tx_variable *streams, int stream_count, size_t len,
+                            d_cx *out, const tx_parallel *parallel);
+
+/* Same as tx_eval_batch, with inputs and outputs split into real and imaginary planes. */
+/* Each stream context points to a tx_planes holding the len inputs of its variable. */
+void tx_eval_batch_soa(const tx_expr *n, const tx_variable *streams, int stream_count, size_t len,
+                       double *out_re, double *out_im);
+
+/* Evaluates n over columns read from files or pipes until the shortest ends, writing each */
+/* result to out_fd as a d_cx. Regular files are mapped and read in place; other inputs are */
+/* read ahead on a second thread with a thread backend. At most chunk points (0 for the */
+/* default) are held per column. Returns the points written, or -1 on error or outside POSIX. */
+/* It returns once the shortest column ends without blocking on the others: pipes are never */
+/* read past the shortest file, but may be read up to two chunks past a pipe that ended first. */
+long long tx_eval_stream(const tx_expr *n, const tx_column *columns, int column_count, int out_fd, size_t chunk);
+
+/* Lowers the expression as tx_compile_program does, for evaluation in single precision. */
+/* Constants are rounded once here and built-ins call their float versions; user functions */
+/* are called with their arguments widened. Returns NULL on error. */
+tx_program_f *tx_compile_program_f(const tx_expr *n);
+
+/* Evaluates the program in single precision. */
+f_cx tx_program_eval_f(const tx_program_f *p);
+
+/* Same as tx_eval_batch in single precision. Each stream context points to len f_cx inputs. */
+void tx_program_eval_batch_f(const tx_program_f *p, const tx_variable *streams, int stream_count, size_t len,
+                             f_cx *out);
+
+/* Same as tx_program_eval_batch_f, lowering n for the one call. */
+void tx_eval_batch_f(const tx_expr *n, const tx_variable *streams, int stream_count, size_t len, f_cx *out);
+
+/* This is safe to call on NULL pointers. */
+void tx_program_free_f(tx_program_f *p);
+
+/* Lowers the expression into flat postfix bytecode. */
+/* Identical subtrees of pure functions are computed once per evaluation and reused. */
+/* The program keeps the variable bindings of the expression, which may be freed afterwards. */
+/* Returns NULL on error. */
+tx_program *tx_compile_program(const tx_expr *n);
+
+/* Lowers several expressions into one program with a value per root, in order. */
+/* Subtrees common to any of the roots are computed once per evaluation. */
+/* Returns NULL on error. */
+tx_program *tx_compile_program_many(const tx_expr *const *roots, int count);
+
+/* Parses the expressions and lowers them together with tx_compile_program_many. */
+/* Returns NULL on error, with error set as by tx_compile_ex for the first failing expression */
+/* and failed to its index, or to -1 when no expression failed. Either may be NULL. */
+tx_program *tx_compile_many(const char *const *expressions, int count, const tx_variable *variables, int var_count,
+                            const tx_options *options, int *failed, int *error);
+
+/* Evaluates the program. A program with several roots returns the value of the last. */
+d_cx tx_program_eval(const tx_program *p);
+
+/* Evaluates the program into out, which holds tx_program_outputs(p) values. */
+void tx_program_eval_many(const tx_program *p, d_cx *out);
+
+/* Returns the number of values the program produces. */
+int tx_program_outputs(const tx_program *p);
+
+/* Frees the program. */
+/* This is safe to call on NULL pointers. */
+void tx_program_free(tx_program *p);
+
+/* Writes the program as a position-independent image, which may be mapped from a file. */
+/* Variables and user functions are stored as indices into variables. */
+/* Returns the image size, and writes it only when it fits in size. Returns 0 when there is */
+/* something the table does not cover. */
+size_t tx_serialize(const tx_program *p, const tx_variable *variables, int var_count, void *buffer, size_t size);
+
+/* Loads an image written by tx_serialize against a table with the same layout, in one allocation. */
+/* Returns NULL on error, with error set to the failing instruction or -1 for a bad image. */
+tx_program *tx_deserialize(const void *data, size_t size, const tx_variable *variables, int var_count,
+                           int *error);
+
+/* Creates a cache holding up to capacity compiled expressions, least recently used out first. */
+/* Locking uses the thread backend selected at build time, or a spinlock with GCC atomics. */
+/* Returns NULL on error. */
+tx_cache *tx_cache_create(int capacity);
+
+/* Returns the shared tree for expression compiled against symtab, which may be NULL. */
+/* Every tree got must be given back with tx_cache_release, and never freed otherwise. */
+/* Returns NULL on error. */
+const tx_expr *tx_cache_get(tx_cache *c, const char *expression, const tx_symtab *symtab, int *error);
+void tx_cache_release(tx_cache *c, const tx_expr *n);
+
+/* Same as tx_interp, going through the cache. */
+d_cx tx_cache_interp(tx_cache *c, const char *expression, const tx_symtab *symtab, int *error);
+
+void tx_cache_get_stats(tx_cache *c, tx_cache_stats *stats);
+
+/* Frees the cache and all its entries, which must no longer be held. */
+/* This is safe to call on NULL pointers. */
+void tx_cache_free(tx_cache *c);
+
+/* Builds the derivative of n with respect to the variable bound to wrt, freed with tx_free. */
+/* Returns NULL on error, or where a user or non-holomorphic function depends on wrt. */
+tx_expr *tx_derive(const tx_expr *n, const d_cx *wrt);
+
+/* Copies n with the variables bound to the count addresses in frozen replaced by their */
+/* current values, then folds and simplifies again. The copy is freed with tx_free. */
+/* Returns NULL on error. */
+tx_expr *tx_specialize(const tx_expr *n, const d_cx *const *frozen, int count);
+
+/* Evaluates n together with its partial derivatives for each of the variables, in one pass. */
+/* Partials that do not exist are NaN. */
+d_cx tx_eval_dual(const tx_expr *n, const tx_variable *variables, int var_count, d_cx *partials);
+
+/* Creates an evaluator that keeps the last value of each node of n, which must outlive it. */
+/* Everything is dirty to begin with. Returns NULL on error. */
+tx_incremental *tx_incremental_create(const tx_expr *n);
+
+/* Notes that the variable bound to variable has changed; NULL marks every variable. */
+void tx_mark_dirty(tx_incremental *inc, const d_cx *variable);
+
+/* Evaluates n, recomputing only nodes that depend on dirty variables or on impure */
+/* functions and closures, which are always recomputed. */
+d_cx tx_eval_incremental(tx_incremental *inc);
+
+/* This is safe to call on NULL pointers. */
+void tx_incremental_free(tx_incremental *inc);
+
+/* Bounds the values of n while each variable bound to boxes[i].address ranges over the */
+/* tx_box its context points to. Other variables keep their bound value. Calls without a */
+/* built-in enclosure give the whole plane unless all their arguments are single points. */
+tx_box tx_eval_box(const tx_expr *n, const tx_variable *boxes, int box_count);
+
+/* Compiles the expression to native code where supported (x86-64 outside Windows, unless TX_NO_JIT). */
+/* Variables bound to variables[i].address read vars[i] at call time, others their bound address. */
+/* Returns NULL on error. */
+tx_jit *tx_jit_compile(const tx_expr *n, const tx_variable *variables, int var_count);
+
+/* Returns the native entry point, or NULL where code could not be generated. */
+tx_jit_fn tx_jit_function(const tx_jit *j);
+
+/* Evaluates natively when possible, and with the bytecode interpreter otherwise. */
+d_cx tx_jit_eval(const tx_jit *j, const d_cx *vars);
+
+/* Frees the compiled code. */
+/* This is safe to call on NULL pointers. */
+void tx_jit_free(tx_jit *j);
+
+
+/* Opens the first OpenCL GPU with double precision, or failing that any device with it. */
+/* OpenCL is loaded at run time. Returns NULL when there is none, or without TX_ENABLE_OPENCL. */
+tx_gpu *tx_gpu_create(void);
+
+/* Writes the OpenCL C source of the kernel that evaluates n over the streams, when it fits */
+/* in size with a NUL. Returns its length, or 0 where n holds closures, user functions or loops. */
+size_t tx_gpu_source(const tx_expr *n, const tx_variable *streams, int stream_count, char *buffer, size_t size);
+
+/* Same as tx_eval_batch, on the device. Kernels are built once per source and kept by its hash. */
+/* Returns 1 when the points were evaluated on the device, or 0 when they went to tx_eval_batch, */
+/* as they do with g NULL or where tx_gpu_source gives 0. Use a tx_gpu from one thread at a time. */
+int tx_gpu_eval_batch(tx_gpu *g, const tx_expr *n, const tx_variable *streams, int stream_count, size_t len,
+                      d_cx *out);
+
+/* This is safe to call on NULL pointers. */
+void tx_gpu_free(tx_gpu *g);
 
 #ifdef __cplusplus
 }